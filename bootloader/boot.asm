@@ -21,6 +21,31 @@ mov si, dap_read_2
 int 0x13
 jc disk_error
 
+; --- Collect the INT 15h E820 memory map ---
+; 0x6000: dword entry count, entries of 24 bytes from 0x6008 (max 128).
+; The ACPI attribute dword is preset to 1 so 20-byte entries count as valid.
+mov di, 0x6008
+xor ebx, ebx
+xor bp, bp
+e820_next:
+mov dword [di + 20], 1
+mov eax, 0xE820
+mov ecx, 24
+mov edx, 0x534D4150             ; 'SMAP'
+int 0x15
+jc e820_done
+cmp eax, 0x534D4150
+jne e820_done
+inc bp
+add di, 24
+test ebx, ebx
+jz e820_done
+cmp bp, 128
+jb e820_next
+e820_done:
+movzx eax, bp
+mov [0x6000], eax
+
 ; set up VESA mode info
 mov ax, 0x0000
 mov es, ax
@@ -126,7 +151,8 @@ disk_error:
     hlt
     jmp .hang
 
-; INT 13h AH=42h Disk Address Packets
+; INT 13h AH=42h Disk Address Packets. Together they read 254 sectors of
+; kernel; the Makefile's KERNEL_MAX_BYTES must match.
 ; packet layout:
 ;   db size(16), db 0, dw sectors, dw offset, dw segment, dq lba
 dap_read_1:
@@ -0,0 +1,23 @@
+#include "bench.h"
+
+#if RUN_ANY_BENCH
+
+static void bench_putc(char c) {
+    __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)c), "Nd"((uint16_t)0xE9));
+}
+
+void bench_puts(const char *s) {
+    while (*s) bench_putc(*s++);
+}
+
+void bench_putu(uint64_t n) {
+    char buf[21];
+    int i = 0;
+    do {
+        buf[i++] = (char)('0' + (n % 10));
+        n /= 10;
+    } while (n);
+    while (i > 0) bench_putc(buf[--i]);
+}
+
+#endif
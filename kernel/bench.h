@@ -0,0 +1,25 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// Boot-time microbenchmarks. Each is compiled in only when its switch is
+// set to 1 (here or with -D); results go to the QEMU debug console (port
+// 0xE9, -debugcon stdio).
+
+#ifndef RUN_PMM_BENCH
+#define RUN_PMM_BENCH 0
+#endif
+#ifndef RUN_PAGING_BENCH
+#define RUN_PAGING_BENCH 0
+#endif
+#ifndef RUN_KLIB_BENCH
+#define RUN_KLIB_BENCH 0
+#endif
+
+#define RUN_ANY_BENCH (RUN_PMM_BENCH || RUN_PAGING_BENCH || RUN_KLIB_BENCH)
+
+void bench_puts(const char *s);
+void bench_putu(uint64_t n);
+
+#endif
@@ -1,4 +1,5 @@
 #include "framebuffer.h"
+#include "../klib.h"
 static uint8_t *fb;
 static uint16_t width;
 static uint16_t height;
@@ -54,22 +55,7 @@ uint64_t fb_base_addr(void){
 }
 void fb_present_buffer(const void *src, uint64_t size){
     if (!fb || !src || size == 0) return;
-    uint64_t qwords = size / 8;
-    const void *s = src;
-    void *d = (void *)fb;
-    __asm__ volatile (
-        "rep movsq"
-        : "+S"(s), "+D"(d), "+c"(qwords)
-        :
-        : "memory"
-    );
-    // Copy remaining bytes
-    uint64_t rem = size & 7;
-    if (rem) {
-        const uint8_t *sb = (const uint8_t *)s;
-        uint8_t *db = (uint8_t *)d;
-        for (uint64_t i = 0; i < rem; i++) db[i] = sb[i];
-    }
+    memcpy(fb, src, size);
 }
 
 void fb_present_buffer_rect(const void *src, int x, int y, int w, int h){
@@ -106,24 +92,7 @@ void fb_present_buffer_rect(const void *src, int x, int y, int w, int h){
     uint8_t *drow = fb + ((uint64_t)cy * stride) + ((uint64_t)cx * (uint64_t)bytes_per_pixel);
 
     for (int row = 0; row < ch; row++) {
-        uint64_t qwords = row_bytes / 8;
-        const void *s = srow;
-        void *d = drow;
-
-        __asm__ volatile (
-            "rep movsq"
-            : "+S"(s), "+D"(d), "+c"(qwords)
-            :
-            : "memory"
-        );
-
-        uint64_t rem = row_bytes & 7;
-        if (rem) {
-            const uint8_t *sb = (const uint8_t *)s;
-            uint8_t *db = (uint8_t *)d;
-            for (uint64_t i = 0; i < rem; i++) db[i] = sb[i];
-        }
-
+        memcpy(drow, srow, row_bytes);
         srow += stride;
         drow += stride;
     }
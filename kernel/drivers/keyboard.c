@@ -2,6 +2,7 @@
 #include "../sched.h"
 #include "../syscall.h"
 #include "../tty.h"
+#include "../x86.h"
 
 // Circular buffer for key events
 #define KEY_BUFFER_SIZE 64
@@ -9,6 +10,9 @@ static struct key_event key_buffer[KEY_BUFFER_SIZE];
 static volatile int key_read_idx = 0;
 static volatile int key_write_idx = 0;
 
+// Tasks blocked in keyboard_get_event / keyboard_read
+static struct wait_queue key_wait;
+
 // Modifier state
 static volatile uint8_t mod_state = 0;
 static volatile int extended = 0;
@@ -191,6 +195,7 @@ void keyboard_handle_scancode(uint8_t scancode) {
     if (next_write != key_read_idx) {
         key_buffer[key_write_idx] = event;
         key_write_idx = next_write;
+        sched_wake_all(&key_wait);
     }
 }
 
@@ -199,10 +204,10 @@ int keyboard_has_event(void) {
 }
 
 struct key_event keyboard_get_event(void) {
-    // Wait for event
-    while (!keyboard_has_event()) {
-        __asm__ volatile ("hlt");
-    }
+    // Sleep until the IRQ queues an event
+    uint64_t flags = irq_save();
+    while (!keyboard_has_event()) sched_sleep_on(&key_wait);
+    irq_restore(flags);
 
     struct key_event event = key_buffer[key_read_idx];
     key_read_idx = (key_read_idx + 1) % KEY_BUFFER_SIZE;
@@ -244,6 +249,19 @@ char keyboard_getchar(uint8_t *modifiers) {
     }
 }
 
+int keyboard_read(char *buf, int count) {
+    if (count <= 0) return 0;
+    int n = 0;
+    while (n == 0) {
+        struct key_event event = keyboard_get_event();
+        if (event.key < 0x80) buf[n++] = (char)event.key;
+        while (n < count && keyboard_poll_event(&event)) {
+            if (event.key < 0x80) buf[n++] = (char)event.key;
+        }
+    }
+    return n;
+}
+
 uint8_t keyboard_get_modifiers(void) {
     return mod_state;
 }
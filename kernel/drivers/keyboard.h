@@ -60,6 +60,10 @@ int keyboard_poll_event(struct key_event *event);
 // Returns the ASCII char, or 0 for non-printable keys
 // Fills modifiers if not NULL
 char keyboard_getchar(uint8_t *modifiers);
+
+// Read up to count characters for a console read(): blocks until at least
+// one arrives, then takes whatever else is queued. Special keys are dropped.
+int keyboard_read(char *buf, int count);
 uint8_t keyboard_get_modifiers(void);
 
 #endif
@@ -2,6 +2,8 @@
 #include "pci.h"
 #include "mouse.h"
 #include "../pmm.h"
+#include "../paging.h"
+#include "../timer.h"
 #include <stdint.h>
 
 /* ---------- Port I/O helpers ---------- */
@@ -161,7 +163,12 @@ struct usb_setup {
 static uint16_t io_base;
 static int uhci_active = 0;
 
-/* Bump allocator for DMA-accessible structures (identity-mapped) */
+/* Bump allocator for DMA-accessible structures (direct-mapped; the
+ * controller is given dma_phys() addresses).
+ * Each pool is one physically contiguous buddy block; when it runs out a
+ * fresh block is started, so no allocation ever straddles two blocks. */
+#define DMA_POOL_ORDER 2
+#define DMA_POOL_SIZE  (4096 << DMA_POOL_ORDER)
 static uint8_t *dma_pool;
 static int dma_pool_offset;
 static int dma_pool_size;
@@ -193,21 +200,32 @@ static uint8_t *mouse_buf;
 
 /* ---------- DMA Allocator ---------- */
 
+/* UHCI takes 32-bit bus addresses: memory it reads or writes must end
+ * at or below 4 GiB. */
+static int dma_reachable(void *block, uint64_t size) {
+    return (uint64_t)block + size <= 0x100000000ULL;
+}
+
 static void dma_init(void) {
-    void *page = pmm_alloc_page();
-    if (!page) return;
-    dma_pool = (uint8_t *)page;
+    void *block = pmm_alloc_pages(DMA_POOL_ORDER);
+    dma_pool = 0;
+    if (block && !dma_reachable(block, DMA_POOL_SIZE)) {
+        pmm_free_pages(block, DMA_POOL_ORDER);
+        block = 0;
+    }
+    if (block) {
+        pmm_set_owner(block, PMM_OWNER_DMA);
+        dma_pool = (uint8_t *)phys_to_virt((uint64_t)block);
+    }
     dma_pool_offset = 0;
-    dma_pool_size = 4096;
+    dma_pool_size = dma_pool ? DMA_POOL_SIZE : 0;
 }
 
 static void *dma_alloc(int size, int align) {
-    /* Grow pool if needed */
-    while (dma_pool_offset + size + align > dma_pool_size) {
-        void *page = pmm_alloc_page();
-        if (!page) return (void *)0;
-        /* Only works if pages are contiguous — just extend */
-        dma_pool_size += 4096;
+    if (size + align > DMA_POOL_SIZE) return (void *)0;
+    if (dma_pool_offset + size + align > dma_pool_size) {
+        dma_init();
+        if (!dma_pool) return (void *)0;
     }
     int off = dma_pool_offset;
     if (align > 1) {
@@ -234,12 +252,17 @@ static void reset_td_pool(void) {
     td_pool_used = 0;
 }
 
+/* Bus address of DMA memory; dma_init only keeps pools below 4 GiB. */
+static uint32_t dma_phys(const void *p) {
+    return (uint32_t)virt_to_phys(p);
+}
+
 static uint32_t td_phys(struct uhci_td *td) {
-    return (uint32_t)(uint64_t)td;
+    return dma_phys(td);
 }
 
 static uint32_t qh_phys(struct uhci_qh *qh) {
-    return (uint32_t)(uint64_t)qh;
+    return dma_phys(qh);
 }
 
 /* ---------- UHCI register access ---------- */
@@ -288,7 +311,7 @@ static int uhci_control_transfer(uint8_t addr, struct usb_setup *setup,
     if (!setup_td) return -1;
     setup_td->ctrl_status = TD_STATUS_ACTIVE | ls_bit | (3u << TD_CERR_SHIFT);
     setup_td->token = TD_TOKEN(TD_PID_SETUP, addr, 0, 0, 8);
-    setup_td->buffer = (uint32_t)(uint64_t)setup_buf;
+    setup_td->buffer = dma_phys(setup_buf);
 
     /* DATA TDs */
     struct uhci_td *prev = setup_td;
@@ -304,7 +327,7 @@ static int uhci_control_transfer(uint8_t addr, struct usb_setup *setup,
         dtd->ctrl_status = TD_STATUS_ACTIVE | ls_bit | (3u << TD_CERR_SHIFT);
         if (dir_in) dtd->ctrl_status |= TD_STATUS_SPD;
         dtd->token = TD_TOKEN(data_pid, addr, 0, toggle, pkt_len);
-        dtd->buffer = (uint32_t)(uint64_t)(data_buf + offset);
+        dtd->buffer = dma_phys(data_buf + offset);
 
         prev->link = td_phys(dtd) | TD_LINK_DEPTH;
         prev = dtd;
@@ -564,6 +587,15 @@ static void uhci_enumerate_port(uint16_t port_reg) {
 
 /* ---------- Mouse Interrupt Polling Setup ---------- */
 
+/* Interrupt transfers are polled, not signalled */
+#define POLL_NS 10000000ULL
+static struct ktimer poll_timer;
+
+static void poll_timer_fn(struct ktimer *t) {
+    uhci_poll();
+    ktimer_add(t, timer_now_ns() + POLL_NS);
+}
+
 static void setup_mouse_polling(void) {
     mouse_buf = (uint8_t *)dma_alloc(8, 16);
     if (!mouse_buf) {
@@ -584,10 +616,13 @@ static void setup_mouse_polling(void) {
     mouse_td->ctrl_status = TD_STATUS_ACTIVE | ls_bit | (3u << TD_CERR_SHIFT);
     mouse_td->token = TD_TOKEN(TD_PID_IN, mouse_addr, mouse_endp, mouse_data_toggle,
                                mouse_max_pkt > 8 ? 8 : mouse_max_pkt);
-    mouse_td->buffer = (uint32_t)(uint64_t)mouse_buf;
+    mouse_td->buffer = dma_phys(mouse_buf);
 
     /* Insert into interrupt QH */
     intr_qh->element = td_phys(mouse_td);
+
+    ktimer_init(&poll_timer, poll_timer_fn);
+    ktimer_add(&poll_timer, timer_now_ns() + POLL_NS);
 }
 
 /* ---------- Public API ---------- */
@@ -635,8 +670,14 @@ void uhci_init(void) {
     td_pool_used = 0;
 
     /* Allocate frame list (4KB aligned, 1024 entries) */
-    frame_list = (uint32_t *)pmm_alloc_page();
-    if (!frame_list) return;
+    void *fl = pmm_alloc_page();
+    if (fl && !dma_reachable(fl, 4096)) {
+        pmm_free_page(fl);
+        fl = 0;
+    }
+    if (!fl) return;
+    pmm_set_owner(fl, PMM_OWNER_DMA);
+    frame_list = (uint32_t *)phys_to_virt((uint64_t)fl);
 
     /* Allocate QHs */
     ctrl_qh = (struct uhci_qh *)dma_alloc(sizeof(struct uhci_qh), 16);
@@ -655,7 +696,7 @@ void uhci_init(void) {
     }
 
     /* Program HC registers */
-    uhci_write32(UHCI_FLBASEADD, (uint32_t)(uint64_t)frame_list);
+    uhci_write32(UHCI_FLBASEADD, dma_phys(frame_list));
     uhci_write16(UHCI_FRNUM, 0);
     uhci_write16(UHCI_INTR, 0); /* No interrupts — we poll */
     uhci_write16(UHCI_STS, 0xFFFF); /* Clear any pending status */
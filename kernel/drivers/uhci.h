@@ -5,7 +5,8 @@
 // If no UHCI controller is found, returns silently (PS/2 fallback).
 void uhci_init(void);
 
-// Poll UHCI for completed transfers. Call from timer IRQ.
+// Poll UHCI for completed transfers. Runs every 10 ms from the driver's
+// own kernel timer once a HID device is attached.
 void uhci_poll(void);
 
 #endif
@@ -2,6 +2,7 @@
 #include "syscall.h"
 #include "paging.h"
 #include "pmm.h"
+#include "klib.h"
 #include "console.h"
 
 // Minimal ELF64 loader for PHOBOS with user-mode execution.
@@ -10,20 +11,6 @@
 // - User programs run in ring 3 via iretq; syscalls return via SYS_EXIT.
 // - No dynamic linking; only ET_EXEC static binaries are supported.
 
-// Simple local helpers (freestanding, no libc)
-static void *memcpy_local(void *dst, const void *src, uint32_t n) {
-    uint8_t *d = (uint8_t *)dst;
-    const uint8_t *s = (const uint8_t *)src;
-    while (n--) *d++ = *s++;
-    return dst;
-}
-
-static void *memset_local(void *dst, int val, uint32_t n) {
-    uint8_t *d = (uint8_t *)dst;
-    while (n--) *d++ = (uint8_t)val;
-    return dst;
-}
-
 // ============================================================================
 // User mode support: setjmp/longjmp style context for returning from user mode
 // ============================================================================
@@ -116,9 +103,9 @@ typedef struct {
 // Loader workspace: staging buffer to read ELF files before mapping segments.
 // Allocated from PMM (above 1MB) to avoid ROM area conflicts.
 #define ELF_MAX_SIZE (512 * 1024)
-#define ELF_FILE_PAGES (ELF_MAX_SIZE / 4096)
+#define ELF_FILE_ORDER 7   // 2^7 pages = ELF_MAX_SIZE
 #define ELF_STACK_SIZE (16 * 1024)
-#define ELF_STACK_PAGES (ELF_STACK_SIZE / 4096)
+#define ELF_STACK_ORDER 2  // 2^2 pages = ELF_STACK_SIZE
 
 static uint8_t *elf_file_buf = 0;
 static uint8_t *elf_stack = 0;
@@ -128,19 +115,16 @@ static int elf_loader_initialized = 0;
 static int elf_loader_init(void) {
     if (elf_loader_initialized) return 0;
 
-    // Allocate file buffer (512KB = 128 pages)
-    elf_file_buf = (uint8_t *)pmm_alloc_page();
-    if (!elf_file_buf) return -1;
-    for (int i = 1; i < ELF_FILE_PAGES; i++) {
-        if (!pmm_alloc_page()) return -1;  // Contiguous allocation
-    }
+    // File buffer and stack are each one contiguous buddy block. The file
+    // buffer is kernel-only and used through the direct map; the stack is
+    // run on by user code on the kernel page tables, so it stays at its
+    // identity address.
+    void *file_buf = pmm_alloc_pages(ELF_FILE_ORDER);
+    if (!file_buf) return -1;
+    elf_file_buf = (uint8_t *)phys_to_virt((uint64_t)file_buf);
 
-    // Allocate stack (16KB = 4 pages)
-    elf_stack = (uint8_t *)pmm_alloc_page();
+    elf_stack = (uint8_t *)pmm_alloc_pages(ELF_STACK_ORDER);
     if (!elf_stack) return -1;
-    for (int i = 1; i < ELF_STACK_PAGES; i++) {
-        if (!pmm_alloc_page()) return -1;
-    }
 
     elf_loader_initialized = 1;
     return 0;
@@ -209,13 +193,13 @@ static int load_segments(const Elf64_Ehdr *eh) {
 
         // Copy file-backed portion
         if (ph->p_filesz > 0) {
-            memcpy_local(dst, src, (uint32_t)ph->p_filesz);
+            memcpy(dst, src, (uint32_t)ph->p_filesz);
         }
 
         // Zero bss part
         if (ph->p_memsz > ph->p_filesz) {
             uint64_t diff = ph->p_memsz - ph->p_filesz;
-            memset_local(dst + ph->p_filesz, 0, (uint32_t)diff);
+            memset(dst + ph->p_filesz, 0, (uint32_t)diff);
         }
 
         // Mark segment pages as user-accessible
@@ -257,7 +241,7 @@ static int jump_to_entry(uint64_t entry, char **args) {
         while (args[i][len]) len++;
         // include null terminator
         sp -= (len + 1);
-        memcpy_local(sp, args[i], (uint32_t)(len + 1));
+        memcpy(sp, args[i], (uint32_t)(len + 1));
         argv_ptrs[i] = (char *)sp;
     }
 
@@ -370,7 +354,22 @@ int elf_execute(struct vfs_node *node, char **args) {
 // Per-process ELF loading (new: allocates fresh pages, maps at p_vaddr)
 // ============================================================================
 
-static int load_segments_mapped(const Elf64_Ehdr *eh, uint64_t *user_pml4) {
+#define ELF_MAP_BATCH 64
+
+// Map a run of freshly loaded pages. On failure the unmapped frames are
+// released here; mapped ones go with the address space.
+static int map_run(uint64_t *user_pml4, uint64_t va, const uint64_t *frames, int n) {
+    uint64_t flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER | PAGE_USERALLOC;
+    if (paging_map_range(user_pml4, va, frames, 0, (uint64_t)n, flags) == 0) return 0;
+    for (int i = 0; i < n; i++) {
+        if (!paging_virt_to_phys(user_pml4, va + (uint64_t)i * 0x1000))
+            pmm_free_page((void *)frames[i]);
+    }
+    return -1;
+}
+
+static int load_segments_mapped(const Elf64_Ehdr *eh, uint64_t *user_pml4,
+                                struct vma **vmas) {
     const uint8_t *base = (const uint8_t *)eh;
     const uint8_t *ph_base = base + eh->e_phoff;
 
@@ -384,18 +383,18 @@ static int load_segments_mapped(const Elf64_Ehdr *eh, uint64_t *user_pml4) {
 
         if (memsz == 0) continue;
 
-        // For each page covered by this segment: allocate, copy, map
+        // The whole segment becomes an area; pages with no file data
+        // (.bss) are left for the page-fault handler.
         uint64_t seg_start = vaddr & ~0xFFFULL;
         uint64_t seg_end   = (vaddr + memsz + 0xFFFULL) & ~0xFFFULL;
+        if (!vma_add(vmas, seg_start, seg_end, VMA_WRITE)) return -22;
 
+        // For each page holding file data: allocate, copy, map. Fresh
+        // pages are mapped in runs of consecutive addresses.
+        uint64_t run[ELF_MAP_BATCH];
+        uint64_t run_va = 0;
+        int run_len = 0;
         for (uint64_t va = seg_start; va < seg_end; va += 0x1000) {
-            // Skip if already mapped (segments may share a page)
-            if (paging_virt_to_phys(user_pml4, va)) continue;
-
-            void *page = pmm_alloc_page();
-            if (!page) return -20;
-            memset_local(page, 0, 4096);
-
             // Copy the file-backed portion that falls in this page
             uint64_t file_start = vaddr;
             uint64_t file_end   = vaddr + filesz;
@@ -404,24 +403,44 @@ static int load_segments_mapped(const Elf64_Ehdr *eh, uint64_t *user_pml4) {
 
             uint64_t copy_lo = (pg_start > file_start) ? pg_start : file_start;
             uint64_t copy_hi = (pg_end   < file_end)   ? pg_end   : file_end;
+            if (copy_lo >= copy_hi) continue;
 
-            if (copy_lo < copy_hi) {
-                uint64_t src_off = copy_lo - vaddr;        // offset into segment data
-                uint64_t dst_off = copy_lo - va;           // offset into physical page
-                memcpy_local((uint8_t *)page + dst_off,
-                             base + ph->p_offset + src_off,
-                             (uint32_t)(copy_hi - copy_lo));
+            if (run_len && (run_len == ELF_MAP_BATCH ||
+                            va != run_va + (uint64_t)run_len * 0x1000)) {
+                if (map_run(user_pml4, run_va, run, run_len) < 0) return -21;
+                run_len = 0;
             }
 
-            uint64_t flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
-            if (paging_map_user_page(user_pml4, va, (uint64_t)page, flags) < 0)
-                return -21;
+            // Reuse the page if an earlier segment already mapped it
+            uint64_t pa = paging_virt_to_phys(user_pml4, va);
+            void *page = (void *)(pa & ~0xFFFULL);
+            int fresh = (pa == 0);
+            if (fresh) {
+                page = pmm_alloc_zeroed_page();
+                if (!page) {
+                    for (int k = 0; k < run_len; k++) pmm_free_page((void *)run[k]);
+                    return -20;
+                }
+                pmm_set_owner(page, PMM_OWNER_USER_ANON);
+            }
+
+            uint64_t src_off = copy_lo - vaddr;        // offset into segment data
+            uint64_t dst_off = copy_lo - va;           // offset into physical page
+            memcpy((uint8_t *)phys_to_virt((uint64_t)page) + dst_off,
+                         base + ph->p_offset + src_off,
+                         (uint32_t)(copy_hi - copy_lo));
+            if (!fresh) continue;
+
+            if (!run_len) run_va = va;
+            run[run_len++] = (uint64_t)page;
         }
+        if (run_len && map_run(user_pml4, run_va, run, run_len) < 0) return -21;
     }
     return 0;
 }
 
-int elf_load_into(struct vfs_node *node, uint64_t *user_pml4, uint64_t *entry_out) {
+int elf_load_into(struct vfs_node *node, uint64_t *user_pml4, struct vma **vmas,
+                  uint64_t *entry_out) {
     if (!node || !(node->flags & VFS_FILE)) return -10;
 
     if (elf_loader_init() < 0) {
@@ -449,7 +468,7 @@ int elf_load_into(struct vfs_node *node, uint64_t *user_pml4, uint64_t *entry_ou
         return hv;
     }
 
-    if (load_segments_mapped(eh, user_pml4) < 0) {
+    if (load_segments_mapped(eh, user_pml4, vmas) < 0) {
         print_str("exec: segment mapping failed\n");
         return -13;
     }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "fs/vfs.h"
+#include "vma.h"
 
 // Load and execute an ELF64 binary from a VFS node (legacy blocking path).
 // Returns the program's return value, or a negative error code on failure.
@@ -12,9 +13,11 @@ int elf_execute(struct vfs_node *node, char **args);
 int elf_load(struct vfs_node *node, uint64_t *entry_out);
 
 // Load an ELF64 binary into a per-process page table.
-// Allocates fresh physical pages for each segment and maps them at p_vaddr.
+// Pages holding file data are allocated and mapped at p_vaddr; each segment
+// is added to *vmas so the zero-filled rest (.bss) is faulted in on demand.
 // Returns 0 on success, <0 on error.  *entry_out receives the entry point VA.
-int elf_load_into(struct vfs_node *node, uint64_t *user_pml4, uint64_t *entry_out);
+int elf_load_into(struct vfs_node *node, uint64_t *user_pml4, struct vma **vmas,
+                  uint64_t *entry_out);
 
 // Called from syscalls to return from user mode to kernel
 void kernel_return_from_user(int exit_code);
@@ -0,0 +1,188 @@
+#include "fpu.h"
+#include "sched.h"
+#include "smp.h"
+#include "kmalloc.h"
+#include "klib.h"
+#include "x86.h"
+
+#define CR0_MP          (1ULL << 1)
+#define CR0_EM          (1ULL << 2)
+#define CR0_TS          (1ULL << 3)
+#define CR0_NE          (1ULL << 5)
+#define CR4_OSFXSR      (1ULL << 9)
+#define CR4_OSXMMEXCPT  (1ULL << 10)
+#define CR4_OSXSAVE     (1ULL << 18)
+
+#define XCR0_X87        (1ULL << 0)
+#define XCR0_SSE        (1ULL << 1)
+#define XCR0_AVX        (1ULL << 2)
+
+// Largest save area used: legacy region, XSAVE header and the AVX upper
+// halves come to 832 bytes. Wider state (AVX-512) is not enabled.
+#define FPU_AREA_MAX    1024
+
+#define MXCSR_DEFAULT   0x1F80      // all SIMD exceptions masked
+
+static int have_xsave = 0;
+static uint64_t xcr0 = 0;
+static uint32_t fpu_size = 512;     // FXSAVE area
+static struct kmem_cache *fpu_cache = 0;
+
+// State after fninit, copied into each task's area on its first use
+static uint8_t fpu_clean[FPU_AREA_MAX] __attribute__((aligned(64)));
+
+// Task whose registers each CPU holds (0 if none, or overwritten); they
+// are still current only if the task last loaded them on that CPU.
+static struct task *fpu_owner[MAX_CPUS];
+
+static inline uint64_t read_cr0(void) {
+    uint64_t v;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v) {
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline void clts(void) {
+    __asm__ volatile ("clts" : : : "memory");
+}
+
+static void fpu_save(void *area) {
+    if (have_xsave) {
+        __asm__ volatile ("xsave64 (%0)" : : "r"(area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+    } else {
+        __asm__ volatile ("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(const void *area) {
+    if (have_xsave) {
+        __asm__ volatile ("xrstor64 (%0)" : : "r"(area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+    } else {
+        __asm__ volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+// Enable the save instructions on this CPU and leave CR0.TS set, so the
+// first FPU instruction traps.
+static void cpu_setup(void) {
+    uint64_t cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (have_xsave) cr4 |= CR4_OSXSAVE;
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+
+    if (have_xsave) {
+        __asm__ volatile ("xsetbv" : : "c"(0), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)));
+    }
+
+    // MP: wait/fwait honour TS too. NE: x87 errors as #MF, not via the PIC.
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+}
+
+void fpu_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    have_xsave = (c >> 26) & 1;
+    int have_avx = (c >> 28) & 1;
+    if (have_xsave) {
+        cpuid(0xD, 0, &a, &b, &c, &d);
+        xcr0 = XCR0_X87 | XCR0_SSE;
+        if (have_avx && (a & XCR0_AVX)) xcr0 |= XCR0_AVX;
+    }
+    cpu_setup();
+
+    if (have_xsave) {
+        // EBX: area size for the features enabled in XCR0
+        cpuid(0xD, 0, &a, &b, &c, &d);
+        fpu_size = b;
+        if (fpu_size > FPU_AREA_MAX) {
+            xcr0 = XCR0_X87 | XCR0_SSE;
+            cpu_setup();
+            cpuid(0xD, 0, &a, &b, &c, &d);
+            fpu_size = b;
+        }
+    }
+    fpu_cache = kmem_cache_create("fpu_state", fpu_size, 64);
+
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    clts();
+    __asm__ volatile ("fninit; ldmxcsr %0" : : "m"(mxcsr));
+    fpu_save(fpu_clean);
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+void fpu_init_ap(void) {
+    cpu_setup();
+}
+
+int fpu_trap(struct task *t) {
+    int cpu = cpu_id();
+    clts();
+    // Nobody has used the registers here since t last did
+    if (fpu_owner[cpu] == t && t->fpu_cpu == cpu) return 0;
+
+    if (!t->fpu_state) {
+        t->fpu_state = fpu_cache ? kmem_cache_alloc(fpu_cache) : 0;
+        if (!t->fpu_state) {
+            write_cr0(read_cr0() | CR0_TS);
+            return -1;
+        }
+        memcpy(t->fpu_state, fpu_clean, fpu_size);
+    }
+    fpu_restore(t->fpu_state);
+    fpu_owner[cpu] = t;
+    t->fpu_cpu = cpu;
+    return 0;
+}
+
+void fpu_switch(struct task *prev) {
+    uint64_t cr0 = read_cr0();
+    // TS is clear only once prev has trapped in this slice
+    if (cr0 & CR0_TS) return;
+    if (prev->fpu_state) fpu_save(prev->fpu_state);
+    write_cr0(cr0 | CR0_TS);
+}
+
+int fpu_fork(struct task *child, struct task *parent) {
+    if (!parent->fpu_state) return 0;
+    child->fpu_state = kmem_cache_alloc(fpu_cache);
+    if (!child->fpu_state) return -1;
+
+    uint64_t flags = irq_save();
+    // The parent's live registers may be newer than its save area
+    if (!(read_cr0() & CR0_TS)) fpu_save(parent->fpu_state);
+    memcpy(child->fpu_state, parent->fpu_state, fpu_size);
+    irq_restore(flags);
+    return 0;
+}
+
+void fpu_release(struct task *t) {
+    uint64_t flags = irq_save();
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (fpu_owner[i] == t) fpu_owner[i] = 0;
+    }
+    irq_restore(flags);
+    if (t->fpu_state) kmem_cache_free(fpu_cache, t->fpu_state);
+    t->fpu_state = 0;
+}
+
+uint64_t kernel_fpu_begin(void) {
+    uint64_t flags = irq_save();
+    int cpu = cpu_id();
+    if (read_cr0() & CR0_TS) {
+        clts();
+    } else if (fpu_owner[cpu] && fpu_owner[cpu]->fpu_state) {
+        fpu_save(fpu_owner[cpu]->fpu_state);
+    }
+    // Whoever held the registers reloads them from memory next time
+    fpu_owner[cpu] = 0;
+    return flags;
+}
+
+void kernel_fpu_end(uint64_t flags) {
+    write_cr0(read_cr0() | CR0_TS);
+    irq_restore(flags);
+}
@@ -0,0 +1,49 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+// x87/SSE/AVX register state, switched lazily.
+//
+// A task gets a save area (XSAVE, or FXSAVE on CPUs without it) the first
+// time it runs an FPU or vector instruction. Switching tasks sets CR0.TS
+// instead of loading anything, so the first such instruction after a switch
+// traps (#NM) and loads the task's state then. Tasks that never touch the
+// FPU cost nothing; one that does pays a save only for slices in which it
+// used the registers.
+//
+// Kernel C code is built without vector registers. Code that wants them
+// brackets its use with kernel_fpu_begin/end.
+
+struct task;
+
+// Enable FXSAVE/XSAVE (CR4.OSFXSR, OSXSAVE, XCR0) and CR0.TS, and size the
+// save area. Call once on the boot CPU after the kernel heap is up.
+void fpu_init(void);
+
+// The same CPU setup on an application processor.
+void fpu_init_ap(void);
+
+// #NM from user mode: give the current task its registers. Returns 0, or
+// -1 if no save area could be allocated.
+int fpu_trap(struct task *t);
+
+// Context switch away from prev: save its registers if it used them since
+// it was switched to, and set CR0.TS for the next task. Interrupts off.
+void fpu_switch(struct task *prev);
+
+// fork(): give child a copy of parent's state. Returns 0 or -1.
+int fpu_fork(struct task *child, struct task *parent);
+
+// Free a task's save area and forget any CPU's registers holding its state.
+void fpu_release(struct task *t);
+
+// Use vector registers in the kernel. Saves the running task's state if it
+// is live, and keeps interrupts off until the matching end:
+//     uint64_t flags = kernel_fpu_begin();
+//     ... SSE/AVX code ...
+//     kernel_fpu_end(flags);
+uint64_t kernel_fpu_begin(void);
+void kernel_fpu_end(uint64_t flags);
+
+#endif
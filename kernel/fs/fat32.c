@@ -1,5 +1,9 @@
 #include "fat32.h"
 #include "../drivers/ata.h"
+#include "../pagecache.h"
+#include "../klib.h"
+#include "../kmalloc.h"
+#include "../x86.h"
 
 // Filesystem state
 static struct fat32_fs fs;
@@ -11,10 +15,15 @@ static uint8_t cluster_buffer[CLUSTER_BUFFER_SIZE];  // Max 4KB cluster
 // Directory entry buffer
 static struct dirent dirent_buf;
 
-// Node cache (simple, fixed size)
-#define NODE_CACHE_SIZE 64
-static struct vfs_node node_cache[NODE_CACHE_SIZE];
-static int node_cache_used = 0;
+// Nodes are refcounted slab objects. Live ones are listed so a second
+// lookup of the same cluster returns the same node.
+struct fat32_node {
+    struct vfs_node vfs;        // first, so a vfs_node pointer converts
+    struct fat32_node *next;
+    struct fat32_node *prev;
+};
+static struct kmem_cache *node_cache;
+static struct fat32_node *live_nodes = 0;
 
 // Error codes (negative to signal failure)
 #define FAT32_E_OK        0
@@ -26,41 +35,6 @@ static int node_cache_used = 0;
 #define FAT32_E_INVAL    -8
 #define FAT32_E_NOSPC    -9
 
-// String functions
-static int strlen(const char *s) {
-    int len = 0;
-    while (*s++) len++;
-    return len;
-}
-
-static void memcpy(void *dest, const void *src, uint32_t n) {
-    uint8_t *d = dest;
-    const uint8_t *s = src;
-    while (n--) *d++ = *s++;
-}
-
-static void memset(void *dest, uint8_t val, uint32_t n) {
-    uint8_t *d = dest;
-    while (n--) *d++ = val;
-}
-
-static int strncmp(const char *a, const char *b, int n) {
-    while (n-- && *a && *b) {
-        if (*a != *b) return *a - *b;
-        a++;
-        b++;
-    }
-    return 0;
-}
-
-static int strcmp_local(const char *a, const char *b) {
-    while (*a && *b && *a == *b) {
-        a++;
-        b++;
-    }
-    return *a - *b;
-}
-
 static int is_special_name(const char *name) {
     if (name[0] == '.' && name[1] == '\0') return 1;
     if (name[0] == '.' && name[1] == '.' && name[2] == '\0') return 1;
@@ -193,7 +167,7 @@ static int find_entry_in_dir(struct vfs_node *dir, const uint8_t fat_name[11],
             if (entry->name[0] == 0x00) return FAT32_E_NOENT; // end marker
             if (entry->name[0] == 0xE5) continue;             // deleted
             if ((entry->attr & FAT32_ATTR_LFN) == FAT32_ATTR_LFN) continue;
-            if (strncmp((char *)entry->name, (char *)fat_name, 11) == 0) {
+            if (memcmp(entry->name, fat_name, 11) == 0) {
                 *out_entry = entry;
                 *out_cluster = cluster;
                 return FAT32_E_OK;
@@ -347,7 +321,10 @@ struct vfs_node *fat32_create_file(struct vfs_node *parent, const char *name) {
 
     // Fail if it already exists
     struct vfs_node *existing = fat32_finddir(parent, name);
-    if (existing) return 0;
+    if (existing) {
+        vfs_node_put(existing);
+        return 0;
+    }
 
     struct fat32_dir_entry *slot;
     uint32_t slot_cluster;
@@ -381,6 +358,25 @@ int fat32_unlink(struct vfs_node *parent, const char *name) {
 
     if (entry->attr & FAT32_ATTR_DIRECTORY) return FAT32_E_ISDIR;
 
+    uint32_t first_cluster = (entry->first_cluster_high << 16) | entry->first_cluster_low;
+    if (first_cluster >= 2) {
+        // Cached pages hold node references, so the node is still live.
+        struct fat32_node *hit = 0;
+        uint64_t flags = irq_save();
+        for (struct fat32_node *n = live_nodes; n; n = n->next) {
+            if (n->vfs.inode == first_cluster) {
+                hit = n;
+                vfs_node_get(&hit->vfs);
+                break;
+            }
+        }
+        irq_restore(flags);
+        if (hit) {
+            pcache_invalidate(&hit->vfs);
+            vfs_node_put(&hit->vfs);
+        }
+    }
+
     // NOTE: to avoid filesystem corruption seen during testing, we do NOT
     // free the cluster chain here yet. Only mark the directory entry deleted.
     // uint32_t first_cluster = (entry->first_cluster_high << 16) | entry->first_cluster_low;
@@ -407,7 +403,9 @@ int fat32_rmdir(struct vfs_node *parent, const char *name) {
 
     struct vfs_node *dir_node = fat32_finddir(parent, name);
     if (!dir_node) return FAT32_E_NOENT;
-    if (!dir_is_empty(dir_node)) return FAT32_E_NOTEMPTY;
+    int empty = dir_is_empty(dir_node);
+    vfs_node_put(dir_node);
+    if (!empty) return FAT32_E_NOTEMPTY;
 
     // Re-read parent cluster to restore cluster_buffer before modifying entry.
     struct fat32_dir_entry *entry_refresh;
@@ -437,7 +435,11 @@ int fat32_rename(struct vfs_node *old_parent, const char *old_name,
     string_to_fat32_name(new_name, new_fat);
 
     // Destination must not exist
-    if (fat32_finddir(new_parent, new_name)) return FAT32_E_EXIST;
+    struct vfs_node *dst = fat32_finddir(new_parent, new_name);
+    if (dst) {
+        vfs_node_put(dst);
+        return FAT32_E_EXIST;
+    }
 
     // Find source entry
     struct fat32_dir_entry *entry;
@@ -487,6 +489,7 @@ int fat32_rename(struct vfs_node *old_parent, const char *old_name,
 int fat32_truncate(struct vfs_node *node, int size) {
     if (!node || !(node->flags & VFS_FILE)) return FAT32_E_INVAL;
     if (size == 0) {
+        pcache_invalidate(node);
         if (node->inode >= 2) free_cluster_chain(node->inode);
         node->inode = 0;
         node->size = 0;
@@ -495,11 +498,13 @@ int fat32_truncate(struct vfs_node *node, int size) {
 }
 
 // Ensure an absolute directory path exists, creating intermediate dirs.
+// Returns a referenced node.
 struct vfs_node *ensure_path_exists(const char *path) {
     if (!path || !*path) return 0;
     if (!fs.cluster_start_lba) return 0; // FAT not initialised
 
     struct vfs_node *current = &root_node;
+    vfs_node_get(current);
 
     // Skip leading slash
     const char *p = path;
@@ -516,12 +521,15 @@ struct vfs_node *ensure_path_exists(const char *path) {
         if (len == 0) continue;
 
         struct vfs_node *child = vfs_finddir(current, component);
-        if (!child) {
-            if (fat32_mkdir(current, component) != 0) return 0;
+        if (!child && fat32_mkdir(current, component) == 0) {
             child = vfs_finddir(current, component);
-            if (!child) return 0;
         }
-        if (!(child->flags & VFS_DIRECTORY)) return 0;
+        vfs_node_put(current);
+        if (!child) return 0;
+        if (!(child->flags & VFS_DIRECTORY)) {
+            vfs_node_put(child);
+            return 0;
+        }
         current = child;
     }
     return current;
@@ -591,34 +599,43 @@ static int fat32_write(struct vfs_node *node, uint32_t offset, uint32_t size, co
 static struct dirent *fat32_readdir(struct vfs_node *node, uint32_t index);
 static struct vfs_node *fat32_finddir(struct vfs_node *node, const char *name);
 
-// Allocate a node from cache
-static struct vfs_node *alloc_node(void) {
-    if (node_cache_used < NODE_CACHE_SIZE) {
-        return &node_cache[node_cache_used++];
-    }
-    return 0;  // Cache full
+// Last reference dropped (vfs_node_put, interrupts off): unlink and free.
+static void fat32_release(struct vfs_node *node) {
+    struct fat32_node *n = (struct fat32_node *)node;
+    if (n->prev) n->prev->next = n->next;
+    else live_nodes = n->next;
+    if (n->next) n->next->prev = n->prev;
+    kmem_cache_free(node_cache, n);
 }
 
-// Create a VFS node from directory entry (with cache deduplication)
+// Create a VFS node from directory entry (with deduplication of live nodes).
+// Returns a referenced node.
 static struct vfs_node *create_node(struct fat32_dir_entry *entry) {
     uint32_t cluster = (entry->first_cluster_high << 16) | entry->first_cluster_low;
 
-    // Reuse existing node if same cluster is already cached
+    // Reuse the live node if the same cluster is already open
     if (cluster >= 2) {
-        for (int i = 0; i < node_cache_used; i++) {
-            if (node_cache[i].inode == cluster) {
+        uint64_t flags = irq_save();
+        for (struct fat32_node *n = live_nodes; n; n = n->next) {
+            if (n->vfs.inode == cluster) {
+                n->vfs.refcount++;
+                irq_restore(flags);
                 // Update with latest on-disk info
-                fat32_name_to_string(entry->name, node_cache[i].name);
-                node_cache[i].size = entry->file_size;
-                return &node_cache[i];
+                fat32_name_to_string(entry->name, n->vfs.name);
+                n->vfs.size = entry->file_size;
+                return &n->vfs;
             }
         }
+        irq_restore(flags);
     }
 
-    struct vfs_node *node = alloc_node();
-    if (!node) return 0;
+    struct fat32_node *n = kmem_cache_alloc(node_cache);
+    if (!n) return 0;
+    struct vfs_node *node = &n->vfs;
 
     fat32_name_to_string(entry->name, node->name);
+    node->refcount = 1;
+    node->release = fat32_release;
 
     node->inode = cluster;
     node->size = entry->file_size;
@@ -638,6 +655,12 @@ static struct vfs_node *create_node(struct fat32_dir_entry *entry) {
         node->finddir = 0;
     }
 
+    uint64_t flags = irq_save();
+    n->prev = 0;
+    n->next = live_nodes;
+    if (live_nodes) live_nodes->prev = n;
+    live_nodes = n;
+    irq_restore(flags);
     return node;
 }
 
@@ -780,7 +803,7 @@ int fat32_flush_size(struct vfs_node *node) {
             if (entry->name[0] == 0xE5) continue;
             if ((entry->attr & FAT32_ATTR_LFN) == FAT32_ATTR_LFN) continue;
 
-            if (strncmp((char *)entry->name, (char *)fat_name, 11) == 0) {
+            if (memcmp(entry->name, fat_name, 11) == 0) {
                 // Update size and first cluster
                 entry->file_size = node->size;
                 entry->first_cluster_low = node->inode & 0xFFFF;
@@ -873,7 +896,7 @@ static struct vfs_node *fat32_finddir(struct vfs_node *node, const char *name) {
             if (entry->attr & FAT32_ATTR_VOLUME_ID) continue;
 
             // Check name match
-            if (strncmp((char *)entry->name, (char *)fat_name, 11) == 0) {
+            if (memcmp(entry->name, fat_name, 11) == 0) {
                 struct vfs_node *child = create_node(entry);
                 if (child) {
                     child->private_data = (void *)(uintptr_t)node->inode;
@@ -900,12 +923,17 @@ int fat32_touch_path(const char *path) {
 
     struct vfs_node *parent = vfs_resolve_path(parent_path);
     if (!parent) return FAT32_E_NOENT;
-    if (!(parent->flags & VFS_DIRECTORY)) return FAT32_E_NOTDIR;
-
-    if (fat32_finddir(parent, leaf)) return FAT32_E_OK; // already exists
-
-    struct vfs_node *node = fat32_create_file(parent, leaf);
-    return node ? FAT32_E_OK : FAT32_E_NOSPC;
+    int st = FAT32_E_OK;
+    struct vfs_node *node = 0;
+    if (!(parent->flags & VFS_DIRECTORY)) {
+        st = FAT32_E_NOTDIR;
+    } else if ((node = fat32_finddir(parent, leaf)) == 0) {   // else already exists
+        node = fat32_create_file(parent, leaf);
+        if (!node) st = FAT32_E_NOSPC;
+    }
+    vfs_node_put(node);
+    vfs_node_put(parent);
+    return st;
 }
 
 int fat32_rm_path(const char *path) {
@@ -914,8 +942,9 @@ int fat32_rm_path(const char *path) {
     if (split_path(path, parent_path, leaf) != FAT32_E_OK) return FAT32_E_INVAL;
     struct vfs_node *parent = vfs_resolve_path(parent_path);
     if (!parent) return FAT32_E_NOENT;
-    if (!(parent->flags & VFS_DIRECTORY)) return FAT32_E_NOTDIR;
-    return fat32_unlink(parent, leaf);
+    int st = (parent->flags & VFS_DIRECTORY) ? fat32_unlink(parent, leaf) : FAT32_E_NOTDIR;
+    vfs_node_put(parent);
+    return st;
 }
 
 int fat32_rmdir_path(const char *path) {
@@ -924,8 +953,9 @@ int fat32_rmdir_path(const char *path) {
     if (split_path(path, parent_path, leaf) != FAT32_E_OK) return FAT32_E_INVAL;
     struct vfs_node *parent = vfs_resolve_path(parent_path);
     if (!parent) return FAT32_E_NOENT;
-    if (!(parent->flags & VFS_DIRECTORY)) return FAT32_E_NOTDIR;
-    return fat32_rmdir(parent, leaf);
+    int st = (parent->flags & VFS_DIRECTORY) ? fat32_rmdir(parent, leaf) : FAT32_E_NOTDIR;
+    vfs_node_put(parent);
+    return st;
 }
 
 int fat32_mv_path(const char *src, const char *dst) {
@@ -937,11 +967,6 @@ int fat32_mv_path(const char *src, const char *dst) {
 
     if (is_special_name(src_leaf) || is_special_name(dst_leaf)) return FAT32_E_INVAL;
 
-    struct vfs_node *src_parent = vfs_resolve_path(src_parent_path);
-    struct vfs_node *dst_parent = vfs_resolve_path(dst_parent_path);
-    if (!src_parent || !dst_parent) return FAT32_E_NOENT;
-    if (!(src_parent->flags & VFS_DIRECTORY) || !(dst_parent->flags & VFS_DIRECTORY)) return FAT32_E_NOTDIR;
-
     // Prevent moving a directory into its own subtree (basic check)
     int src_len = strlen(src);
     int dst_len = strlen(dst);
@@ -949,7 +974,19 @@ int fat32_mv_path(const char *src, const char *dst) {
         return FAT32_E_INVAL;
     }
 
-    return fat32_rename(src_parent, src_leaf, dst_parent, dst_leaf);
+    struct vfs_node *src_parent = vfs_resolve_path(src_parent_path);
+    struct vfs_node *dst_parent = vfs_resolve_path(dst_parent_path);
+    int st;
+    if (!src_parent || !dst_parent) {
+        st = FAT32_E_NOENT;
+    } else if (!(src_parent->flags & VFS_DIRECTORY) || !(dst_parent->flags & VFS_DIRECTORY)) {
+        st = FAT32_E_NOTDIR;
+    } else {
+        st = fat32_rename(src_parent, src_leaf, dst_parent, dst_leaf);
+    }
+    vfs_node_put(src_parent);
+    vfs_node_put(dst_parent);
+    return st;
 }
 
 int fat32_ls_path(const char *path,
@@ -957,7 +994,10 @@ int fat32_ls_path(const char *path,
                   void *ctx) {
     struct vfs_node *dir = vfs_resolve_path(path);
     if (!dir) return FAT32_E_NOENT;
-    if (!(dir->flags & VFS_DIRECTORY)) return FAT32_E_NOTDIR;
+    if (!(dir->flags & VFS_DIRECTORY)) {
+        vfs_node_put(dir);
+        return FAT32_E_NOTDIR;
+    }
 
     uint32_t idx = 0;
     struct dirent *d;
@@ -966,6 +1006,7 @@ int fat32_ls_path(const char *path,
             if (visitor(d, ctx) != 0) break;
         }
     }
+    vfs_node_put(dir);
     return FAT32_E_OK;
 }
 
@@ -1004,8 +1045,12 @@ int fat32_init(uint32_t partition_lba) {
     int data_sectors = bpb->total_sectors_32 - (bpb->reserved_sectors + bpb->num_fats * bpb->fat_size_32);
     fs.total_clusters = data_sectors / bpb->sectors_per_cluster;
 
-    // Set up root node
+    node_cache = kmem_cache_create("fat32_node", sizeof(struct fat32_node), 0);
+    if (!node_cache) return -1;
+
+    // Set up root node; static, so it holds a reference of its own
     memset(&root_node, 0, sizeof(root_node));
+    root_node.refcount = 1;
     root_node.name[0] = '/';
     root_node.name[1] = 0;
     root_node.flags = VFS_DIRECTORY;
@@ -79,7 +79,8 @@ int fat32_init(uint32_t partition_lba);
 // Get root directory node
 struct vfs_node *fat32_get_root(void);
 
-// Create directory at path if missing, return its node (absolute paths only)
+// Create directory at path if missing, return its node (absolute paths only).
+// Like fat32_create_file(), returns a referenced node (vfs_node_put()).
 struct vfs_node *ensure_path_exists(const char *path);
 
 // Create a subdirectory under parent (helper used by ensure_path_exists)
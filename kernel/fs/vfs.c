@@ -1,4 +1,7 @@
 #include "vfs.h"
+#include "../pagecache.h"
+#include "../klib.h"
+#include "../x86.h"
 
 static struct vfs_node *root_node = 0;
 
@@ -10,6 +13,20 @@ void vfs_set_root(struct vfs_node *node) {
     root_node = node;
 }
 
+void vfs_node_get(struct vfs_node *node) {
+    if (!node) return;
+    uint64_t flags = irq_save();
+    node->refcount++;
+    irq_restore(flags);
+}
+
+void vfs_node_put(struct vfs_node *node) {
+    if (!node) return;
+    uint64_t flags = irq_save();
+    if (--node->refcount == 0 && node->release) node->release(node);
+    irq_restore(flags);
+}
+
 int vfs_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
     if (node && node->read) {
         return node->read(node, offset, size, buffer);
@@ -19,7 +36,9 @@ int vfs_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buf
 
 int vfs_write(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *buffer) {
     if (node && node->write) {
-        return node->write(node, offset, size, buffer);
+        int written = node->write(node, offset, size, buffer);
+        if (written > 0) pcache_update(node, offset, written, buffer);
+        return written;
     }
     return -1;
 }
@@ -38,32 +57,18 @@ struct vfs_node *vfs_finddir(struct vfs_node *node, const char *name) {
     return 0;
 }
 
-// Simple string compare
-static int strcmp(const char *a, const char *b) {
-    while (*a && *b && *a == *b) {
-        a++;
-        b++;
-    }
-    return *a - *b;
-}
-
-// Copy string
-static void strcpy(char *dest, const char *src) {
-    while (*src) {
-        *dest++ = *src++;
-    }
-    *dest = 0;
-}
-
 struct vfs_node *vfs_resolve_path(const char *path) {
     if (!path || !root_node) return 0;
 
     // Handle root
     if (path[0] == '/' && path[1] == 0) {
+        vfs_node_get(root_node);
         return root_node;
     }
 
+    // current and every node on the stack hold a reference.
     struct vfs_node *current = root_node;
+    vfs_node_get(current);
     struct vfs_node *stack[VFS_MAX_PATH / 2];
     int depth = 0;
     char component[VFS_MAX_NAME];
@@ -92,24 +97,28 @@ struct vfs_node *vfs_resolve_path(const char *path) {
                 continue;
             }
             if (strcmp(component, "..") == 0) {
+                vfs_node_put(current);
                 if (depth > 0) {
                     current = stack[--depth];
                 } else {
                     current = root_node;
+                    vfs_node_get(current);
                 }
                 continue;
             }
 
-            if (depth < (VFS_MAX_PATH / 2)) {
-                stack[depth++] = current;
-            } else {
-                return 0;
+            if (depth >= (VFS_MAX_PATH / 2)) {
+                vfs_node_put(current);
+                current = 0;
+                break;
             }
+            stack[depth++] = current;
 
             current = vfs_finddir(current, component);
-            if (!current) return 0;
+            if (!current) break;
         }
     }
 
+    while (depth > 0) vfs_node_put(stack[--depth]);
     return current;
 }
@@ -17,6 +17,7 @@ typedef int (*read_fn)(struct vfs_node *, uint32_t offset, uint32_t size, uint8_
 typedef int (*write_fn)(struct vfs_node *, uint32_t offset, uint32_t size, const uint8_t *buffer);
 typedef struct dirent *(*readdir_fn)(struct vfs_node *, uint32_t index);
 typedef struct vfs_node *(*finddir_fn)(struct vfs_node *, const char *name);
+typedef void (*release_fn)(struct vfs_node *);
 
 // Filesystem node (file or directory)
 struct vfs_node {
@@ -30,9 +31,12 @@ struct vfs_node {
     write_fn write;
     readdir_fn readdir;
     finddir_fn finddir;
+    release_fn release;   // frees the node when the last reference goes
 
     // Filesystem-specific data
     void *private_data;
+
+    uint32_t refcount;    // vfs_node_get/vfs_node_put
 };
 
 // Directory entry
@@ -50,7 +54,12 @@ int vfs_write(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8
 struct dirent *vfs_readdir(struct vfs_node *node, uint32_t index);
 struct vfs_node *vfs_finddir(struct vfs_node *node, const char *name);
 
-// Path resolution
+// Nodes returned by finddir and path resolution carry a reference that
+// the caller drops with vfs_node_put(). Both accept NULL.
+void vfs_node_get(struct vfs_node *node);
+void vfs_node_put(struct vfs_node *node);
+
+// Path resolution. Returns a referenced node, or 0.
 struct vfs_node *vfs_resolve_path(const char *path);
 
 #endif
@@ -2,6 +2,7 @@
 // Sets up kernel/user segments and TSS for privilege transitions
 
 #include "gdt.h"
+#include "smp.h"
 
 // GDT selectors (must match bootloader layout)
 // 0x00: Null
@@ -56,77 +57,88 @@ struct tss {
 } __attribute__((packed));
 
 // GDT with 5 segment entries + 1 TSS entry (which is 16 bytes = 2 slots)
-static struct {
+struct gdt_table {
     struct gdt_entry entries[5];
     struct tss_entry tss;
-} __attribute__((packed, aligned(16))) gdt;
-
-static struct tss tss;
-static struct gdt_ptr gdt_ptr;
-
-static void gdt_set_entry(int idx, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
-    gdt.entries[idx].base_low = base & 0xFFFF;
-    gdt.entries[idx].base_mid = (base >> 16) & 0xFF;
-    gdt.entries[idx].base_high = (base >> 24) & 0xFF;
-    gdt.entries[idx].limit_low = limit & 0xFFFF;
-    gdt.entries[idx].flags_limit = ((limit >> 16) & 0x0F) | (flags & 0xF0);
-    gdt.entries[idx].access = access;
+} __attribute__((packed, aligned(16)));
+
+// One of each per CPU: a busy TSS cannot be loaded twice, and each CPU
+// needs its own RSP0.
+static struct gdt_table cpu_gdt[MAX_CPUS];
+static struct tss cpu_tss[MAX_CPUS];
+static struct gdt_ptr cpu_gdt_ptr[MAX_CPUS];
+
+static void gdt_set_entry(struct gdt_table *gdt, int idx, uint32_t base, uint32_t limit,
+                          uint8_t access, uint8_t flags) {
+    gdt->entries[idx].base_low = base & 0xFFFF;
+    gdt->entries[idx].base_mid = (base >> 16) & 0xFF;
+    gdt->entries[idx].base_high = (base >> 24) & 0xFF;
+    gdt->entries[idx].limit_low = limit & 0xFFFF;
+    gdt->entries[idx].flags_limit = ((limit >> 16) & 0x0F) | (flags & 0xF0);
+    gdt->entries[idx].access = access;
 }
 
-static void gdt_set_tss(uint64_t base, uint32_t limit) {
-    gdt.tss.limit_low = limit & 0xFFFF;
-    gdt.tss.base_low = base & 0xFFFF;
-    gdt.tss.base_mid = (base >> 16) & 0xFF;
-    gdt.tss.access = 0x89;  // Present, 64-bit TSS (available)
-    gdt.tss.flags_limit = ((limit >> 16) & 0x0F);
-    gdt.tss.base_high = (base >> 24) & 0xFF;
-    gdt.tss.base_upper = (base >> 32) & 0xFFFFFFFF;
-    gdt.tss.reserved = 0;
+static void gdt_set_tss(struct gdt_table *gdt, uint64_t base, uint32_t limit) {
+    gdt->tss.limit_low = limit & 0xFFFF;
+    gdt->tss.base_low = base & 0xFFFF;
+    gdt->tss.base_mid = (base >> 16) & 0xFF;
+    gdt->tss.access = 0x89;  // Present, 64-bit TSS (available)
+    gdt->tss.flags_limit = ((limit >> 16) & 0x0F);
+    gdt->tss.base_high = (base >> 24) & 0xFF;
+    gdt->tss.base_upper = (base >> 32) & 0xFFFFFFFF;
+    gdt->tss.reserved = 0;
 }
 
 void gdt_init(void) {
+    gdt_init_cpu(0);
+}
+
+void gdt_init_cpu(int cpu) {
+    struct gdt_table *gdt = &cpu_gdt[cpu];
+    struct tss *tss = &cpu_tss[cpu];
+    struct gdt_ptr *gdt_ptr = &cpu_gdt_ptr[cpu];
+
     // Zero TSS
-    for (int i = 0; i < (int)sizeof(tss); i++) {
-        ((uint8_t *)&tss)[i] = 0;
+    for (int i = 0; i < (int)sizeof(*tss); i++) {
+        ((uint8_t *)tss)[i] = 0;
     }
-    tss.iopb_offset = sizeof(tss);
+    tss->iopb_offset = sizeof(*tss);
 
     // Null descriptor
-    gdt_set_entry(0, 0, 0, 0, 0);
+    gdt_set_entry(gdt, 0, 0, 0, 0, 0);
 
     // Ring 0 code: selector 0x08
     // Access: Present, DPL 0, Code, Executable, Readable
-    gdt_set_entry(1, 0, 0xFFFFF, 0x9A, 0xA0);  // 0xA0 = Long mode, 4KB granularity
+    gdt_set_entry(gdt, 1, 0, 0xFFFFF, 0x9A, 0xA0);  // 0xA0 = Long mode, 4KB granularity
 
     // Ring 0 data: selector 0x10
     // Access: Present, DPL 0, Data, Writable
-    gdt_set_entry(2, 0, 0xFFFFF, 0x92, 0xC0);  // 0xC0 = 32-bit (ignored for data in long mode)
+    gdt_set_entry(gdt, 2, 0, 0xFFFFF, 0x92, 0xC0);  // 0xC0 = 32-bit (ignored for data in long mode)
 
     // Ring 3 data: selector 0x18 (0x1B with RPL 3)
     // Access: Present, DPL 3, Data, Writable
-    gdt_set_entry(3, 0, 0xFFFFF, 0xF2, 0xC0);
+    gdt_set_entry(gdt, 3, 0, 0xFFFFF, 0xF2, 0xC0);
 
     // Ring 3 code: selector 0x20 (0x23 with RPL 3)
     // Access: Present, DPL 3, Code, Executable, Readable
-    gdt_set_entry(4, 0, 0xFFFFF, 0xFA, 0xA0);  // 0xA0 = Long mode
+    gdt_set_entry(gdt, 4, 0, 0xFFFFF, 0xFA, 0xA0);  // 0xA0 = Long mode
 
     // TSS: selector 0x28
-    gdt_set_tss((uint64_t)&tss, sizeof(tss) - 1);
+    gdt_set_tss(gdt, (uint64_t)tss, sizeof(*tss) - 1);
 
     // Set up GDT pointer
-    gdt_ptr.limit = sizeof(gdt) - 1;
-    gdt_ptr.base = (uint64_t)&gdt;
+    gdt_ptr->limit = sizeof(*gdt) - 1;
+    gdt_ptr->base = (uint64_t)gdt;
 
     // Load GDT
     __asm__ volatile (
         "lgdt %0\n"
-        // Reload segment registers
+        // Reload segment registers. FS and GS are left alone: loading them
+        // would reset GS_BASE, which holds the per-CPU area.
         "mov $0x10, %%ax\n"
         "mov %%ax, %%ds\n"
         "mov %%ax, %%es\n"
         "mov %%ax, %%ss\n"
-        "mov %%ax, %%fs\n"
-        "mov %%ax, %%gs\n"
         // Far jump to reload CS
         "pushq $0x08\n"
         "lea 1f(%%rip), %%rax\n"
@@ -134,7 +146,7 @@ void gdt_init(void) {
         "lretq\n"
         "1:\n"
         :
-        : "m"(gdt_ptr)
+        : "m"(*gdt_ptr)
         : "rax", "memory"
     );
 
@@ -149,5 +161,5 @@ void gdt_init(void) {
 }
 
 void tss_set_rsp0(uint64_t rsp0) {
-    tss.rsp0 = rsp0;
+    cpu_tss[cpu_id()].rsp0 = rsp0;
 }
@@ -3,10 +3,13 @@
 
 #include <stdint.h>
 
-// Initialize GDT with TSS for ring 3 support
+// Initialize GDT with TSS for ring 3 support (boot CPU)
 void gdt_init(void);
 
-// Set RSP0 in TSS (kernel stack for ring 3 -> ring 0 transitions)
+// Same for another CPU, with a GDT and TSS of its own
+void gdt_init_cpu(int cpu);
+
+// Set RSP0 in this CPU's TSS (kernel stack for ring 3 -> ring 0 transitions)
 void tss_set_rsp0(uint64_t rsp0);
 
 #endif
@@ -1,4 +1,5 @@
 #include "idt.h"
+#include "lapic.h"
 
 #define IDT_ENTRIES 256
 #define PIT_HZ 100
@@ -43,6 +44,9 @@ extern void isr31(void);
 extern void irq0(void);
 extern void irq1(void);
 extern void irq12(void);
+extern void lapic_timer_entry(void);
+extern void lapic_ipi_entry(void);
+extern void lapic_spurious_entry(void);
 
 static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
@@ -131,14 +135,22 @@ void idt_init(void) {
     idt_set_gate(32, (uint64_t)irq0);  // Timer
     idt_set_gate(33, (uint64_t)irq1);  // Keyboard
     idt_set_gate(44, (uint64_t)irq12); // Mouse
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint64_t)lapic_timer_entry);
+    idt_set_gate(LAPIC_IPI_VECTOR, (uint64_t)lapic_ipi_entry);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint64_t)lapic_spurious_entry);
 
     // Load IDT
     idtp.limit = sizeof(idt) - 1;
     idtp.base = (uint64_t)&idt;
-    __asm__ volatile ("lidt %0" : : "m"(idtp));
+    idt_load();
 
-    // Program PIT to periodic interrupts
+    // Program PIT to periodic interrupts (timer_init may hand the tick
+    // to the local APIC)
     pit_init();
 
     // Interrupts are enabled later once scheduling is ready.
 }
+
+void idt_load(void) {
+    __asm__ volatile ("lidt %0" : : "m"(idtp));
+}
@@ -20,6 +20,8 @@ struct idt_ptr {
 } __attribute__((packed));
 
 void idt_init(void);
+// Load the IDT built by idt_init on this CPU (application processors).
+void idt_load(void);
 void idt_set_gate(int n, uint64_t handler);
 
 #endif
@@ -6,10 +6,13 @@ global isr8, isr9, isr10, isr11, isr12, isr13, isr14, isr15
 global isr16, isr17, isr18, isr19, isr20, isr21, isr22, isr23
 global isr24, isr25, isr26, isr27, isr28, isr29, isr30, isr31
 global irq0, irq1, irq12
+global lapic_timer_entry, lapic_ipi_entry, lapic_spurious_entry
+global task_first_return
 
 ; Import C handler
 extern isr_handler
 extern irq_handler
+extern kernel_unlock
 
 ; Macro for ISRs that don't push an error code
 %macro ISR_NOERR 1
@@ -26,6 +29,17 @@ isr%1:
     jmp isr_common
 %endmacro
 
+; GS_BASE holds the per-CPU area (struct cpu in smp.h) while in the kernel
+; and the user's value in user mode; swapgs exchanges it with
+; KERNEL_GS_BASE. Swap only when the frame's CS, at [rsp + %1], is ring 3:
+; an interrupt in the kernel already has the kernel's.
+%macro SWAPGS_IF_USER 1
+    test qword [rsp + %1], 3
+    jz %%kernel
+    swapgs
+%%kernel:
+%endmacro
+
 ; Macro for IRQs
 %macro IRQ 2
 irq%1:
@@ -73,8 +87,27 @@ IRQ 0, 32    ; Timer
 IRQ 1, 33    ; Keyboard
 IRQ 12, 44   ; PS/2 mouse
 
+; Local APIC timer (LAPIC_TIMER_VECTOR)
+lapic_timer_entry:
+    push 0
+    push 0x40
+    jmp irq_common
+
+; Inter-processor interrupt (LAPIC_IPI_VECTOR)
+lapic_ipi_entry:
+    push 0
+    push 0x41
+    jmp irq_common
+
+; Local APIC spurious interrupt: no handler and no EOI
+lapic_spurious_entry:
+    iretq
+
 ; Common ISR handler
 isr_common:
+    cld                 ; the kernel's string copies run forwards
+    SWAPGS_IF_USER 24   ; int_no, err_code, rip, then cs
+
     ; Save all registers
     push rax
     push rbx
@@ -92,8 +125,9 @@ isr_common:
     push r14
     push r15
 
-    ; Call C handler with interrupt number as argument
+    ; Call C handler with interrupt number and frame pointer
     mov rdi, [rsp + 120]  ; Get interrupt number (15 regs * 8 = 120)
+    mov rsi, rsp
     call isr_handler
 
     ; Restore all registers
@@ -114,10 +148,14 @@ isr_common:
     pop rax
 
     add rsp, 16     ; Remove error code and interrupt number
+    SWAPGS_IF_USER 8
     iretq
 
 ; Common IRQ handler
 irq_common:
+    cld
+    SWAPGS_IF_USER 24
+
     ; Save all registers
     push rax
     push rbx
@@ -139,12 +177,15 @@ irq_common:
     mov rdi, [rsp + 120]
     mov rsi, rsp
     call irq_handler
-    test rax, rax
-    jnz .have_frame
-    mov rax, rsp
-.have_frame:
-    mov rsp, rax
+    jmp irq_return
+
+; A new task's first ctx_switch returns here with rsp at the frame it was
+; built with, so it starts through the same iretq. It was switched to with
+; the kernel lock held as if from inside irq_handler: release it likewise.
+task_first_return:
+    call kernel_unlock
 
+irq_return:
     ; Restore all registers
     pop r15
     pop r14
@@ -163,4 +204,5 @@ irq_common:
     pop rax
 
     add rsp, 16
+    SWAPGS_IF_USER 8
     iretq
@@ -1,11 +1,13 @@
 #include "isr.h"
 #include "drivers/keyboard.h"
 #include "drivers/mouse.h"
-#include "drivers/uhci.h"
 #include "sched.h"
-
-// System tick counter (incremented by timer IRQ ~18.2 times/sec by default PIT)
-volatile uint64_t system_ticks = 0;
+#include "paging.h"
+#include "vma.h"
+#include "lapic.h"
+#include "timer.h"
+#include "smp.h"
+#include "fpu.h"
 
 // Video memory for exception output
 static volatile unsigned short *video = (volatile unsigned short *)0xB8000;
@@ -57,7 +59,42 @@ static const char *exception_names[] = {
     "Reserved", "Reserved"
 };
 
-void isr_handler(uint64_t int_no) {
+// Page fault error code bits
+#define PF_PRESENT 0x1
+#define PF_WRITE   0x2
+
+static void handle_exception(uint64_t int_no, struct irq_frame *frame) {
+    // Write to a present page: may be a copy-on-write page shared by fork().
+    // Kernel-mode faults count too — syscalls write into user buffers.
+    if (int_no == 14 && (frame->err_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE)) {
+        uint64_t cr2, cr3;
+        __asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));
+        __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
+        if (paging_handle_cow_fault((uint64_t *)(cr3 & ~0xFFFULL), cr2) == 0) {
+            return;
+        }
+    }
+
+    // Device not available: a user task's first FPU/SSE instruction since
+    // it was switched to. Kernel code has to use kernel_fpu_begin().
+    if (int_no == 7 && (frame->cs & 3)) {
+        struct task *cur = sched_current();
+        if (cur && cur->is_user && fpu_trap(cur) == 0) return;
+    }
+
+    // Not-present page inside one of the task's areas: demand-allocate it.
+    if (int_no == 14 && !(frame->err_code & PF_PRESENT)) {
+        struct task *cur = sched_current();
+        if (cur && cur->is_user) {
+            uint64_t cr2;
+            __asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));
+            if (vma_fault(&cur->vmas, (uint64_t *)cur->cr3, cr2,
+                          (frame->err_code & PF_WRITE) != 0) == 0) {
+                return;
+            }
+        }
+    }
+
     // If a user task faulted, kill it instead of halting the whole system.
     struct task *t = sched_current();
     if (t && t->is_user) {
@@ -101,12 +138,21 @@ void isr_handler(uint64_t int_no) {
     }
 }
 
-struct irq_frame *irq_handler(uint64_t int_no, struct irq_frame *frame) {
-    if (int_no == 32) {
-        // Timer interrupt - increment system tick counter and schedule
-        system_ticks++;
-        uhci_poll();
-        frame = sched_tick(frame);
+void isr_handler(uint64_t int_no, struct irq_frame *frame) {
+    kernel_lock();
+    handle_exception(int_no, frame);
+    kernel_unlock();
+}
+
+void irq_handler(uint64_t int_no, struct irq_frame *frame) {
+    (void)frame;
+    kernel_lock();
+    if (int_no == 32 || int_no == LAPIC_TIMER_VECTOR) {
+        // Timer interrupt - USB polling, end of a time slice
+        timer_interrupt();
+    } else if (int_no == LAPIC_IPI_VECTOR) {
+        // Another CPU queued work for this one, or moved a timer forward
+        timer_rearm();
     } else if (int_no == 33) {
         // Keyboard interrupt - read scancode and pass to keyboard driver
         uint8_t scancode;
@@ -119,11 +165,19 @@ struct irq_frame *irq_handler(uint64_t int_no, struct irq_frame *frame) {
         mouse_handle_byte(data_byte);
     }
 
-    // Send End of Interrupt (EOI) to PIC
-    if (int_no >= 40) {
-        __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0x20), "Nd"((uint16_t)0xA0));
+    // Send End of Interrupt (EOI) to the APIC or PIC. Before switching
+    // tasks: the task switched to may not come back through here for a while.
+    if (int_no == LAPIC_TIMER_VECTOR || int_no == LAPIC_IPI_VECTOR) {
+        lapic_eoi();
+    } else {
+        if (int_no >= 40) {
+            __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0x20), "Nd"((uint16_t)0xA0));
+        }
+        __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0x20), "Nd"((uint16_t)0x20));
     }
-    __asm__ volatile ("outb %0, %1" : : "a"((uint8_t)0x20), "Nd"((uint16_t)0x20));
 
-    return frame;
+    // A slice that ran out preempts round robin; a device interrupt that
+    // woke a task switches to it straight away.
+    if (sched_need_resched()) sched_tick();
+    kernel_unlock();
 }
@@ -10,12 +10,20 @@
 #include "fs/fat32.h"
 #include "fs/vfs.h"
 #include "gdt.h"
+#include "klib.h"
 #include "paging.h"
 #include "pmm.h"
 #include "sched.h"
+#include "vma.h"
+#include "shm.h"
+#include "pagecache.h"
+#include "smp.h"
+#include "fpu.h"
 #include "syscall.h"
 #include "tty.h"
+#include "timer.h"
 #include "console.h"
+#include "bench.h"
 
 #define START_USER_TASK 0
 #define START_SCHEDULER 1
@@ -49,17 +57,32 @@ void print_color(const char *str, int row, unsigned char color) {
 
 static void idle_thread(void) {
     while (1) {
-        __asm__ volatile ("sti; hlt");
+        // Spend idle time zeroing pages for the allocator; only halt once
+        // the pool is full. The idle task runs without the kernel lock.
+        kernel_lock();
+        int refilled = pmm_zero_pool_refill();
+        kernel_unlock();
+        if (refilled) continue;
+        cpu_idle();
     }
 }
 
 void kernel_main(void) {
+    // Per-CPU area first: the kernel lock and the scheduler look up the CPU
+    smp_init_boot_cpu();
+    // The boot task holds the kernel lock like all kernel code
+    kernel_lock();
     print("PHOBOS - 64-bit C Kernel", 0);
+    // Pick memcpy/memset paths for this CPU before anything bulk-copies
+    klib_init();
+#if RUN_KLIB_BENCH
+    klib_bench();
+#endif
 
     // Initialize paging with user-accessible pages
     paging_init();
-    // Initialize physical memory manager (assume 2MB..64MB usable)
-    pmm_init(0x200000, 0x4000000);
+    // Map all RAM for the kernel; the PMM only hands out what is mapped
+    uint64_t direct_end = paging_init_direct_map();
     // VESA stuff
     fb_init();
     uint64_t fb_addr = (uint64_t)(*(uint32_t *)0x5028);
@@ -70,9 +93,20 @@ void kernel_main(void) {
     uint64_t fb_size = (uint64_t)fb_width() * (uint64_t)fb_height() * bytes_per_pixel;
     uint64_t map_start = fb_addr & ~0xFFFULL;
     uint64_t map_end = (fb_addr + fb_size + 0xFFFULL) & ~0xFFFULL;
-    for (uint64_t addr = map_start; addr < map_end; addr += 0x1000){
-        paging_map_kernel_page(paging_kernel_pml4(), addr, addr, PAGE_PRESENT | PAGE_WRITABLE);
-    }
+    // Initialize physical memory manager from the E820 map
+    pmm_reserve(map_start, map_end);
+    pmm_reserve(direct_end, ~0xFFFULL);
+    pmm_init();
+#if RUN_PMM_BENCH
+    pmm_bench();
+#endif
+    // Global: the mapping is shared by every address space (see
+    // paging_new_user_space), so it may survive CR3 switches in the TLB.
+    paging_map_kernel_range(paging_kernel_pml4(), map_start, map_end,
+                            PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL);
+#if RUN_PAGING_BENCH
+    paging_bench();
+#endif
     console_init();
     // Allow user tasks to write to VGA for now
     paging_mark_user_region(0xB8000, 0x1000);
@@ -80,7 +114,13 @@ void kernel_main(void) {
     // Initialize GDT and TSS (for ring3 stack switch)
     gdt_init();
 
-    // Initialize scheduler structures
+    // FPU/SSE state, saved per task and switched lazily
+    fpu_init();
+
+    // Initialize scheduler structures and the caches tasks draw on
+    vma_init();
+    shm_init();
+    pcache_init();
     sched_init();
     sched_bootstrap_current();
 
@@ -91,11 +131,17 @@ void kernel_main(void) {
     keyboard_init();
     idt_init();
     mouse_init();
+    // Scheduler timer: local APIC one-shot if present, else the PIT.
+    // Before uhci_init, which starts a kernel timer for USB polling.
+    timer_init();
     uhci_init();
 
     // Initialize syscall mechanism
     syscall_init();
 
+    // Start the other CPUs; each idles until the scheduler gives it work
+    smp_init();
+
     // Initialize ATA and mount filesystem
     ata_init();
     ata_select_drive(ATA_DRIVE_SLAVE);
@@ -104,22 +150,19 @@ void kernel_main(void) {
         print_color("FAT32 mounted", 1, 0x0A);
         vfs_set_root(fat32_get_root());
         // Create standard directories
-        ensure_path_exists("/apps");
-        ensure_path_exists("/core");
-        ensure_path_exists("/users/root");
-        ensure_path_exists("/cfg");
-        ensure_path_exists("/temp");
-        ensure_path_exists("/dev");
+        vfs_node_put(ensure_path_exists("/apps"));
+        vfs_node_put(ensure_path_exists("/core"));
+        vfs_node_put(ensure_path_exists("/users/root"));
+        vfs_node_put(ensure_path_exists("/cfg"));
+        vfs_node_put(ensure_path_exists("/temp"));
+        vfs_node_put(ensure_path_exists("/dev"));
     } else {
         print_color("FAT32 failed", 1, 0x0C);
     }
 
     // Create idle task
     if (START_IDLE_TASK) {
-        struct task *idle = sched_create_kernel(idle_thread);
-        if (idle) {
-            idle->is_idle = 1;
-        }
+        sched_create_idle(idle_thread);
     }
 
     // Launch first user task
@@ -127,12 +170,14 @@ void kernel_main(void) {
         struct vfs_node *task_a = vfs_resolve_path("/apps/ticka");
         if (task_a) {
             sched_create_user(task_a, 0);
+            vfs_node_put(task_a);
         } else {
             print_color("ticka missing", 6, 0x0C);
         }
         struct vfs_node *task_b = vfs_resolve_path("/apps/tickb");
         if (task_b) {
             sched_create_user(task_b, 0);
+            vfs_node_put(task_b);
         } else {
             print_color("tickb missing", 7, 0x0C);
         }
@@ -151,13 +196,13 @@ void kernel_main(void) {
     } else {
         print("No shell linked.", 4);
         while (1) {
-            __asm__ volatile ("sti; hlt");
+            sched_yield();
         }
     }
 #else
     print("Shell disabled at build.", 4);
     while (1) {
-        __asm__ volatile ("sti; hlt");
+        sched_yield();
     }
 #endif
 
@@ -0,0 +1,237 @@
+#include "klib.h"
+#include "x86.h"
+#include "bench.h"
+
+// ERMS (CPUID.7:EBX[9]): rep movsb / rep stosb move whole cache lines
+// internally and beat the qword forms at every size worth a string op.
+// FSRM (CPUID.7:EDX[4]): they are also fast for short lengths, so there is
+// no need for a separate small-size loop.
+static int have_erms = 0;
+static int have_fsrm = 0;
+
+// Below this, a plain loop beats the startup cost of a string instruction
+// on parts without FSRM.
+#define SMALL_COPY 32
+
+void klib_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7) return;
+    cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    have_erms = (ebx >> 9) & 1;
+    have_fsrm = (edx >> 4) & 1;
+}
+
+// ---------------------------------------------------------------------------
+// Memory
+// ---------------------------------------------------------------------------
+
+static inline void movsb(void *dst, const void *src, size_t n) {
+    __asm__ volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void movsq_tail(void *dst, const void *src, size_t n) {
+    size_t q = n >> 3, r = n & 7;
+    __asm__ volatile ("rep movsq\n\t"
+                      "mov %3, %%rcx\n\t"
+                      "rep movsb"
+                      : "+D"(dst), "+S"(src), "+c"(q) : "r"(r) : "memory");
+}
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    if (n < SMALL_COPY && !have_fsrm) {
+        uint8_t *d = (uint8_t *)dst;
+        const uint8_t *s = (const uint8_t *)src;
+        while (n--) *d++ = *s++;
+    } else if (have_erms) {
+        movsb(dst, src, n);
+    } else {
+        movsq_tail(dst, src, n);
+    }
+    return dst;
+}
+
+void *memmove(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    if (d <= s || d >= s + n) return memcpy(dst, src, n);
+
+    // Overlap with dst above src: copy downwards. Interrupts stay off
+    // while DF is set; every kernel entry expects it clear.
+    d += n - 1;
+    s += n - 1;
+    __asm__ volatile ("pushfq\n\t"
+                      "cli\n\t"
+                      "std\n\t"
+                      "rep movsb\n\t"
+                      "popfq"
+                      : "+D"(d), "+S"(s), "+c"(n) : : "memory", "cc");
+    return dst;
+}
+
+void *memset(void *dst, int c, size_t n) {
+    uint8_t b = (uint8_t)c;
+    if (n < SMALL_COPY && !have_fsrm) {
+        uint8_t *d = (uint8_t *)dst;
+        while (n--) *d++ = b;
+    } else if (have_erms) {
+        void *d = dst;
+        __asm__ volatile ("rep stosb" : "+D"(d), "+c"(n) : "a"(b) : "memory");
+    } else {
+        void *d = dst;
+        size_t q = n >> 3, r = n & 7;
+        uint64_t pattern = b * 0x0101010101010101ULL;
+        __asm__ volatile ("rep stosq\n\t"
+                          "mov %3, %%rcx\n\t"
+                          "rep stosb"
+                          : "+D"(d), "+c"(q) : "a"(pattern), "r"(r) : "memory");
+    }
+    return dst;
+}
+
+typedef uint64_t __attribute__((may_alias)) qword_alias;
+
+int memcmp(const void *a, const void *b, size_t n) {
+    const uint8_t *x = (const uint8_t *)a;
+    const uint8_t *y = (const uint8_t *)b;
+    // Skip equal qwords, then find the first differing byte.
+    while (n >= 8 && *(const qword_alias *)x == *(const qword_alias *)y) {
+        x += 8;
+        y += 8;
+        n -= 8;
+    }
+    for (; n; n--, x++, y++) {
+        if (*x != *y) return *x - *y;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Strings
+// ---------------------------------------------------------------------------
+
+size_t strlen(const char *s) {
+    const char *p = s;
+    while (*p) p++;
+    return (size_t)(p - s);
+}
+
+int strcmp(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (uint8_t)*a - (uint8_t)*b;
+}
+
+int strncmp(const char *a, const char *b, size_t n) {
+    for (; n; n--, a++, b++) {
+        if (*a != *b || !*a) return (uint8_t)*a - (uint8_t)*b;
+    }
+    return 0;
+}
+
+size_t strlcpy(char *dst, const char *src, size_t max) {
+    size_t len = strlen(src);
+    size_t n = len < max - 1 ? len : max - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return len;
+}
+
+// ---------------------------------------------------------------------------
+// Pages
+// ---------------------------------------------------------------------------
+
+void copy_page(void *dst, const void *src) {
+    if (have_erms) {
+        movsb(dst, src, 4096);
+    } else {
+        size_t q = 512;
+        __asm__ volatile ("rep movsq" : "+D"(dst), "+S"(src), "+c"(q) : : "memory");
+    }
+}
+
+void zero_page(void *dst) {
+    if (have_erms) {
+        size_t n = 4096;
+        __asm__ volatile ("rep stosb" : "+D"(dst), "+c"(n) : "a"(0) : "memory");
+    } else {
+        size_t q = 512;
+        __asm__ volatile ("rep stosq" : "+D"(dst), "+c"(q) : "a"(0ULL) : "memory");
+    }
+}
+
+void zero_page_nt(void *dst) {
+    uint64_t *p = (uint64_t *)dst;
+    for (int i = 0; i < 512; i += 4) {
+        __asm__ volatile (
+            "movnti %1, 0(%0)\n"
+            "movnti %1, 8(%0)\n"
+            "movnti %1, 16(%0)\n"
+            "movnti %1, 24(%0)\n"
+            : : "r"(p + i), "r"(0ULL) : "memory");
+    }
+    __asm__ volatile ("sfence" : : : "memory");
+}
+
+#if RUN_KLIB_BENCH
+
+// ---------------------------------------------------------------------------
+// Microbenchmark
+// ---------------------------------------------------------------------------
+
+#define BENCH_ITERS 256
+
+static uint8_t bench_src[4096] __attribute__((aligned(4096)));
+static uint8_t bench_dst[4096] __attribute__((aligned(4096)));
+
+static void byte_copy(void *dst, const void *src, size_t n) {
+    volatile uint8_t *d = (volatile uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    while (n--) *d++ = *s++;
+}
+
+static void byte_zero(void *dst, size_t n) {
+    volatile uint8_t *d = (volatile uint8_t *)dst;
+    while (n--) *d++ = 0;
+}
+
+static void bench_line(const char *name, uint64_t cycles) {
+    bench_puts("  ");
+    bench_puts(name);
+    bench_puts(": ");
+    bench_putu(cycles / BENCH_ITERS);
+    bench_puts(" cycles/4K\n");
+}
+
+void klib_bench(void) {
+    uint64_t t0;
+    bench_puts("klib bench: erms=");
+    bench_putu((uint64_t)have_erms);
+    bench_puts(" fsrm=");
+    bench_putu((uint64_t)have_fsrm);
+    bench_puts("\n");
+
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) byte_copy(bench_dst, bench_src, 4096);
+    bench_line("byte copy", rdtsc() - t0);
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) copy_page(bench_dst, bench_src);
+    bench_line("copy_page", rdtsc() - t0);
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) memcpy(bench_dst + 1, bench_src, 4095);
+    bench_line("memcpy unaligned", rdtsc() - t0);
+
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) byte_zero(bench_dst, 4096);
+    bench_line("byte zero", rdtsc() - t0);
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) zero_page(bench_dst);
+    bench_line("zero_page", rdtsc() - t0);
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) zero_page_nt(bench_dst);
+    bench_line("zero_page_nt", rdtsc() - t0);
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef KLIB_H
+#define KLIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel memory and string routines. The bulk copy and fill paths pick
+// their instruction sequence once at boot from CPUID (klib_init); before
+// that they use the baseline one, so they are safe to call at any time.
+//
+// Only general-purpose registers are used: copies may touch user memory and
+// fault, which must not happen inside a kernel_fpu_begin (fpu.h) section.
+
+void klib_init(void);
+
+void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+void *memset(void *dst, int c, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+
+size_t strlen(const char *s);
+int strcmp(const char *a, const char *b);
+int strncmp(const char *a, const char *b, size_t n);
+// Copy at most max - 1 characters and always terminate (max > 0).
+// Returns strlen(src).
+size_t strlcpy(char *dst, const char *src, size_t max);
+
+// Whole 4 KiB frames (both pointers page-aligned).
+void copy_page(void *dst, const void *src);
+void zero_page(void *dst);
+// Zero with non-temporal stores, for pages nobody touches soon.
+void zero_page_nt(void *dst);
+
+// Benchmark the copy/zero paths against byte loops and print cycles per
+// 4 KiB to the QEMU debug console (port 0xE9). Built only with
+// RUN_KLIB_BENCH (bench.h).
+void klib_bench(void);
+
+#endif
@@ -0,0 +1,217 @@
+#include "kmalloc.h"
+#include "pmm.h"
+#include "paging.h"
+#include "klib.h"
+#include "x86.h"
+
+#define CACHE_LINE 64
+// Slab size: grow the block until it holds this many objects, or until
+// less than an eighth of it is lost to the header and the tail.
+#define SLAB_MIN_OBJECTS 8
+
+// Header at the start of every slab block, and of every large kmalloc
+// block (cache 0). Blocks come from the buddy allocator, so they are
+// aligned to their size and an object finds its slab by masking.
+struct slab {
+    struct kmem_cache *cache;   // owner, 0 for a large kmalloc block
+    struct slab *next;          // cache's list of slabs with free slots
+    struct slab *prev;
+    void *free;                 // free slots, linked through their first word
+    uint32_t inuse;             // allocated slots
+    uint32_t order;             // block order
+};
+
+struct kmem_cache {
+    const char *name;
+    uint32_t size;              // slot size, a multiple of the alignment
+    uint32_t offset;            // first slot, past the header
+    uint32_t per_slab;
+    uint32_t order;
+    struct slab *partial;       // slabs with at least one free slot
+};
+
+// kmalloc size classes, 32 .. KMALLOC_MAX_SMALL bytes. Their slabs are
+// single pages so kfree() can find the header from any pointer.
+#define KMALLOC_MIN_SHIFT 5
+#define KMALLOC_CLASSES   6
+
+static struct kmem_cache cache_cache;   // descriptors of created caches
+static struct kmem_cache size_caches[KMALLOC_CLASSES];
+static int kmem_ready = 0;
+static uint64_t slab_pages = 0;
+static uint64_t large_pages = 0;
+static uint64_t live_objects = 0;
+
+static void cache_init(struct kmem_cache *c, const char *name, uint32_t size,
+                       uint32_t align, unsigned max_order) {
+    if (!align) align = CACHE_LINE;
+    if (align < sizeof(void *)) align = sizeof(void *);
+    if (size < sizeof(void *)) size = sizeof(void *);
+    c->name = name;
+    c->size = (size + align - 1) & ~(align - 1);
+    c->offset = (sizeof(struct slab) + align - 1) & ~(align - 1);
+    c->partial = 0;
+
+    for (c->order = 0; c->order < max_order; c->order++) {
+        uint64_t bytes = PMM_BLOCK_SIZE(c->order);
+        uint64_t per = bytes > c->offset ? (bytes - c->offset) / c->size : 0;
+        if (per >= SLAB_MIN_OBJECTS) break;
+        if (per && (bytes - per * c->size) * 8 <= bytes) break;
+    }
+    c->per_slab = (uint32_t)((PMM_BLOCK_SIZE(c->order) - c->offset) / c->size);
+}
+
+static void kmem_init(void) {
+    cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, PMM_MAX_ORDER);
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        uint32_t size = 1u << (KMALLOC_MIN_SHIFT + i);
+        cache_init(&size_caches[i], "kmalloc", size, size < CACHE_LINE ? size : CACHE_LINE, 0);
+    }
+    kmem_ready = 1;
+}
+
+static void partial_unlink(struct kmem_cache *c, struct slab *s) {
+    if (s->prev) s->prev->next = s->next;
+    else c->partial = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = s->prev = 0;
+}
+
+static void partial_push(struct kmem_cache *c, struct slab *s) {
+    s->prev = 0;
+    s->next = c->partial;
+    if (c->partial) c->partial->prev = s;
+    c->partial = s;
+}
+
+static struct slab *slab_new(struct kmem_cache *c) {
+    void *block = pmm_alloc_pages(c->order);
+    if (!block) return 0;
+    struct slab *s = (struct slab *)phys_to_virt((uint64_t)block);
+    s->cache = c;
+    s->inuse = 0;
+    s->order = c->order;
+    s->free = 0;
+    // Thread the free list so the lowest slot is handed out first.
+    uint8_t *base = (uint8_t *)s + c->offset;
+    for (uint32_t i = c->per_slab; i > 0; i--) {
+        void **slot = (void **)(base + (uint64_t)(i - 1) * c->size);
+        *slot = s->free;
+        s->free = slot;
+    }
+    partial_push(c, s);
+    slab_pages += 1ULL << c->order;
+    return s;
+}
+
+static void *cache_alloc(struct kmem_cache *c) {
+    struct slab *s = c->partial;
+    if (!s) s = slab_new(c);
+    if (!s) return 0;
+    void **obj = (void **)s->free;
+    s->free = *obj;
+    s->inuse++;
+    if (!s->free) partial_unlink(c, s);
+    live_objects++;
+    return obj;
+}
+
+static void cache_free(struct kmem_cache *c, void *obj) {
+    struct slab *s = (struct slab *)((uint64_t)obj & ~(PMM_BLOCK_SIZE(c->order) - 1));
+    int was_full = s->free == 0;
+    *(void **)obj = s->free;
+    s->free = obj;
+    s->inuse--;
+    live_objects--;
+    if (was_full) partial_push(c, s);
+
+    // Keep one empty slab around so a steady alloc/free pattern does not
+    // bounce pages through the PMM; release any further ones.
+    if (s->inuse == 0 && (s->prev || s->next)) {
+        partial_unlink(c, s);
+        slab_pages -= 1ULL << c->order;
+        pmm_free_pages((void *)virt_to_phys(s), c->order);
+    }
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size, uint32_t align) {
+    uint64_t flags = irq_save();
+    if (!kmem_ready) kmem_init();
+    struct kmem_cache *c = (struct kmem_cache *)cache_alloc(&cache_cache);
+    if (c) cache_init(c, name, size, align, PMM_MAX_ORDER);
+    irq_restore(flags);
+    return c;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c) {
+    uint64_t flags = irq_save();
+    void *obj = cache_alloc(c);
+    irq_restore(flags);
+    return obj;
+}
+
+void *kmem_cache_zalloc(struct kmem_cache *c) {
+    void *obj = kmem_cache_alloc(c);
+    if (obj) memset(obj, 0, c->size);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *obj) {
+    if (!obj) return;
+    uint64_t flags = irq_save();
+    cache_free(c, obj);
+    irq_restore(flags);
+}
+
+void *kmalloc(uint64_t size) {
+    uint64_t flags = irq_save();
+    if (!kmem_ready) kmem_init();
+    void *ptr = 0;
+    if (size <= KMALLOC_MAX_SMALL) {
+        int i = 0;
+        while ((1ULL << (KMALLOC_MIN_SHIFT + i)) < size) i++;
+        ptr = cache_alloc(&size_caches[i]);
+    } else {
+        unsigned order = 0;
+        while (order <= PMM_MAX_ORDER && PMM_BLOCK_SIZE(order) < size + CACHE_LINE) order++;
+        void *block = order <= PMM_MAX_ORDER ? pmm_alloc_pages(order) : 0;
+        if (block) {
+            struct slab *s = (struct slab *)phys_to_virt((uint64_t)block);
+            s->cache = 0;
+            s->order = order;
+            large_pages += 1ULL << order;
+            live_objects++;
+            ptr = (uint8_t *)s + CACHE_LINE;
+        }
+    }
+    irq_restore(flags);
+    return ptr;
+}
+
+void *kzalloc(uint64_t size) {
+    void *ptr = kmalloc(size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+void kfree(void *ptr) {
+    if (!ptr) return;
+    uint64_t flags = irq_save();
+    struct slab *s = (struct slab *)((uint64_t)ptr & ~0xFFFULL);
+    if (s->cache) {
+        cache_free(s->cache, ptr);
+    } else {
+        large_pages -= 1ULL << s->order;
+        live_objects--;
+        pmm_free_pages((void *)virt_to_phys(s), s->order);
+    }
+    irq_restore(flags);
+}
+
+void kmem_get_stats(struct kmem_stats *out) {
+    uint64_t flags = irq_save();
+    out->slab_pages = slab_pages;
+    out->large_pages = large_pages;
+    out->objects = live_objects;
+    irq_restore(flags);
+}
@@ -0,0 +1,39 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+
+#include <stdint.h>
+
+// Kernel heap on top of the PMM. Objects of one type come from a slab
+// cache: blocks of contiguous pages carved into equal, cache-line aligned
+// slots, with freed slots reused first. Allocation and free are O(1);
+// capacity grows with free RAM. Memory is used through the direct map.
+
+struct kmem_cache;
+
+// A cache of size-byte objects aligned to align (a power of two; 0 means
+// a cache line). The cache descriptor itself comes from the heap, so this
+// may be called any time after pmm_init(). Returns 0 if memory is out.
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size, uint32_t align);
+
+// Uninitialised object, or 0 if memory is out.
+void *kmem_cache_alloc(struct kmem_cache *c);
+// Same, zero-filled.
+void *kmem_cache_zalloc(struct kmem_cache *c);
+void kmem_cache_free(struct kmem_cache *c, void *obj);
+
+// General-purpose allocation from power-of-two size classes; requests
+// above KMALLOC_MAX_SMALL take whole pages. Returns 0 if memory is out.
+#define KMALLOC_MAX_SMALL 1024
+void *kmalloc(uint64_t size);
+void *kzalloc(uint64_t size);
+void kfree(void *ptr);
+
+struct kmem_stats {
+    uint64_t slab_pages;     // pages held by slab caches
+    uint64_t large_pages;    // pages held by large kmalloc blocks
+    uint64_t objects;        // objects currently allocated
+};
+
+void kmem_get_stats(struct kmem_stats *out);
+
+#endif
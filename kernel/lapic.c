@@ -0,0 +1,153 @@
+#include "lapic.h"
+#include "paging.h"
+#include "x86.h"
+
+#define MSR_APIC_BASE     0x1B
+#define MSR_TSC_DEADLINE  0x6E0
+#define APIC_BASE_ENABLE  (1ULL << 11)
+
+// Register offsets
+#define LAPIC_ID          0x020
+#define LAPIC_TPR         0x080
+#define LAPIC_EOI         0x0B0
+#define LAPIC_SVR         0x0F0
+#define LAPIC_ICR_LOW     0x300
+#define LAPIC_ICR_HIGH    0x310
+#define LAPIC_LVT_TIMER   0x320
+#define LAPIC_TIMER_INIT  0x380
+#define LAPIC_TIMER_CUR   0x390
+#define LAPIC_TIMER_DIV   0x3E0
+
+#define SVR_ENABLE        0x100
+#define LVT_MASKED        0x10000
+#define LVT_ONESHOT       0x00000
+#define LVT_TSC_DEADLINE  0x40000
+#define DIV_16            0x3
+
+#define ICR_INIT          0x00500
+#define ICR_STARTUP       0x00600
+#define ICR_PENDING       0x01000   // delivery status: not yet accepted
+#define ICR_ASSERT        0x04000
+
+static volatile uint32_t *lapic = 0;
+static int have_tsc_deadline = 0;
+static uint32_t timer_mode = LVT_MASKED;   // LVT timer as last written
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    uint32_t low = value & 0xFFFFFFFF;
+    uint32_t high = value >> 32;
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"(low), "d"(high) : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static void set_timer_mode(uint32_t mode) {
+    if (timer_mode == mode) return;
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | mode);
+    timer_mode = mode;
+    // The deadline MSR must not be written before the mode switch lands
+    if (mode == LVT_TSC_DEADLINE) __asm__ volatile ("mfence" : : : "memory");
+}
+
+// Software-enable this CPU's APIC with its timer masked
+static void lapic_setup(void) {
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TIMER_DIV, DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_MASKED);
+}
+
+int lapic_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1u << 9))) return -1;
+    have_tsc_deadline = (ecx >> 24) & 1;
+
+    uint64_t base = rdmsr(MSR_APIC_BASE) & 0xFFFFF000ULL;
+
+    // Uncached, and global like the other kernel mappings above 1 GiB
+    if (paging_map_kernel_range(paging_kernel_pml4(), base, base + 0x1000,
+                                PAGE_PRESENT | PAGE_WRITABLE | PAGE_PCD |
+                                PAGE_PWT | PAGE_GLOBAL) < 0) {
+        return -1;
+    }
+    lapic = (volatile uint32_t *)base;
+
+    lapic_setup();
+    timer_mode = LVT_MASKED;
+    return 0;
+}
+
+void lapic_init_ap(void) {
+    // Same register page as the boot CPU's (each CPU sees its own APIC
+    // there). The timer stays masked: the boot CPU runs the timers.
+    lapic_setup();
+}
+
+int lapic_enabled(void) {
+    return lapic != 0;
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+static void send_icr(uint32_t apic_id, uint32_t low) {
+    uint64_t flags = irq_save();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, low);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) __asm__ volatile ("pause");
+    irq_restore(flags);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    send_icr(apic_id, vector);
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    send_icr(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uint32_t addr) {
+    send_icr(apic_id, ICR_STARTUP | (addr >> 12));
+}
+
+int lapic_has_tsc_deadline(void) {
+    return have_tsc_deadline;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_timer_oneshot(uint32_t count) {
+    set_timer_mode(LVT_ONESHOT);
+    lapic_write(LAPIC_TIMER_INIT, count ? count : 1);
+}
+
+void lapic_timer_deadline(uint64_t tsc) {
+    set_timer_mode(LVT_TSC_DEADLINE);
+    wrmsr(MSR_TSC_DEADLINE, tsc ? tsc : 1);
+}
+
+void lapic_timer_stop(void) {
+    if (timer_mode == LVT_TSC_DEADLINE) wrmsr(MSR_TSC_DEADLINE, 0);
+    else lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+uint32_t lapic_timer_count(void) {
+    return lapic_read(LAPIC_TIMER_CUR);
+}
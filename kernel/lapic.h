@@ -0,0 +1,52 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+
+// Local APIC: the per-CPU interrupt controller. Here it supplies the
+// scheduler timer and the IPIs between CPUs; external IRQs still come
+// through the 8259 PIC, which the boot CPU's APIC passes on in virtual-wire
+// mode.
+
+#define LAPIC_TIMER_VECTOR    0x40
+#define LAPIC_IPI_VECTOR      0x41
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Enable the local APIC and map its registers (before any user address
+// space is made). Returns 0, or -1 if the CPU has none.
+int lapic_init(void);
+
+// Enable the APIC of an application processor, after lapic_init has run
+// on the boot CPU.
+void lapic_init_ap(void);
+
+// Whether lapic_init succeeded.
+int lapic_enabled(void);
+
+// This CPU's APIC ID.
+uint32_t lapic_id(void);
+
+// Interrupt the CPU with APIC ID apic_id on vector.
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+// AP start-up: INIT, then STARTUP at the page-aligned real-mode addr.
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uint32_t addr);
+
+// Whether the timer takes an absolute TSC deadline (CPUID.1:ECX[24])
+// instead of a count.
+int lapic_has_tsc_deadline(void);
+
+// Signal end of interrupt for a vector the local APIC delivered.
+void lapic_eoi(void);
+
+// Timer, with its interrupt masked until one of these arms it:
+// one-shot countdown from count (bus clock / 16)...
+void lapic_timer_oneshot(uint32_t count);
+// ...or, with TSC deadlines, fire once the TSC reaches tsc.
+void lapic_timer_deadline(uint64_t tsc);
+// Disarm whichever is pending.
+void lapic_timer_stop(void);
+// Remaining one-shot count (calibration).
+uint32_t lapic_timer_count(void);
+
+#endif
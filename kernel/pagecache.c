@@ -0,0 +1,217 @@
+#include "pagecache.h"
+#include "paging.h"
+#include "pmm.h"
+#include "kmalloc.h"
+#include "klib.h"
+#include "x86.h"
+
+struct pcache_page {
+    struct vfs_node *node;       // holds a reference
+    uint32_t index;              // file offset / 4096
+    uint64_t frame;              // physical address
+    struct pcache_page *next;    // hash chain
+    struct pcache_page *clock_next, *clock_prev;   // ring of all cached pages
+};
+
+static struct kmem_cache *pcache_cache = 0;
+static struct pcache_page *buckets[PCACHE_BUCKETS];
+static struct pcache_page *clock_hand = 0;
+static uint64_t max_pages = 0;
+static struct pcache_stats stats;
+
+// Bumped by every write and invalidate, so a fill that raced with one
+// does not cache what it read.
+static uint64_t generation = 0;
+
+static inline uint32_t bucket_of(struct vfs_node *node, uint32_t index) {
+    return (uint32_t)(((uint64_t)node >> 4) ^ (index * 0x9E3779B1u)) % PCACHE_BUCKETS;
+}
+
+void pcache_init(void) {
+    pcache_cache = kmem_cache_create("pcache_page", sizeof(struct pcache_page), 0);
+    struct pmm_stats ps;
+    pmm_get_stats(&ps);
+    max_pages = ps.free_pages / PCACHE_RAM_SHARE;
+    if (max_pages < PCACHE_MIN_PAGES) max_pages = PCACHE_MIN_PAGES;
+}
+
+static struct pcache_page *lookup(struct vfs_node *node, uint32_t index) {
+    for (struct pcache_page *p = buckets[bucket_of(node, index)]; p; p = p->next) {
+        if (p->node == node && p->index == index) return p;
+    }
+    return 0;
+}
+
+static void insert(struct pcache_page *p) {
+    uint32_t b = bucket_of(p->node, p->index);
+    p->next = buckets[b];
+    buckets[b] = p;
+    // Behind the hand: the last page the clock will look at
+    if (clock_hand) {
+        p->clock_next = clock_hand;
+        p->clock_prev = clock_hand->clock_prev;
+        clock_hand->clock_prev->clock_next = p;
+        clock_hand->clock_prev = p;
+    } else {
+        p->clock_next = p->clock_prev = p;
+        clock_hand = p;
+    }
+    stats.pages++;
+}
+
+static void drop(struct pcache_page *p) {
+    struct pcache_page **pp = &buckets[bucket_of(p->node, p->index)];
+    while (*pp != p) pp = &(*pp)->next;
+    *pp = p->next;
+    if (p->clock_next == p) {
+        clock_hand = 0;
+    } else {
+        p->clock_prev->clock_next = p->clock_next;
+        p->clock_next->clock_prev = p->clock_prev;
+        if (clock_hand == p) clock_hand = p->clock_next;
+    }
+    pmm_free_page((void *)p->frame);
+    vfs_node_put(p->node);
+    kmem_cache_free(pcache_cache, p);
+    stats.pages--;
+}
+
+// A new descriptor, evicting the next page on the clock that no task has
+// mapped once the cache is at its limit.
+static struct pcache_page *take_slot(void) {
+    if (stats.pages >= max_pages) {
+        uint64_t n = stats.pages;
+        while (n--) {
+            struct pcache_page *p = clock_hand;
+            clock_hand = p->clock_next;
+            if (pmm_page_refcount((void *)p->frame) == 1) {
+                drop(p);
+                stats.evictions++;
+                break;
+            }
+        }
+        if (stats.pages >= max_pages) return 0;
+    }
+    return kmem_cache_alloc(pcache_cache);
+}
+
+// Frame holding page index of node, with a reference for the caller; 0 if
+// it could not be cached. The filesystem read runs with interrupts on.
+static uint64_t get_ref(struct vfs_node *node, uint32_t index) {
+    uint64_t flags = irq_save();
+    struct pcache_page *p = lookup(node, index);
+    if (p) {
+        stats.hits++;
+        pmm_page_ref((void *)p->frame);
+        irq_restore(flags);
+        return p->frame;
+    }
+    stats.misses++;
+    uint64_t gen = generation;
+    irq_restore(flags);
+
+    void *frame = pmm_alloc_page();
+    if (!frame) return 0;
+    pmm_set_owner(frame, PMM_OWNER_CACHE);
+    uint8_t *data = phys_to_virt((uint64_t)frame);
+    int got = vfs_read(node, index << 12, 4096, data);
+    if (got < 0) got = 0;
+    memset(data + got, 0, 4096 - got);
+
+    flags = irq_save();
+    // Someone may have filled the page while we were reading
+    p = lookup(node, index);
+    if (p) {
+        uint64_t ret = p->frame;
+        pmm_page_ref((void *)ret);
+        irq_restore(flags);
+        pmm_free_page(frame);
+        return ret;
+    }
+    p = generation == gen ? take_slot() : 0;
+    if (!p) {
+        irq_restore(flags);
+        pmm_free_page(frame);
+        return 0;
+    }
+    vfs_node_get(node);
+    p->node = node;
+    p->index = index;
+    p->frame = (uint64_t)frame;
+    insert(p);
+    pmm_page_ref(frame);
+    irq_restore(flags);
+    return (uint64_t)frame;
+}
+
+uint64_t pcache_get(struct vfs_node *node, uint32_t index) {
+    if (!node || !(node->flags & VFS_FILE)) return 0;
+    if ((uint64_t)index << 12 >= node->size) return 0;
+    return get_ref(node, index);
+}
+
+int pcache_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+    if (!node || !(node->flags & VFS_FILE)) return -1;
+    if (offset >= node->size) return 0;
+    if (size > node->size - offset) size = node->size - offset;
+
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t pos = offset + done;
+        // Pinned: faulting in the user buffer may evict it.
+        uint64_t frame = get_ref(node, pos >> 12);
+        if (!frame) {
+            // Cache full of mapped pages: fall back to the filesystem.
+            int got = vfs_read(node, pos, size - done, buffer + done);
+            return got < 0 ? (done ? (int)done : -1) : (int)(done + got);
+        }
+        uint32_t in_page = pos & 0xFFF;
+        uint32_t n = 4096 - in_page;
+        if (n > size - done) n = size - done;
+        memcpy(buffer + done, (uint8_t *)phys_to_virt(frame) + in_page, n);
+        pmm_free_page((void *)frame);
+        done += n;
+    }
+    return (int)done;
+}
+
+void pcache_update(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *buffer) {
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t pos = offset + done;
+        uint32_t in_page = pos & 0xFFF;
+        uint32_t n = 4096 - in_page;
+        if (n > size - done) n = size - done;
+
+        uint64_t flags = irq_save();
+        generation++;
+        struct pcache_page *p = lookup(node, pos >> 12);
+        uint64_t frame = p ? p->frame : 0;
+        if (frame) pmm_page_ref((void *)frame);
+        irq_restore(flags);
+        if (frame) {
+            memcpy((uint8_t *)phys_to_virt(frame) + in_page, buffer + done, n);
+            pmm_free_page((void *)frame);
+        }
+        done += n;
+    }
+}
+
+void pcache_invalidate(struct vfs_node *node) {
+    uint64_t flags = irq_save();
+    generation++;
+    uint64_t n = stats.pages;
+    struct pcache_page *p = clock_hand;
+    while (n--) {
+        struct pcache_page *next = p->clock_next;
+        if (p->node == node) drop(p);
+        p = next;
+    }
+    irq_restore(flags);
+}
+
+void pcache_get_stats(struct pcache_stats *out) {
+    uint64_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
@@ -0,0 +1,46 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+#include "fs/vfs.h"
+
+// Page cache: file contents in 4 KiB frames keyed by (node, page index),
+// filled from the filesystem on first use. SYS_READ copies out of it and
+// file mmap maps its frames straight into user space. The cache holds one
+// reference per frame; mappings take their own, so a cached page that is
+// mapped somewhere is never reclaimed from under it.
+
+#define PCACHE_RAM_SHARE  8      // cache at most 1/8 of the memory free at boot
+#define PCACHE_MIN_PAGES  256
+#define PCACHE_BUCKETS    256
+
+// Create the descriptor cache and size the cache from free memory. Call
+// once after pmm_init() and kmalloc_init().
+void pcache_init(void);
+
+// Physical frame holding page index of node, read in on a miss, with a
+// reference taken for the caller. Bytes past the end of the file are zero.
+// Returns 0 if the page lies past the end of the file or could not be
+// cached.
+uint64_t pcache_get(struct vfs_node *node, uint32_t index);
+
+// vfs_read() through the cache.
+int pcache_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer);
+
+// Keep cached pages in step after size bytes were written at offset.
+void pcache_update(struct vfs_node *node, uint32_t offset, uint32_t size, const uint8_t *buffer);
+
+// Forget every cached page of node (truncate, unlink). Frames still mapped
+// by a task live on until it unmaps them.
+void pcache_invalidate(struct vfs_node *node);
+
+struct pcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t pages;        // pages currently cached
+};
+
+void pcache_get_stats(struct pcache_stats *out);
+
+#endif
@@ -1,5 +1,9 @@
 #include "paging.h"
 #include "pmm.h"
+#include "klib.h"
+#include "smp.h"
+#include "x86.h"
+#include "bench.h"
 
 // Fresh 4 KiB page tables built in kernel .bss so we fully control them.
 // Identity-map the first 2 MiB with 4 KiB pages.
@@ -7,6 +11,10 @@
 #define PT_ENTRIES 512
 #define NUM_PT 8  // map first 16 MiB
 
+#define LARGE_PAGE_MASK  0x000FFFFFFFE00000ULL  // frame bits of a 2 MiB PDE
+#define LARGE_PAGE_ORDER PMM_MAX_ORDER          // 2 MiB = 2^9 frames
+#define PHYS_MASK        0x000FFFFFFFFFF000ULL  // frame bits of a 4 KiB entry
+
 uint64_t pml4[PT_ENTRIES] __attribute__((aligned(4096)));  // Non-static for debug
 uint64_t pdpt[PT_ENTRIES] __attribute__((aligned(4096)));  // Non-static for debug
 uint64_t pd[PT_ENTRIES]   __attribute__((aligned(4096)));  // Non-static for debug
@@ -15,6 +23,51 @@ uint64_t pt[NUM_PT][PT_ENTRIES] __attribute__((aligned(4096)));  // Non-static f
 // Keep a pointer to kernel PML4 to copy into user spaces
 static uint64_t *kernel_pml4;
 
+// Address-space tags (PCIDs). Tag 0 is the kernel's and the fallback when
+// the CPU has no PCID or the tags run out; pcid_owner remembers which PML4
+// a tag last held, so a tag that changes hands is flushed on its next load.
+// A space is only edited while loaded, but it may have moved to another
+// CPU meanwhile: pcid_cpu remembers where the tag was last loaded, and
+// loading it on any other CPU flushes it too.
+#define PCID_COUNT     256
+#define CR3_NOFLUSH    (1ULL << 63)
+#define CR4_PCIDE      (1ULL << 17)
+static int pcid_enabled;
+static uint8_t pcid_used[PCID_COUNT];
+static uint64_t pcid_owner[PCID_COUNT];
+static uint8_t pcid_cpu[PCID_COUNT];
+static uint64_t loaded_cr3[MAX_CPUS];       // PML4 | tag currently in CR3
+static struct paging_stats pg_stats;
+
+// Paging features of this CPU. CR3 must hold tag 0.
+static void enable_cpu_features(void) {
+    // CR4.PGE: PAGE_GLOBAL mappings of the shared kernel subtrees stay in
+    // the TLB across CR3 switches. The identity map is not global — the
+    // bootstrap tables above carry user bits that per-process spaces don't.
+    uint64_t cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 1ULL << 7;
+
+    // CR4.PCIDE (CPUID.1:ECX[17]): TLB entries are tagged with CR3[11:0], so
+    // switching address spaces need not drop the other spaces' entries.
+    // CR3 holds tag 0 right now, as enabling requires.
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (ecx & (1u << 17)) {
+        cr4 |= CR4_PCIDE;
+        pcid_enabled = 1;
+    }
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+
+    // CR0.WP: make read-only PTEs apply to the kernel too, so kernel writes
+    // into copy-on-write user pages (syscall output buffers) fault and get
+    // their private copy like user writes do.
+    uint64_t cr0;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= 1ULL << 16;
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
 void paging_init(void) {
     // Initialize kernel_pml4 pointer
     kernel_pml4 = pml4;
@@ -76,12 +129,30 @@ void paging_init(void) {
     // Load new page tables
     uint64_t new_cr3 = (uint64_t)pml4;
     __asm__ volatile ("mov %0, %%cr3" : : "r"(new_cr3) : "memory");
+
+    enable_cpu_features();
+    loaded_cr3[cpu_id()] = new_cr3;
+    pcid_owner[0] = new_cr3;
+    pcid_cpu[0] = cpu_id();
+    pcid_used[0] = 1;
+}
+
+void paging_init_ap(void) {
+    // The trampoline loaded the kernel tables with tag 0
+    enable_cpu_features();
+    loaded_cr3[cpu_id()] = (uint64_t)kernel_pml4;
 }
 
 static inline void invlpg(uint64_t addr) {
     __asm__ volatile ("invlpg (%0)" : : "r"(addr) : "memory");
 }
 
+// invlpg only reaches the loaded tag. Edits to the bootstrap tables made
+// under another space leave tag 0 stale: flush it on its next load.
+static void bootstrap_tables_changed(void) {
+    if ((loaded_cr3[cpu_id()] & ~0xFFFULL) != (uint64_t)kernel_pml4) pcid_owner[0] = 0;
+}
+
 void paging_mark_user_region(uint64_t addr, uint64_t size) {
     uint64_t start = addr & ~0xFFFULL;
     uint64_t end   = (addr + size + 0xFFFULL) & ~0xFFFULL;
@@ -93,6 +164,7 @@ void paging_mark_user_region(uint64_t addr, uint64_t size) {
             invlpg(a);  // Flush TLB for this page
         }
     }
+    bootstrap_tables_changed();
 }
 
 void paging_mark_supervisor_region(uint64_t addr, uint64_t size) {
@@ -107,51 +179,124 @@ void paging_mark_supervisor_region(uint64_t addr, uint64_t size) {
             invlpg(a);  // Flush TLB for this page
         }
     }
+    bootstrap_tables_changed();
+}
+
+// ---------------------------------------------------------------------------
+// Direct map
+// ---------------------------------------------------------------------------
+
+// GiB-sized stretches of the direct map that can be built from 2 MiB pages
+// when the CPU has no 1 GiB pages or the stretch is only partly RAM.
+#define DIRECT_PD_COUNT 8
+
+static uint64_t direct_pdpt[PT_ENTRIES] __attribute__((aligned(4096)));
+static uint64_t direct_pd[DIRECT_PD_COUNT][PT_ENTRIES] __attribute__((aligned(4096)));
+
+uint64_t paging_init_direct_map(void) {
+    uint64_t top = pmm_boot_ram_top();
+    uint64_t flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL;
+
+    // CPUID.80000001h:EDX[26]: 1 GiB pages
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    int gb_pages = (edx >> 26) & 1;
+
+    // Only RAM is mapped, so MMIO holes never get a cached alias. A GiB
+    // that is all RAM takes one 1 GiB page; otherwise 2 MiB pages cover the
+    // parts that hold RAM, plus the first 2 MiB where the kernel lives.
+    uint64_t mapped = 0;
+    int pds = 0;
+    for (uint64_t gb = 0; gb < PT_ENTRIES && (gb << 30) < top; gb++) {
+        uint64_t base = gb << 30;
+        int ram = pmm_boot_ram_in(base, base + (1ULL << 30));
+        if (ram == 2 && gb_pages) {
+            direct_pdpt[gb] = base | flags | PAGE_PSE;
+        } else if (ram || gb == 0) {
+            if (pds == DIRECT_PD_COUNT) break;
+            uint64_t *pd_l = direct_pd[pds++];
+            for (int k = 0; k < PT_ENTRIES; k++) {
+                uint64_t a = base + ((uint64_t)k << 21);
+                if (a == 0 || pmm_boot_ram_in(a, a + 0x200000)) {
+                    pd_l[k] = a | flags | PAGE_PSE;
+                }
+            }
+            direct_pdpt[gb] = (uint64_t)pd_l | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+        mapped = base + (1ULL << 30);
+    }
+
+    kernel_pml4[(DIRECT_MAP_BASE >> 39) & 0x1FF] =
+        (uint64_t)direct_pdpt | PAGE_PRESENT | PAGE_WRITABLE;
+    return mapped < top ? mapped : top;
 }
 
 // ---------------------------------------------------------------------------
-// Helpers for per-task address spaces (identity mapping for now)
+// Helpers for per-task address spaces
 // ---------------------------------------------------------------------------
 
-// Allocate and zero a new page table level
-static uint64_t *alloc_pt_page(void) {
-    extern void *pmm_alloc_page(void);
-    uint64_t *page = (uint64_t *)pmm_alloc_page();
-    if (!page) return 0;
-    for (int i = 0; i < PT_ENTRIES; i++) page[i] = 0;
-    return page;
+// Table referenced by an entry or a PML4 address, through the direct map.
+static inline uint64_t *table_at(uint64_t entry) {
+    return (uint64_t *)phys_to_virt(entry & PHYS_MASK);
+}
+
+// Allocate a new, zeroed page table level. Returns its physical address.
+static uint64_t alloc_pt_page(void) {
+    void *page = pmm_alloc_zeroed_page();
+    if (page) pmm_set_owner(page, PMM_OWNER_PAGETABLE);
+    return (uint64_t)page;
+}
+
+// Return the table referenced by parent[idx], allocating it if missing.
+static uint64_t *get_or_alloc_table(uint64_t *parent, int idx, uint64_t hier) {
+    if (parent[idx] & PAGE_PRESENT) return table_at(parent[idx]);
+    uint64_t table = alloc_pt_page();
+    if (!table) return 0;
+    parent[idx] = table | hier;
+    return table_at(table);
 }
 
 uint64_t *paging_new_user_space(void) {
-    uint64_t *new_pml4 = alloc_pt_page();
-    uint64_t *new_pdpt = alloc_pt_page();
-    uint64_t *new_pd   = alloc_pt_page();
-    if (!new_pml4 || !new_pdpt || !new_pd) {
+    uint64_t pml4_pa = alloc_pt_page();
+    uint64_t pdpt_pa = alloc_pt_page();
+    uint64_t pd_pa   = alloc_pt_page();
+    if (!pml4_pa || !pdpt_pa || !pd_pa) {
+        if (pml4_pa) pmm_free_page((void *)pml4_pa);
+        if (pdpt_pa) pmm_free_page((void *)pdpt_pa);
+        if (pd_pa) pmm_free_page((void *)pd_pa);
         return 0;
     }
+    uint64_t *new_pml4 = table_at(pml4_pa);
+    uint64_t *new_pdpt = table_at(pdpt_pa);
+    uint64_t *new_pd   = table_at(pd_pa);
 
     // Intermediate table entries need USER bit so user-mapped pages deeper
-    // in the hierarchy are reachable.  The leaf PT entries for the identity
+    // in the hierarchy are reachable.  The leaf entries for the identity
     // map are supervisor-only, which is what actually blocks user access.
     uint64_t flags_hier = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
     uint64_t flags_sup  = PAGE_PRESENT | PAGE_WRITABLE;
 
-    new_pml4[0] = ((uint64_t)new_pdpt) | flags_hier;
-    new_pdpt[0] = ((uint64_t)new_pd)   | flags_hier;
+    new_pml4[0] = pdpt_pa | flags_hier;
+    new_pdpt[0] = pd_pa   | flags_hier;
 
+    // All identity-mapped memory is supervisor-only, so it can use 2 MiB
+    // pages directly in the PD instead of one PT per 2 MiB.
+    // User code gets access only via paging_map_user_page().
     for (int p = 0; p < NUM_PT; p++) {
-        uint64_t *new_pt = alloc_pt_page();
-        if (!new_pt) return 0;
-        new_pd[p] = (uint64_t)new_pt | flags_hier;
-        for (int i = 0; i < PT_ENTRIES; i++) {
-            uint64_t addr = ((uint64_t)p * 0x200000) + ((uint64_t)i * 0x1000);
-            // All identity-mapped pages are supervisor-only.
-            // User code gets access only via paging_map_user_page().
-            new_pt[i] = addr | flags_sup;
-        }
+        new_pd[p] = ((uint64_t)p * 0x200000) | flags_sup | PAGE_PSE;
+    }
+
+    // Everything else the kernel maps (direct map, framebuffer, ...) lives
+    // in kernel-owned subtrees: link them in rather than copying. The first
+    // PD is not shared because user memory starts inside it.
+    for (int j = 1; j < PT_ENTRIES; j++) {
+        if (pdpt[j] & PAGE_PRESENT) new_pdpt[j] = pdpt[j] | PAGE_KERNEL_SHARED;
+    }
+    for (int i = 1; i < PT_ENTRIES; i++) {
+        if (kernel_pml4[i] & PAGE_PRESENT) new_pml4[i] = kernel_pml4[i] | PAGE_KERNEL_SHARED;
     }
 
-    return new_pml4;
+    return (uint64_t *)pml4_pa;
 }
 
 int paging_map_page(uint64_t *pml4, uint64_t addr, uint64_t flags) {
@@ -160,14 +305,14 @@ int paging_map_page(uint64_t *pml4, uint64_t addr, uint64_t flags) {
     uint64_t pd_idx   = (addr >> 21) & 0x1FF;
     uint64_t pt_idx   = (addr >> 12) & 0x1FF;
 
-    uint64_t *pdpt_l = (uint64_t *)(pml4[pml4_idx] & ~0xFFFULL);
-    if (!pdpt_l) return -1;
-    uint64_t *pd_l = (uint64_t *)(pdpt_l[pdpt_idx] & ~0xFFFULL);
-    if (!pd_l) return -1;
-    uint64_t *pt_l = (uint64_t *)(pd_l[pd_idx] & ~0xFFFULL);
-    if (!pt_l) return -1;
+    uint64_t e = table_at((uint64_t)pml4)[pml4_idx];
+    if (!(e & PAGE_PRESENT)) return -1;
+    e = table_at(e)[pdpt_idx];
+    if (!(e & PAGE_PRESENT)) return -1;
+    e = table_at(e)[pd_idx];
+    if (!(e & PAGE_PRESENT)) return -1;
 
-    pt_l[pt_idx] = (addr & ~0xFFFULL) | flags | PAGE_PRESENT;
+    table_at(e)[pt_idx] = (addr & ~0xFFFULL) | flags | PAGE_PRESENT;
     return 0;
 }
 
@@ -175,160 +320,247 @@ int paging_map_page(uint64_t *pml4, uint64_t addr, uint64_t flags) {
 // Per-process virtual memory helpers
 // ---------------------------------------------------------------------------
 
-static void memcpy_pg(void *dst, const void *src, uint64_t n) {
-    uint8_t *d = (uint8_t *)dst;
-    const uint8_t *s = (const uint8_t *)src;
-    while (n--) *d++ = *s++;
+// Whether changes to pml4 can be stale in the TLB right now. Other spaces
+// are flushed when they are next loaded (see paging_switch).
+static int is_live(uint64_t *pml4) {
+    return (loaded_cr3[cpu_id()] & ~0xFFFULL) == (uint64_t)pml4;
 }
 
-static void memset_pg(void *dst, int val, uint64_t n) {
-    uint8_t *d = (uint8_t *)dst;
-    while (n--) *d++ = (uint8_t)val;
-}
+int paging_map_range(uint64_t *target_pml4, uint64_t vaddr, const uint64_t *frames,
+                     uint64_t paddr, uint64_t npages, uint64_t flags) {
+    uint64_t hier = PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+    int flush = is_live(target_pml4) || (flags & PAGE_GLOBAL);
+    uint64_t *pml4_l = table_at((uint64_t)target_pml4);
+
+    // The PT cursor is kept across pages and re-walked only when the
+    // range enters the next 2 MiB stretch.
+    uint64_t *pt_l = 0;
+    for (uint64_t i = 0; i < npages; i++, vaddr += 0x1000) {
+        uint64_t pt_idx = (vaddr >> 12) & 0x1FF;
+        if (!pt_l || pt_idx == 0) {
+            uint64_t *pdpt_l = get_or_alloc_table(pml4_l, (vaddr >> 39) & 0x1FF, hier);
+            if (!pdpt_l) return -1;
+            uint64_t *pd_l = get_or_alloc_table(pdpt_l, (vaddr >> 30) & 0x1FF, hier);
+            if (!pd_l) return -1;
+            uint64_t pd_idx = (vaddr >> 21) & 0x1FF;
+            if (pd_l[pd_idx] & PAGE_PSE) return -1;  // a 2 MiB page covers this address
+            pt_l = get_or_alloc_table(pd_l, pd_idx, hier);
+            if (!pt_l) return -1;
+        }
 
-int paging_map_user_page(uint64_t *target_pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
-    uint64_t pml4_idx = (vaddr >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (vaddr >> 30) & 0x1FF;
-    uint64_t pd_idx   = (vaddr >> 21) & 0x1FF;
-    uint64_t pt_idx   = (vaddr >> 12) & 0x1FF;
+        uint64_t frame = frames ? frames[i] : paddr + i * 0x1000;
+        pt_l[pt_idx] = (frame & ~0xFFFULL) | flags | PAGE_PRESENT;
+        if (flush) invlpg(vaddr);
+    }
+    return 0;
+}
 
-    uint64_t hier = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+// PD covering vaddr, or 0 if the upper levels are not present.
+static uint64_t *lookup_pd(uint64_t *target_pml4, uint64_t vaddr) {
+    uint64_t e = table_at((uint64_t)target_pml4)[(vaddr >> 39) & 0x1FF];
+    if (!(e & PAGE_PRESENT)) return 0;
+    e = table_at(e)[(vaddr >> 30) & 0x1FF];
+    if (!(e & PAGE_PRESENT) || (e & PAGE_PSE)) return 0;
+    return table_at(e);
+}
 
-    // Get or create PDPT
-    uint64_t *pdpt_l;
-    if (!(target_pml4[pml4_idx] & PAGE_PRESENT)) {
-        pdpt_l = alloc_pt_page();
-        if (!pdpt_l) return -1;
-        target_pml4[pml4_idx] = (uint64_t)pdpt_l | hier;
-    } else {
-        pdpt_l = (uint64_t *)(target_pml4[pml4_idx] & ~0xFFFULL);
+// Turn a 2 MiB mapping into a PT of 4 KiB mappings of the same frames, so
+// part of it can be unmapped. A large user page still shared copy-on-write
+// cannot be split: the other sharers free it as one block.
+static int split_large(uint64_t *pde) {
+    uint64_t e = *pde;
+    uint64_t base = e & LARGE_PAGE_MASK;
+    if ((e & PAGE_USERALLOC) && pmm_page_refcount((void *)base) > 1) return -1;
+
+    uint64_t pt_pa = alloc_pt_page();
+    if (!pt_pa) return -1;
+    uint64_t *pt_l = table_at(pt_pa);
+    uint64_t flags = e & 0xFFFULL & ~PAGE_PSE;
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        pt_l[i] = (base + ((uint64_t)i << 12)) | flags;
     }
+    if (e & PAGE_USERALLOC) pmm_split_pages((void *)base, LARGE_PAGE_ORDER);
+    *pde = pt_pa | PAGE_PRESENT | PAGE_WRITABLE | (e & PAGE_USER);
+    return 0;
+}
 
-    // Get or create PD
-    uint64_t *pd_l;
-    if (!(pdpt_l[pdpt_idx] & PAGE_PRESENT)) {
-        pd_l = alloc_pt_page();
-        if (!pd_l) return -1;
-        pdpt_l[pdpt_idx] = (uint64_t)pd_l | hier;
-    } else {
-        pd_l = (uint64_t *)(pdpt_l[pdpt_idx] & ~0xFFFULL);
+int paging_unmap_range(uint64_t *target_pml4, uint64_t vaddr, uint64_t npages) {
+    int flush = is_live(target_pml4);
+    uint64_t end = vaddr + npages * 0x1000;
+
+    // One PD lookup per 2 MiB stretch.
+    while (vaddr < end) {
+        uint64_t next = (vaddr + 0x200000) & ~0x1FFFFFULL;
+        uint64_t *pd_l = lookup_pd(target_pml4, vaddr);
+        uint64_t pd_idx = (vaddr >> 21) & 0x1FF;
+        int whole = !(vaddr & 0x1FFFFF) && end >= next;
+
+        // A large page only partly in the range is split first.
+        if (pd_l && (pd_l[pd_idx] & PAGE_PSE) && !whole) {
+            if (split_large(&pd_l[pd_idx]) < 0) return -1;
+            if (flush) invlpg(vaddr);
+        }
+
+        if (!pd_l || !(pd_l[pd_idx] & PAGE_PRESENT)) {
+            // nothing mapped here
+        } else if (pd_l[pd_idx] & PAGE_PSE) {
+            uint64_t e = pd_l[pd_idx];
+            pd_l[pd_idx] = 0;
+            if (e & PAGE_USERALLOC)
+                pmm_free_pages((void *)(e & LARGE_PAGE_MASK), LARGE_PAGE_ORDER);
+            if (flush) invlpg(vaddr);
+        } else {
+            uint64_t *pt_l = table_at(pd_l[pd_idx]);
+            uint64_t stop = next < end ? next : end;
+            for (uint64_t a = vaddr; a < stop; a += 0x1000) {
+                uint64_t e = pt_l[(a >> 12) & 0x1FF];
+                if (!(e & PAGE_PRESENT)) continue;
+                pt_l[(a >> 12) & 0x1FF] = 0;
+                if (e & PAGE_USERALLOC) pmm_free_page((void *)(e & PHYS_MASK));
+                if (flush) invlpg(a);
+            }
+        }
+        vaddr = next;
     }
+    return 0;
+}
 
-    // Get or create PT
-    uint64_t *pt_l;
-    if (!(pd_l[pd_idx] & PAGE_PRESENT)) {
-        pt_l = alloc_pt_page();
-        if (!pt_l) return -1;
-        pd_l[pd_idx] = (uint64_t)pt_l | hier;
-    } else {
-        pt_l = (uint64_t *)(pd_l[pd_idx] & ~0xFFFULL);
+int paging_user_range_ok(uint64_t start, uint64_t end) {
+    if (end <= start || start < USER_VADDR_BASE || end > USER_MMAP_END) return 0;
+    // Stay out of subtrees the kernel links into every space.
+    for (uint64_t gb = start >> 30; gb <= (end - 1) >> 30 && gb < PT_ENTRIES; gb++) {
+        if (gb && (pdpt[gb] & PAGE_PRESENT)) return 0;
     }
+    for (uint64_t slot = start >> 39; slot <= (end - 1) >> 39; slot++) {
+        if (slot && (kernel_pml4[slot] & PAGE_PRESENT)) return 0;
+    }
+    return 1;
+}
 
-    // Map the page, marking it as user-allocated for later cleanup
-    pt_l[pt_idx] = (paddr & ~0xFFFULL) | flags | PAGE_PRESENT | PAGE_USERALLOC;
-    invlpg(vaddr);
-    return 0;
+int paging_map_user_page(uint64_t *target_pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    // Marked as user-allocated for later cleanup
+    return paging_map_range(target_pml4, vaddr, 0, paddr, 1, flags | PAGE_USERALLOC);
 }
+
 int paging_map_kernel_page(uint64_t *target_pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
-    uint64_t pml4_idx = (vaddr >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (vaddr >> 30) & 0x1FF;
-    uint64_t pd_idx   = (vaddr >> 21) & 0x1FF;
-    uint64_t pt_idx   = (vaddr >> 12) & 0x1FF;
+    return paging_map_range(target_pml4, vaddr, 0, paddr, 1, flags);
+}
 
-    uint64_t hier = PAGE_PRESENT | PAGE_WRITABLE;
+uint64_t paging_virt_to_phys(uint64_t *target_pml4, uint64_t vaddr) {
+    uint64_t e = table_at((uint64_t)target_pml4)[(vaddr >> 39) & 0x1FF];
+    if (!(e & PAGE_PRESENT)) return 0;
 
-    // Get or create PDPT
-    uint64_t *pdpt_l;
-    if (!(target_pml4[pml4_idx] & PAGE_PRESENT)) {
-        pdpt_l = alloc_pt_page();
-        if (!pdpt_l) return -1;
-        target_pml4[pml4_idx] = (uint64_t)pdpt_l | hier;
-    } else {
-        pdpt_l = (uint64_t *)(target_pml4[pml4_idx] & ~0xFFFULL);
+    e = table_at(e)[(vaddr >> 30) & 0x1FF];
+    if (!(e & PAGE_PRESENT)) return 0;
+    if (e & PAGE_PSE) {
+        return (e & 0x000FFFFFC0000000ULL) | (vaddr & 0x3FFFFFFF);
     }
 
-    // Get or create PD
-    uint64_t *pd_l;
-    if (!(pdpt_l[pdpt_idx] & PAGE_PRESENT)) {
-        pd_l = alloc_pt_page();
-        if (!pd_l) return -1;
-        pdpt_l[pdpt_idx] = (uint64_t)pd_l | hier;
-    } else {
-        pd_l = (uint64_t *)(pdpt_l[pdpt_idx] & ~0xFFFULL);
+    e = table_at(e)[(vaddr >> 21) & 0x1FF];
+    if (!(e & PAGE_PRESENT)) return 0;
+    if (e & PAGE_PSE) {
+        return (e & LARGE_PAGE_MASK) | (vaddr & 0x1FFFFF);
     }
 
-    // Get or create PT
-    uint64_t *pt_l;
-    if (!(pd_l[pd_idx] & PAGE_PRESENT)) {
-        pt_l = alloc_pt_page();
-        if (!pt_l) return -1;
-        pd_l[pd_idx] = (uint64_t)pt_l | hier;
-    } else {
-        pt_l = (uint64_t *)(pd_l[pd_idx] & ~0xFFFULL);
-    }
+    e = table_at(e)[(vaddr >> 12) & 0x1FF];
+    if (!(e & PAGE_PRESENT)) return 0;
 
-    // Map the page, marking it as user-allocated for later cleanup
-    pt_l[pt_idx] = (paddr & ~0xFFFULL) | flags | PAGE_PRESENT;
-    invlpg(vaddr);
-    return 0;
+    return (e & PHYS_MASK) | (vaddr & 0xFFF);
 }
 
-uint64_t paging_virt_to_phys(uint64_t *target_pml4, uint64_t vaddr) {
-    uint64_t pml4_idx = (vaddr >> 39) & 0x1FF;
-    if (!(target_pml4[pml4_idx] & PAGE_PRESENT)) return 0;
-    uint64_t *pdpt_l = (uint64_t *)(target_pml4[pml4_idx] & ~0xFFFULL);
+int paging_map_large(uint64_t *target_pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    if ((vaddr | paddr) & 0x1FFFFF) return -1;
 
+    uint64_t pml4_idx = (vaddr >> 39) & 0x1FF;
     uint64_t pdpt_idx = (vaddr >> 30) & 0x1FF;
-    if (!(pdpt_l[pdpt_idx] & PAGE_PRESENT)) return 0;
-    uint64_t *pd_l = (uint64_t *)(pdpt_l[pdpt_idx] & ~0xFFFULL);
+    uint64_t pd_idx   = (vaddr >> 21) & 0x1FF;
 
-    uint64_t pd_idx = (vaddr >> 21) & 0x1FF;
-    if (!(pd_l[pd_idx] & PAGE_PRESENT)) return 0;
-    uint64_t *pt_l = (uint64_t *)(pd_l[pd_idx] & ~0xFFFULL);
+    uint64_t hier = PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
 
-    uint64_t pt_idx = (vaddr >> 12) & 0x1FF;
-    if (!(pt_l[pt_idx] & PAGE_PRESENT)) return 0;
+    uint64_t *pdpt_l = get_or_alloc_table(table_at((uint64_t)target_pml4), pml4_idx, hier);
+    if (!pdpt_l) return -1;
+    if (pdpt_l[pdpt_idx] & PAGE_PSE) return -1;
+    uint64_t *pd_l = get_or_alloc_table(pdpt_l, pdpt_idx, hier);
+    if (!pd_l) return -1;
 
-    return (pt_l[pt_idx] & ~0xFFFULL) | (vaddr & 0xFFF);
+    // Do not silently drop a PT of 4 KiB mappings.
+    if ((pd_l[pd_idx] & PAGE_PRESENT) && !(pd_l[pd_idx] & PAGE_PSE)) return -1;
+
+    pd_l[pd_idx] = paddr | flags | PAGE_PRESENT | PAGE_PSE;
+    if (is_live(target_pml4) || (flags & PAGE_GLOBAL)) invlpg(vaddr);
+    return 0;
+}
+
+int paging_map_kernel_range(uint64_t *target_pml4, uint64_t start, uint64_t end, uint64_t flags) {
+    start &= ~0xFFFULL;
+    end = (end + 0xFFFULL) & ~0xFFFULL;
+    uint64_t addr = start;
+    while (addr < end) {
+        if (!(addr & 0x1FFFFF) && end - addr >= 0x200000 &&
+            paging_map_large(target_pml4, addr, addr, flags) == 0) {
+            addr += 0x200000;
+            continue;
+        }
+        // 4 KiB pages up to the next 2 MiB boundary, in one walk
+        uint64_t stop = (addr + 0x200000) & ~0x1FFFFFULL;
+        if (stop > end) stop = end;
+        uint64_t n = (stop - addr) >> 12;
+        if (paging_map_range(target_pml4, addr, 0, addr, n, flags) < 0) return -1;
+        addr = stop;
+    }
+    return 0;
 }
 
 void paging_free_user_space(uint64_t *user_pml4) {
     if (!user_pml4) return;
+    uint64_t *pml4_l = table_at((uint64_t)user_pml4);
 
     // Walk all four levels.  Free any leaf page that carries PAGE_USERALLOC
     // (these are pages we allocated for user code/data/stack).
     // Also free ALL intermediate page table pages (PML4, PDPT, PD, PT)
     // since they were all allocated from PMM per-process.
+    // Subtrees marked PAGE_KERNEL_SHARED belong to the kernel and are skipped.
     for (int i = 0; i < PT_ENTRIES; i++) {
-        if (!(user_pml4[i] & PAGE_PRESENT)) continue;
-        uint64_t *pdpt_l = (uint64_t *)(user_pml4[i] & ~0xFFFULL);
+        if (!(pml4_l[i] & PAGE_PRESENT)) continue;
+        if (pml4_l[i] & PAGE_KERNEL_SHARED) continue;
+        uint64_t *pdpt_l = table_at(pml4_l[i]);
 
         for (int j = 0; j < PT_ENTRIES; j++) {
             if (!(pdpt_l[j] & PAGE_PRESENT)) continue;
-            uint64_t *pd_l = (uint64_t *)(pdpt_l[j] & ~0xFFFULL);
+            if (pdpt_l[j] & PAGE_KERNEL_SHARED) continue;
+            uint64_t *pd_l = table_at(pdpt_l[j]);
 
             for (int k = 0; k < PT_ENTRIES; k++) {
                 if (!(pd_l[k] & PAGE_PRESENT)) continue;
-                uint64_t *pt_l = (uint64_t *)(pd_l[k] & ~0xFFFULL);
+                if (pd_l[k] & PAGE_PSE) {
+                    // 2 MiB leaf: free it if it is user memory, never the
+                    // identity map or the framebuffer.
+                    if (pd_l[k] & PAGE_USERALLOC) {
+                        pmm_free_pages((void *)(pd_l[k] & LARGE_PAGE_MASK), LARGE_PAGE_ORDER);
+                    }
+                    pd_l[k] = 0;
+                    continue;
+                }
+                uint64_t *pt_l = table_at(pd_l[k]);
 
                 // Free user-allocated leaf pages (code, data, stack)
                 for (int l = 0; l < PT_ENTRIES; l++) {
                     if ((pt_l[l] & PAGE_PRESENT) && (pt_l[l] & PAGE_USERALLOC)) {
-                        pmm_free_page((void *)(pt_l[l] & ~0xFFFULL));
+                        pmm_free_page((void *)(pt_l[l] & PHYS_MASK));
                         pt_l[l] = 0;
                     }
                 }
 
                 // Free the PT page itself (allocated per-process)
-                pmm_free_page(pt_l);
+                pmm_free_page((void *)(pd_l[k] & PHYS_MASK));
             }
 
             // Free PD page
-            pmm_free_page(pd_l);
+            pmm_free_page((void *)(pdpt_l[j] & PHYS_MASK));
         }
 
         // Free PDPT page
-        pmm_free_page(pdpt_l);
+        pmm_free_page((void *)(pml4_l[i] & PHYS_MASK));
     }
 
     // Free PML4 itself
@@ -336,47 +568,261 @@ void paging_free_user_space(uint64_t *user_pml4) {
 }
 
 int paging_clone_user_pages(uint64_t *dst_pml4, uint64_t *src_pml4) {
-    // Walk src page tables.  For every leaf entry with PAGE_USERALLOC,
-    // allocate a fresh physical page, copy contents, and map it at the
-    // same virtual address in dst.
-    for (int i = 0; i < PT_ENTRIES; i++) {
-        if (!(src_pml4[i] & PAGE_PRESENT)) continue;
-        uint64_t *pdpt_s = (uint64_t *)(src_pml4[i] & ~0xFFFULL);
+    // Walk src page tables.  Every leaf entry with PAGE_USERALLOC is shared
+    // with dst instead of copied: writable pages become read-only +
+    // PAGE_COW in both spaces and the frame gains a reference.  The first
+    // write on either side takes a private copy in paging_handle_cow_fault().
+    // PAGE_SHARED frames stay writable: both spaces keep seeing one frame.
+    // dst tables are built alongside the src walk, so each PT is found or
+    // allocated once rather than walking four levels per page.
+    uint64_t hier = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+    uint64_t *src_l = table_at((uint64_t)src_pml4);
+    uint64_t *dst_l = table_at((uint64_t)dst_pml4);
+    int rc = 0;
 
-        for (int j = 0; j < PT_ENTRIES; j++) {
+    for (int i = 0; i < PT_ENTRIES && rc == 0; i++) {
+        if (!(src_l[i] & PAGE_PRESENT)) continue;
+        if (src_l[i] & PAGE_KERNEL_SHARED) continue;  // already linked in dst
+        uint64_t *pdpt_s = table_at(src_l[i]);
+
+        for (int j = 0; j < PT_ENTRIES && rc == 0; j++) {
             if (!(pdpt_s[j] & PAGE_PRESENT)) continue;
-            uint64_t *pd_s = (uint64_t *)(pdpt_s[j] & ~0xFFFULL);
+            if (pdpt_s[j] & PAGE_KERNEL_SHARED) continue;
+            uint64_t *pd_s = table_at(pdpt_s[j]);
 
-            for (int k = 0; k < PT_ENTRIES; k++) {
+            for (int k = 0; k < PT_ENTRIES && rc == 0; k++) {
                 if (!(pd_s[k] & PAGE_PRESENT)) continue;
-                uint64_t *pt_s = (uint64_t *)(pd_s[k] & ~0xFFFULL);
+                if (pd_s[k] & PAGE_PSE) {
+                    // 2 MiB user page: shared copy-on-write like 4 KiB ones.
+                    if (!(pd_s[k] & PAGE_USERALLOC)) continue;
+                    uint64_t *pdpt_d = get_or_alloc_table(dst_l, i, hier);
+                    uint64_t *pd_d = pdpt_d ? get_or_alloc_table(pdpt_d, j, hier) : 0;
+                    if (!pd_d) { rc = -1; break; }
+                    if (pd_s[k] & PAGE_WRITABLE) {
+                        pd_s[k] = (pd_s[k] & ~PAGE_WRITABLE) | PAGE_COW;
+                    }
+                    pmm_page_ref((void *)(pd_s[k] & LARGE_PAGE_MASK));
+                    pd_d[k] = pd_s[k];
+                    continue;
+                }
+                uint64_t *pt_s = table_at(pd_s[k]);
+                uint64_t *pt_d = 0;
 
                 for (int l = 0; l < PT_ENTRIES; l++) {
                     if (!(pt_s[l] & PAGE_PRESENT)) continue;
                     if (!(pt_s[l] & PAGE_USERALLOC)) continue;
 
-                    uint64_t src_pa = pt_s[l] & ~0xFFFULL;
-                    uint64_t flags  = pt_s[l] & 0xFFFULL;
-
-                    // Reconstruct the virtual address from indices
-                    uint64_t vaddr = ((uint64_t)i << 39) | ((uint64_t)j << 30) |
-                                     ((uint64_t)k << 21) | ((uint64_t)l << 12);
-
-                    // Allocate fresh page and copy
-                    void *new_page = pmm_alloc_page();
-                    if (!new_page) return -1;
-                    memcpy_pg(new_page, (void *)src_pa, 4096);
+                    if (!pt_d) {
+                        uint64_t *pdpt_d = get_or_alloc_table(dst_l, i, hier);
+                        uint64_t *pd_d = pdpt_d ? get_or_alloc_table(pdpt_d, j, hier) : 0;
+                        pt_d = pd_d ? get_or_alloc_table(pd_d, k, hier) : 0;
+                        if (!pt_d) { rc = -1; break; }
+                    }
 
-                    // Map in destination
-                    if (paging_map_user_page(dst_pml4, vaddr, (uint64_t)new_page, flags) < 0)
-                        return -1;
+                    if ((pt_s[l] & PAGE_WRITABLE) && !(pt_s[l] & PAGE_SHARED)) {
+                        pt_s[l] = (pt_s[l] & ~PAGE_WRITABLE) | PAGE_COW;
+                    }
+                    pmm_page_ref((void *)(pt_s[l] & PHYS_MASK));
+                    pt_d[l] = pt_s[l];
                 }
             }
         }
     }
+
+    // Parent PTEs lost their write bit; drop any stale writable TLB entries.
+    uint64_t cr3;
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
+    if ((cr3 & ~0xFFFULL) == (uint64_t)src_pml4) {
+        __asm__ volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+    return rc;
+}
+
+static int handle_large_cow(uint64_t *pde, uint64_t vaddr) {
+    uint64_t entry = *pde;
+    if (!(entry & PAGE_COW)) return -1;
+
+    uint64_t old_page = entry & LARGE_PAGE_MASK;
+    uint64_t flags = (entry & ~LARGE_PAGE_MASK & ~PAGE_COW) | PAGE_WRITABLE;
+
+    if (pmm_page_refcount((void *)old_page) > 1) {
+        void *new_page = pmm_alloc_pages(LARGE_PAGE_ORDER);
+        if (!new_page) return -1;
+        pmm_set_owner(new_page, PMM_OWNER_USER_ANON);
+        memcpy(phys_to_virt((uint64_t)new_page), phys_to_virt(old_page), 0x200000);
+        *pde = (uint64_t)new_page | flags;
+        pmm_free_pages((void *)old_page, LARGE_PAGE_ORDER);
+    } else {
+        *pde = old_page | flags;
+    }
+    invlpg(vaddr);
+    return 0;
+}
+
+int paging_handle_cow_fault(uint64_t *target_pml4, uint64_t vaddr) {
+    uint64_t *pd_l = lookup_pd(target_pml4, vaddr);
+    if (!pd_l) return -1;
+    uint64_t pd_idx = (vaddr >> 21) & 0x1FF;
+    if (!(pd_l[pd_idx] & PAGE_PRESENT)) return -1;
+    if (pd_l[pd_idx] & PAGE_PSE) return handle_large_cow(&pd_l[pd_idx], vaddr);
+    uint64_t *pt_l = table_at(pd_l[pd_idx]);
+    uint64_t pt_idx = (vaddr >> 12) & 0x1FF;
+
+    uint64_t pte = pt_l[pt_idx];
+    if (!(pte & PAGE_PRESENT) || !(pte & PAGE_COW)) return -1;
+
+    uint64_t old_page = pte & PHYS_MASK;
+    uint64_t flags = (pte & 0xFFFULL & ~PAGE_COW) | PAGE_WRITABLE;
+
+    if (pmm_page_refcount((void *)old_page) > 1) {
+        void *new_page = pmm_alloc_page();
+        if (!new_page) return -1;
+        pmm_set_owner(new_page, PMM_OWNER_USER_ANON);
+        copy_page(phys_to_virt((uint64_t)new_page), phys_to_virt(old_page));
+        pt_l[pt_idx] = (uint64_t)new_page | flags;
+        pmm_free_page((void *)old_page);  // drop this space's reference
+    } else {
+        // Every other sharer already took its copy; reuse the frame.
+        pt_l[pt_idx] = old_page | flags;
+    }
+    invlpg(vaddr);
     return 0;
 }
 
 uint64_t *paging_kernel_pml4(void) {
     return kernel_pml4;
 }
+
+// ---------------------------------------------------------------------------
+// Address-space switching
+// ---------------------------------------------------------------------------
+
+uint16_t paging_pcid_alloc(void) {
+    if (!pcid_enabled) return 0;
+    for (int i = 1; i < PCID_COUNT; i++) {
+        if (!pcid_used[i]) {
+            pcid_used[i] = 1;
+            return (uint16_t)i;
+        }
+    }
+    return 0;
+}
+
+void paging_pcid_free(uint16_t pcid, uint64_t *pml4) {
+    if (pcid >= PCID_COUNT) return;
+    // The PML4 frame may come back as another space's: never trust the
+    // tag's entries for it again.
+    if (pcid_owner[pcid] == (uint64_t)pml4) pcid_owner[pcid] = 0;
+    if (pcid) pcid_used[pcid] = 0;
+}
+
+void paging_switch(uint64_t *pml4, uint16_t pcid) {
+    int cpu = cpu_id();
+    uint64_t target = (uint64_t)pml4 | (pcid_enabled ? pcid : 0);
+    if (target == loaded_cr3[cpu]) {
+        pg_stats.cr3_skipped++;
+        return;
+    }
+
+    uint64_t value = target;
+    if (!pcid_enabled) {
+        pg_stats.tlb_flushes++;
+    } else if (pcid_owner[pcid] != (uint64_t)pml4 || pcid_cpu[pcid] != cpu) {
+        pcid_owner[pcid] = (uint64_t)pml4;   // stale entries: let the load flush them
+        pcid_cpu[pcid] = (uint8_t)cpu;
+        pg_stats.tlb_flushes++;
+    } else {
+        value |= CR3_NOFLUSH;
+    }
+    __asm__ volatile ("mov %0, %%cr3" : : "r"(value) : "memory");
+    loaded_cr3[cpu] = target;
+    pg_stats.cr3_writes++;
+}
+
+void paging_get_stats(struct paging_stats *out) {
+    *out = pg_stats;
+    out->pcid_enabled = (uint64_t)pcid_enabled;
+}
+
+#if RUN_PAGING_BENCH
+
+// ---------------------------------------------------------------------------
+// Microbenchmark: cost of a switch between two address spaces plus the TLB
+// refill of a small working set, with a full flush per switch versus
+// separately tagged spaces. Results go to the QEMU debug console (port
+// 0xE9). Must run before any task exists.
+// ---------------------------------------------------------------------------
+
+#define BENCH_ITERS 2000
+#define BENCH_PAGES 64
+
+static void bench_touch(void) {
+    for (uint64_t i = 0; i < BENCH_PAGES; i++) {
+        (void)*(volatile uint64_t *)(USER_VADDR_BASE + i * 0x1000);
+    }
+}
+
+// Cycles per round trip A -> B -> A, touching the working set in each.
+static uint64_t bench_round_trips(uint64_t *a, uint16_t ta, uint64_t *b, uint16_t tb) {
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        paging_switch(a, ta);
+        bench_touch();
+        paging_switch(b, tb);
+        bench_touch();
+    }
+    return (rdtsc() - t0) / BENCH_ITERS;
+}
+
+void paging_bench(void) {
+    uint64_t *space[2];
+    for (int s = 0; s < 2; s++) {
+        space[s] = paging_new_user_space();
+        if (!space[s]) {
+            if (s) paging_free_user_space(space[0]);
+            return;
+        }
+        for (uint64_t i = 0; i < BENCH_PAGES; i++) {
+            void *frame = pmm_alloc_zeroed_page();
+            if (!frame) break;
+            paging_map_user_page(space[s], USER_VADDR_BASE + i * 0x1000, (uint64_t)frame,
+                                 PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
+        }
+    }
+
+    // Both spaces on tag 0: every switch hands the tag over and flushes.
+    uint64_t flushed = bench_round_trips(space[0], 0, space[1], 0);
+
+    uint16_t ta = paging_pcid_alloc(), tb = paging_pcid_alloc();
+    uint64_t tagged = bench_round_trips(space[0], ta, space[1], tb);
+
+    // Same space again: the CR3 write is skipped.
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        paging_switch(space[0], ta);
+        bench_touch();
+    }
+    uint64_t same = (rdtsc() - t0) / BENCH_ITERS;
+
+    paging_switch(kernel_pml4, 0);
+    paging_pcid_free(ta, space[0]);
+    paging_pcid_free(tb, space[1]);
+    paging_pcid_free(0, space[0]);
+    paging_pcid_free(0, space[1]);
+    paging_free_user_space(space[0]);
+    paging_free_user_space(space[1]);
+
+    bench_puts("paging bench: pcid=");
+    bench_putu((uint64_t)pcid_enabled);
+    bench_puts(" pages=");
+    bench_putu(BENCH_PAGES);
+    bench_puts(" round trip flushed=");
+    bench_putu(flushed);
+    bench_puts(" cyc tagged=");
+    bench_putu(tagged);
+    bench_puts(" cyc same-space=");
+    bench_putu(same);
+    bench_puts(" cyc\n");
+}
+
+#endif
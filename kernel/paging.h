@@ -17,21 +17,68 @@
 
 // OS-defined bit: marks pages allocated for user processes (for cleanup)
 #define PAGE_USERALLOC  (1ULL << 9)
+// OS-defined bit: read-only view of a frame shared after fork(); the first
+// write takes a private copy
+#define PAGE_COW        (1ULL << 10)
+// OS-defined bit on PML4/PDPT entries: the subtree below belongs to the
+// kernel page tables and is linked into every address space, never freed
+#define PAGE_KERNEL_SHARED (1ULL << 11)
+// OS-defined bit (ignored by the MMU): frame of a shared-memory object,
+// writable in every space that maps it; fork shares it as-is instead of
+// copy-on-write
+#define PAGE_SHARED     (1ULL << 52)
+
+// Direct map: every physical RAM address pa is also mapped at
+// DIRECT_MAP_BASE + pa (PML4 slot 256), supervisor-only and global, in
+// every address space. Frames from the PMM are physical addresses; the
+// kernel reads and writes them through here.
+#define DIRECT_MAP_BASE 0xFFFF800000000000ULL
+
+static inline void *phys_to_virt(uint64_t phys) {
+    return (void *)(phys + DIRECT_MAP_BASE);
+}
+
+// Inverse of phys_to_virt. Kernel image and .bss addresses are identity
+// mapped and pass through unchanged.
+static inline uint64_t virt_to_phys(const void *virt) {
+    uint64_t v = (uint64_t)virt;
+    return v >= DIRECT_MAP_BASE ? v - DIRECT_MAP_BASE : v;
+}
 
 // User virtual address layout (above identity-mapped kernel region)
 #define USER_VADDR_BASE   0x1000000ULL   // 16 MB - user code starts here
 #define USER_STACK_TOP    0x1200000ULL   // 18 MB - user stack top (grows down)
-#define USER_STACK_SIZE   (16 * 1024)    // 16 KB
+#define USER_STACK_SIZE   (16 * 1024)    // 16 KB initial stack area
+#define USER_STACK_MAX    (1024 * 1024)  // 1 MB - furthest the stack may grow
+#define USER_HEAP_BASE    0x8000000000ULL    // 512 GiB - brk heap (PML4 slot 1)
+#define USER_HEAP_MAX     0x1000000000ULL    // 64 GiB  - furthest brk may go
+#define USER_MMAP_BASE    0x10000000000ULL   // 1 TiB   - mmap areas
+#define USER_MMAP_END     0x7F0000000000ULL  // top of mmap areas, below the canonical hole
 
 // Initialize paging with user-accessible memory for the bootstrap kernel
 void paging_init(void);
 
+// Turn on the same paging features on an application processor, which
+// arrives on the kernel tables.
+void paging_init_ap(void);
+
+// Build the direct map from the boot E820 map. Must run after paging_init()
+// and before anything calls phys_to_virt(), the PMM included. Returns the
+// physical address up to which RAM is mapped; anything above it must be
+// kept out of the PMM (pmm_reserve).
+uint64_t paging_init_direct_map(void);
+
 // Mark an identity-mapped region as user-accessible (bootstrap tables only)
 void paging_mark_user_region(uint64_t addr, uint64_t size);
 // Mark an identity-mapped region as supervisor-only (bootstrap tables only)
 void paging_mark_supervisor_region(uint64_t addr, uint64_t size);
 
+// Page tables are named by physical address throughout (the value loaded
+// into CR3); paging.c reaches them through the direct map.
+
 // Create a fresh page table hierarchy with kernel identity map (supervisor-only).
+// Kernel mappings outside the first 1 GiB (framebuffer, ...) are linked from
+// the kernel tables, so they must be set up before address spaces are made.
 // User regions are left unmapped — use paging_map_user_page() to populate.
 // Returns pointer to PML4 (physical address). Returns 0 on failure.
 uint64_t *paging_new_user_space(void);
@@ -44,6 +91,32 @@ int paging_map_page(uint64_t *pml4, uint64_t addr, uint64_t flags);
 int paging_map_user_page(uint64_t *pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags);
 // maps a new kernel page
 int paging_map_kernel_page(uint64_t *target_pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags);
+// Map npages consecutive 4 KiB pages from vaddr: page i goes to frames[i],
+// or to paddr + i * 4 KiB when frames is 0. flags go on every leaf as-is
+// (add PAGE_USERALLOC for frames the space owns); intermediate levels get
+// PAGE_USER if flags has it. The TLB is only touched when pml4 is the live
+// space or the mapping is global. Returns 0, or -1 with the pages before
+// the failing one left mapped.
+int paging_map_range(uint64_t *pml4, uint64_t vaddr, const uint64_t *frames,
+                     uint64_t paddr, uint64_t npages, uint64_t flags);
+// Remove the mappings of npages pages from vaddr, releasing PAGE_USERALLOC
+// frames. A large page only partly in the range is split into 4 KiB pages
+// first. Returns 0, or -1 if a split was impossible (out of memory, or the
+// large page is shared copy-on-write); pages before it are already gone.
+int paging_unmap_range(uint64_t *pml4, uint64_t vaddr, uint64_t npages);
+
+// Whether [start, end) lies in the user part of the address space, clear of
+// the identity map and of kernel subtrees shared into every space.
+int paging_user_range_ok(uint64_t start, uint64_t end);
+// Map a 2 MiB page (PSE) vaddr → paddr; both must be 2 MiB aligned.
+// Intermediate levels get PAGE_USER if flags has it. Fails rather than
+// replacing an existing PT of 4 KiB mappings. Returns 0 or -1.
+int paging_map_large(uint64_t *pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags);
+
+// Identity-map [start, end) as kernel memory, using 2 MiB pages for every
+// aligned 2 MiB stretch and 4 KiB pages for the ends.
+int paging_map_kernel_range(uint64_t *pml4, uint64_t start, uint64_t end, uint64_t flags);
+
 // Translate virtual address to physical address using given page tables.
 // Returns physical address or 0 if not mapped.
 uint64_t paging_virt_to_phys(uint64_t *pml4, uint64_t vaddr);
@@ -52,11 +125,40 @@ uint64_t paging_virt_to_phys(uint64_t *pml4, uint64_t vaddr);
 // Does NOT free identity-mapped kernel pages.
 void paging_free_user_space(uint64_t *user_pml4);
 
-// Deep-copy all user-allocated page mappings from src to dst.
-// Allocates new physical pages and copies contents. For fork().
+// Share all user-allocated page mappings of src with dst, copy-on-write.
+// Writable pages become read-only + PAGE_COW in both spaces. For fork().
 int paging_clone_user_pages(uint64_t *dst_pml4, uint64_t *src_pml4);
 
+// Resolve a write fault on a PAGE_COW page at vaddr: copy the frame if it is
+// still shared, otherwise just make it writable again.
+// Returns 0 if handled, -1 if vaddr is not a COW page (or out of memory).
+int paging_handle_cow_fault(uint64_t *pml4, uint64_t vaddr);
+
 // Return pointer to the kernel's global PML4.
 uint64_t *paging_kernel_pml4(void);
 
+// Address-space tag (PCID) for a new space, or 0 when the CPU lacks PCID or
+// all tags are in use. Tag 0 may be shared; it is flushed whenever it moves
+// to a different PML4. Release with paging_pcid_free() before freeing pml4.
+uint16_t paging_pcid_alloc(void);
+void paging_pcid_free(uint16_t pcid, uint64_t *pml4);
+
+// Load pml4 with tag pcid into CR3. Does nothing if it is already loaded;
+// keeps the tag's TLB entries when the tag last held this same PML4.
+// Mappings shared by every space must be PAGE_GLOBAL so invlpg reaches all tags.
+void paging_switch(uint64_t *pml4, uint16_t pcid);
+
+struct paging_stats {
+    uint64_t cr3_writes;    // CR3 loads done by paging_switch
+    uint64_t cr3_skipped;   // switches to the space already loaded
+    uint64_t tlb_flushes;   // loads that dropped the target's TLB entries
+    uint64_t pcid_enabled;
+};
+
+void paging_get_stats(struct paging_stats *out);
+
+// Context-switch/TLB-refill microbenchmark (QEMU debug console). Built
+// only with RUN_PAGING_BENCH (bench.h).
+void paging_bench(void);
+
 #endif
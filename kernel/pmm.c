@@ -1,48 +1,598 @@
 #include "pmm.h"
+#include "paging.h"
+#include "klib.h"
+#include "x86.h"
+#include "bench.h"
 
-// Simple bitmap-based physical page allocator.
-// Assumes a contiguous usable range; no NUMA; no highmem.
+// Buddy physical page allocator built on per-order free bitmaps.
+// The pool is built from the usable ranges of the bootloader's E820 map;
+// no NUMA; no highmem.
+//
+// For every order k (block = 2^k pages) there is a bitmap with one bit per
+// naturally aligned block (1 = this block is free and not merged into a
+// larger free block), plus a summary bitmap with one bit per bitmap word
+// (1 = that word holds at least one free block). Allocation scans the
+// summary from a next-free hint and uses ctz (bsf/tzcnt) to jump straight to
+// a free block; if the order is empty it splits the lowest block of the next
+// order up. Frees coalesce with the buddy block while it is also free.
+//
+// The free state lives entirely in these bitmaps, never inside the free
+// frames themselves, so allocation and freeing touch no frame memory. The
+// bitmaps are sized for the highest usable address and carved out of the
+// lowest usable range, which sits just above PMM_LOW_LIMIT. They, the frame
+// database and the frames zeroed here are all reached through the direct
+// map, which must exist before pmm_init().
+//
+// Alongside the bitmaps sits the frame database: one struct page per frame
+// with a reference count, an owner type and flags. An allocated block is
+// described by its first frame (PMM_FRAME_HEAD, order in the low bits); the
+// block goes back to the buddy maps when its reference count drops to zero.
 
-#define MAX_PAGES (1024 * 1024)  // supports up to 4 GiB with 4 KiB pages
+#define PMM_MAX_RANGES   64
+#define PMM_MAX_RESERVED 8
 
-static uint64_t bitmap[MAX_PAGES / 64];
-static uint64_t page_base = 0;
-static uint64_t total_pages = 0;
+// Pre-zeroed order-0 frames, refilled by the idle task.
+#define ZERO_POOL_SIZE 256
 
-static inline void set_bit(uint64_t idx) { bitmap[idx >> 6] |= (1ULL << (idx & 63)); }
-static inline void clear_bit(uint64_t idx) { bitmap[idx >> 6] &= ~(1ULL << (idx & 63)); }
-static inline int test_bit(uint64_t idx) { return (bitmap[idx >> 6] >> (idx & 63)) & 1; }
+// Used when the bootloader found no E820 map.
+#define FALLBACK_START 0x200000ULL
+#define FALLBACK_END   0x4000000ULL
 
-void pmm_init(uint64_t start, uint64_t end) {
-    // Align to pages
+struct free_map {
+    uint64_t *bits;           // 1 = free block of this order
+    uint64_t *summary;        // 1 = bits[] word has a free block
+    uint64_t nblocks;
+    uint64_t words;
+    uint64_t summary_words;
+    uint64_t hint;            // summary words below this are known empty
+};
+
+struct range {
+    uint64_t start;
+    uint64_t end;
+};
+
+static struct free_map maps[PMM_MAX_ORDER + 1];
+static struct range ranges[PMM_MAX_RANGES];    // pooled memory, sorted
+static int range_count = 0;
+static struct range reserved[PMM_MAX_RESERVED];
+static int reserved_count = 0;
+static uint64_t total_pages = 0;    // span covered by the maps, in pages
+static uint64_t pool_pages = 0;     // pages actually handed to the allocator
+static uint64_t free_pages = 0;
+
+static struct page *frames;         // frame database, total_pages entries
+static uint64_t owner_pages[PMM_OWNER_COUNT];
+
+static void *zero_pool[ZERO_POOL_SIZE];
+static uint64_t zero_pool_count = 0;
+static uint64_t zero_hits = 0;
+static uint64_t zero_misses = 0;
+
+static inline uint64_t page_index(uint64_t addr) {
+    return addr / PMM_PAGE_SIZE;
+}
+
+static inline void *page_addr(uint64_t idx) {
+    return (void *)(idx * PMM_PAGE_SIZE);
+}
+
+static inline int map_test(struct free_map *m, uint64_t idx) {
+    if (idx >= m->nblocks) return 0;
+    return (m->bits[idx >> 6] >> (idx & 63)) & 1;
+}
+
+static inline void map_set(struct free_map *m, uint64_t idx) {
+    uint64_t w = idx >> 6;
+    m->bits[w] |= 1ULL << (idx & 63);
+    m->summary[w >> 6] |= 1ULL << (w & 63);
+    if ((w >> 6) < m->hint) m->hint = w >> 6;
+}
+
+static inline void map_clear(struct free_map *m, uint64_t idx) {
+    uint64_t w = idx >> 6;
+    m->bits[w] &= ~(1ULL << (idx & 63));
+    if (!m->bits[w]) {
+        m->summary[w >> 6] &= ~(1ULL << (w & 63));
+    }
+}
+
+// Lowest free block at this order, or -1.
+static int64_t map_find(struct free_map *m) {
+    for (uint64_t s = m->hint; s < m->summary_words; s++) {
+        uint64_t sum = m->summary[s];
+        if (!sum) continue;
+        uint64_t w = s * 64 + (uint64_t)__builtin_ctzll(sum);
+        m->hint = s;
+        return (int64_t)(w * 64 + (uint64_t)__builtin_ctzll(m->bits[w]));
+    }
+    m->hint = m->summary_words;
+    return -1;
+}
+
+// Insert a block, merging with its buddy for as long as the buddy is free.
+static void free_block(uint64_t idx, unsigned order) {
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = idx ^ (1ULL << order);
+        if (!map_test(&maps[order], buddy >> order)) break;
+        map_clear(&maps[order], buddy >> order);
+        idx &= ~(1ULL << order);
+        order++;
+    }
+    map_set(&maps[order], idx >> order);
+}
+
+static int64_t alloc_block(unsigned order) {
+    for (unsigned k = order; k <= PMM_MAX_ORDER; k++) {
+        int64_t blk = map_find(&maps[k]);
+        if (blk < 0) continue;
+        map_clear(&maps[k], (uint64_t)blk);
+        uint64_t idx = (uint64_t)blk << k;
+        // Split down, returning the upper halves to the smaller orders.
+        while (k > order) {
+            k--;
+            map_set(&maps[k], (idx >> k) + 1);
+        }
+        return (int64_t)idx;
+    }
+    return -1;
+}
+
+// Hand the pages in [start_idx, end_idx) to the allocator.
+static void add_range(uint64_t start_idx, uint64_t end_idx) {
+    uint64_t i = start_idx;
+    while (i < end_idx) {
+        unsigned k = 0;
+        while (k < PMM_MAX_ORDER &&
+               (i & ((2ULL << k) - 1)) == 0 &&
+               i + (2ULL << k) <= end_idx) {
+            k++;
+        }
+        free_block(i, k);
+        i += 1ULL << k;
+        pool_pages += 1ULL << k;
+        free_pages += 1ULL << k;
+    }
+}
+
+void pmm_reserve(uint64_t start, uint64_t end) {
+    if (end <= start || reserved_count >= PMM_MAX_RESERVED) return;
+    reserved[reserved_count].start = start;
+    reserved[reserved_count].end = end;
+    reserved_count++;
+}
+
+static void range_insert(int at, uint64_t start, uint64_t end) {
+    if (range_count >= PMM_MAX_RANGES) return;
+    for (int i = range_count; i > at; i--) ranges[i] = ranges[i - 1];
+    ranges[at].start = start;
+    ranges[at].end = end;
+    range_count++;
+}
+
+static void range_remove(int at) {
+    for (int i = at; i < range_count - 1; i++) ranges[i] = ranges[i + 1];
+    range_count--;
+}
+
+// Add a usable range, keeping the list sorted and merging overlaps (some
+// BIOSes report overlapping or adjacent usable entries).
+static void range_add(uint64_t start, uint64_t end) {
     start = (start + PMM_PAGE_SIZE - 1) & ~(PMM_PAGE_SIZE - 1);
     end   = end & ~(PMM_PAGE_SIZE - 1);
+    if (start < PMM_LOW_LIMIT) start = PMM_LOW_LIMIT;
     if (end <= start) return;
 
-    page_base = start;
-    total_pages = (end - start) / PMM_PAGE_SIZE;
-    if (total_pages > MAX_PAGES) total_pages = MAX_PAGES;
+    int i = 0;
+    while (i < range_count && ranges[i].end < start) i++;
+    if (i == range_count || ranges[i].start > end) {
+        range_insert(i, start, end);
+        return;
+    }
+    if (start < ranges[i].start) ranges[i].start = start;
+    if (end > ranges[i].end) ranges[i].end = end;
+    while (i + 1 < range_count && ranges[i + 1].start <= ranges[i].end) {
+        if (ranges[i + 1].end > ranges[i].end) ranges[i].end = ranges[i + 1].end;
+        range_remove(i + 1);
+    }
+}
 
-    // Mark all free initially
-    for (uint64_t i = 0; i < (total_pages + 63) / 64; i++) {
-        bitmap[i] = 0;
+// Cut [start, end) out of every usable range.
+static void range_cut(uint64_t start, uint64_t end) {
+    start = start & ~(PMM_PAGE_SIZE - 1);
+    end   = (end + PMM_PAGE_SIZE - 1) & ~(PMM_PAGE_SIZE - 1);
+    if (end <= start) return;
+
+    for (int i = 0; i < range_count; i++) {
+        struct range *r = &ranges[i];
+        if (r->end <= start || r->start >= end) continue;
+        if (r->start < start && r->end > end) {
+            range_insert(i + 1, end, r->end);
+            r->end = start;
+        } else if (r->start < start) {
+            r->end = start;
+        } else if (r->end > end) {
+            r->start = end;
+        } else {
+            range_remove(i);
+            i--;
+        }
     }
 }
 
-void *pmm_alloc_page(void) {
-    for (uint64_t i = 0; i < total_pages; i++) {
-        if (!test_bit(i)) {
-            set_bit(i);
-            return (void *)(page_base + i * PMM_PAGE_SIZE);
+// Boot-map queries, usable before pmm_init() (see paging_init_direct_map).
+
+uint64_t pmm_boot_ram_top(void) {
+    uint32_t count = *(volatile uint32_t *)BOOT_E820_ADDR;
+    struct e820_entry *map = (struct e820_entry *)(BOOT_E820_ADDR + 8);
+    if (count > BOOT_E820_MAX) count = BOOT_E820_MAX;
+
+    uint64_t top = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!(map[i].acpi & 1) || map[i].type != E820_USABLE) continue;
+        if (map[i].base + map[i].length > top) top = map[i].base + map[i].length;
+    }
+    return top ? top : FALLBACK_END;
+}
+
+int pmm_boot_ram_in(uint64_t start, uint64_t end) {
+    uint32_t count = *(volatile uint32_t *)BOOT_E820_ADDR;
+    struct e820_entry *map = (struct e820_entry *)(BOOT_E820_ADDR + 8);
+    if (count > BOOT_E820_MAX) count = BOOT_E820_MAX;
+
+    int found = 0, any = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!(map[i].acpi & 1) || map[i].type != E820_USABLE || !map[i].length) continue;
+        uint64_t b = map[i].base, e = map[i].base + map[i].length;
+        found = 1;
+        if (b <= start && e >= end) return 2;
+        if (b < end && e > start) any = 1;
+    }
+    if (!found) {
+        // No map: the fallback pool, and the kernel below it
+        if (end <= FALLBACK_END) return 2;
+        return start < FALLBACK_END;
+    }
+    return any;
+}
+
+static void build_ranges(void) {
+    uint32_t count = *(volatile uint32_t *)BOOT_E820_ADDR;
+    struct e820_entry *map = (struct e820_entry *)(BOOT_E820_ADDR + 8);
+    if (count > BOOT_E820_MAX) count = BOOT_E820_MAX;
+
+    range_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!(map[i].acpi & 1)) continue;   // ACPI 3.0: ignore this entry
+        if (map[i].type == E820_USABLE && map[i].length) {
+            range_add(map[i].base, map[i].base + map[i].length);
         }
     }
+    if (range_count == 0) {
+        range_add(FALLBACK_START, FALLBACK_END);
+    }
+
+    // Anything the firmware reports as not usable (ACPI tables, NVS, bad
+    // RAM) wins over an overlapping usable entry.
+    for (uint32_t i = 0; i < count; i++) {
+        if (!(map[i].acpi & 1)) continue;
+        if (map[i].type != E820_USABLE && map[i].length) {
+            range_cut(map[i].base, map[i].base + map[i].length);
+        }
+    }
+    for (int i = 0; i < reserved_count; i++) {
+        range_cut(reserved[i].start, reserved[i].end);
+    }
+}
+
+// Is [idx, idx + pages) entirely inside pooled memory?
+static int in_pool(uint64_t idx, uint64_t pages) {
+    uint64_t start = idx * PMM_PAGE_SIZE;
+    uint64_t end = start + pages * PMM_PAGE_SIZE;
+    for (int i = 0; i < range_count; i++) {
+        if (start >= ranges[i].start && end <= ranges[i].end) return 1;
+    }
     return 0;
 }
 
+void pmm_init(void) {
+    build_ranges();
+    pool_pages = 0;
+    free_pages = 0;
+    if (range_count == 0) return;
+
+    // Pages are indexed from physical address 0 so buddy blocks are
+    // physically aligned (2 MiB blocks land on 2 MiB boundaries).
+    total_pages = ranges[range_count - 1].end / PMM_PAGE_SIZE;
+
+    uint64_t storage_words = 0;
+    for (unsigned k = 0; k <= PMM_MAX_ORDER; k++) {
+        uint64_t words = ((total_pages >> k) + 63) / 64;
+        storage_words += words + (words + 63) / 64;
+    }
+    uint64_t frames_bytes = total_pages * sizeof(struct page);
+    uint64_t storage_bytes = (storage_words * 8 + frames_bytes + PMM_PAGE_SIZE - 1) & ~(PMM_PAGE_SIZE - 1);
+
+    // Take the bitmaps and the frame database from the bottom of the lowest
+    // range large enough.
+    uint64_t *store = 0;
+    for (int i = 0; i < range_count; i++) {
+        if (ranges[i].end - ranges[i].start >= storage_bytes) {
+            store = (uint64_t *)phys_to_virt(ranges[i].start);
+            range_cut(ranges[i].start, ranges[i].start + storage_bytes);
+            break;
+        }
+    }
+    if (!store) {
+        range_count = 0;
+        return;
+    }
+
+    for (unsigned k = 0; k <= PMM_MAX_ORDER; k++) {
+        struct free_map *m = &maps[k];
+        m->nblocks = total_pages >> k;
+        m->words = (m->nblocks + 63) / 64;
+        m->summary_words = (m->words + 63) / 64;
+        m->bits = store;
+        store += m->words;
+        m->summary = store;
+        store += m->summary_words;
+        m->hint = m->summary_words;
+
+        for (uint64_t i = 0; i < m->words; i++) m->bits[i] = 0;
+        for (uint64_t i = 0; i < m->summary_words; i++) m->summary[i] = 0;
+    }
+
+    frames = (struct page *)store;
+    uint32_t *f = (uint32_t *)frames;
+    for (uint64_t i = 0; i < total_pages; i++) f[i] = 0;
+    for (unsigned k = 0; k < PMM_OWNER_COUNT; k++) owner_pages[k] = 0;
+
+    for (int i = 0; i < range_count; i++) {
+        add_range(page_index(ranges[i].start), page_index(ranges[i].end));
+    }
+}
+
+static void set_block_owner(uint64_t idx, unsigned order, uint8_t owner) {
+    uint64_t n = 1ULL << order;
+    if (frames[idx].owner != PMM_OWNER_FREE) owner_pages[frames[idx].owner] -= n;
+    if (owner != PMM_OWNER_FREE) owner_pages[owner] += n;
+    for (uint64_t i = 0; i < n; i++) frames[idx + i].owner = owner;
+}
+
+void *pmm_alloc_pages(unsigned order) {
+    if (order > PMM_MAX_ORDER) return 0;
+    int64_t idx = alloc_block(order);
+    if (idx < 0) return 0;
+    free_pages -= 1ULL << order;
+
+    struct page *head = &frames[idx];
+    head->refcount = 1;
+    head->flags = PMM_FRAME_HEAD | order;
+    set_block_owner((uint64_t)idx, order, PMM_OWNER_KERNEL);
+    return page_addr((uint64_t)idx);
+}
+
+// Frame database entry for the head of an allocated block, or 0.
+static struct page *block_head(void *ptr) {
+    uint64_t addr = (uint64_t)ptr;
+    if (addr & (PMM_PAGE_SIZE - 1)) return 0;
+    uint64_t idx = page_index(addr);
+    if (idx >= total_pages || !in_pool(idx, 1)) return 0;
+    struct page *pg = &frames[idx];
+    if (!(pg->flags & PMM_FRAME_HEAD) || pg->refcount == 0) return 0;
+    return pg;
+}
+
+void pmm_free_pages(void *ptr, unsigned order) {
+    if (order > PMM_MAX_ORDER) return;
+    struct page *pg = block_head(ptr);
+    if (!pg) return;                                       // not allocated / double free
+    if ((pg->flags & PMM_FRAME_ORDER_MASK) != order) return;
+    if (--pg->refcount) return;                            // still shared
+
+    uint64_t idx = page_index((uint64_t)ptr);
+    set_block_owner(idx, order, PMM_OWNER_FREE);
+    pg->flags = 0;
+    free_block(idx, order);
+    free_pages += 1ULL << order;
+}
+
+void pmm_page_ref(void *page) {
+    struct page *pg = block_head(page);
+    if (pg && pg->refcount < 0xFFFF) pg->refcount++;
+}
+
+uint16_t pmm_page_refcount(void *page) {
+    struct page *pg = block_head(page);
+    return pg ? pg->refcount : 0;
+}
+
+void pmm_set_owner(void *ptr, uint8_t owner) {
+    if (owner == PMM_OWNER_FREE || owner >= PMM_OWNER_COUNT) return;
+    struct page *pg = block_head(ptr);
+    if (!pg) return;
+    set_block_owner(page_index((uint64_t)ptr), pg->flags & PMM_FRAME_ORDER_MASK, owner);
+}
+
+void pmm_split_pages(void *ptr, unsigned order) {
+    struct page *pg = block_head(ptr);
+    if (!pg || (pg->flags & PMM_FRAME_ORDER_MASK) != order) return;
+    uint64_t idx = page_index((uint64_t)ptr);
+    for (uint64_t i = 1; i < (1ULL << order); i++) {
+        frames[idx + i].refcount = pg->refcount;
+        frames[idx + i].flags = PMM_FRAME_HEAD;
+    }
+    pg->flags = PMM_FRAME_HEAD;
+}
+
+void *pmm_alloc_page(void) {
+    void *page = pmm_alloc_pages(0);
+    if (!page && zero_pool_count) {
+        // Out of memory: the zero pool is just free pages kept warm.
+        uint64_t flags = irq_save();
+        if (zero_pool_count) page = zero_pool[--zero_pool_count];
+        if (page) pmm_set_owner(page, PMM_OWNER_KERNEL);
+        irq_restore(flags);
+    }
+    return page;
+}
+
 void pmm_free_page(void *page) {
-    uint64_t addr = (uint64_t)page;
-    if (addr < page_base) return;
-    uint64_t idx = (addr - page_base) / PMM_PAGE_SIZE;
-    if (idx >= total_pages) return;
-    clear_bit(idx);
+    pmm_free_pages(page, 0);
 }
+
+// ---------------------------------------------------------------------------
+// Pre-zeroed page pool
+// ---------------------------------------------------------------------------
+
+void *pmm_alloc_zeroed_page(void) {
+    uint64_t flags = irq_save();
+    if (zero_pool_count) {
+        void *page = zero_pool[--zero_pool_count];
+        pmm_set_owner(page, PMM_OWNER_KERNEL);
+        zero_hits++;
+        irq_restore(flags);
+        return page;
+    }
+    zero_misses++;
+    irq_restore(flags);
+
+    // Miss path: the caller is about to use the page, so zero it through
+    // the cache.
+    void *page = pmm_alloc_page();
+    if (page) zero_page(phys_to_virt((uint64_t)page));
+    return page;
+}
+
+int pmm_zero_pool_refill(void) {
+    uint64_t flags = irq_save();
+    void *page = 0;
+    if (zero_pool_count < ZERO_POOL_SIZE) page = pmm_alloc_pages(0);
+    irq_restore(flags);
+    if (!page) return 0;
+
+    // Non-temporal stores: pool pages are not touched again until some
+    // later allocation, so there is no point dragging them through the cache.
+    zero_page_nt(phys_to_virt((uint64_t)page));
+
+    flags = irq_save();
+    pmm_set_owner(page, PMM_OWNER_ZEROPOOL);
+    zero_pool[zero_pool_count++] = page;
+    irq_restore(flags);
+    return 1;
+}
+
+void pmm_get_stats(struct pmm_stats *out) {
+    uint64_t flags = irq_save();
+    out->total_pages = pool_pages;
+    out->free_pages = free_pages;
+    out->zero_pool_pages = zero_pool_count;
+    out->zero_hits = zero_hits;
+    out->zero_misses = zero_misses;
+    for (unsigned k = 0; k < PMM_OWNER_COUNT; k++) out->owner_pages[k] = owner_pages[k];
+    out->owner_pages[PMM_OWNER_FREE] = free_pages;
+    irq_restore(flags);
+}
+
+#if RUN_PMM_BENCH
+
+// ---------------------------------------------------------------------------
+// Microbenchmark: alloc/free cycle cost at a given pool occupancy.
+// Must run on an empty pool (right after pmm_init). Results go to the QEMU
+// debug console (port 0xE9, -debugcon stdio).
+// ---------------------------------------------------------------------------
+
+#define BENCH_ITERS 10000
+#define BENCH_BATCH 64
+
+// Cycles per alloc+free pair of the given order, or 0 if the order is
+// exhausted at this occupancy.
+static uint64_t bench_cycle(unsigned order) {
+    void *batch[BENCH_BATCH];
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS / BENCH_BATCH; i++) {
+        for (int j = 0; j < BENCH_BATCH; j++) {
+            batch[j] = pmm_alloc_pages(order);
+            if (!batch[j]) {
+                while (j-- > 0) pmm_free_pages(batch[j], order);
+                return 0;
+            }
+        }
+        for (int j = 0; j < BENCH_BATCH; j++) pmm_free_pages(batch[j], order);
+    }
+    return (rdtsc() - t0) / ((BENCH_ITERS / BENCH_BATCH) * BENCH_BATCH);
+}
+
+static void bench_occupancy(uint64_t percent, uint8_t *owned) {
+    // Fill the whole pool, then punch pseudo-random holes so the used pages
+    // are scattered rather than one contiguous prefix.
+    void *p;
+    while ((p = pmm_alloc_page()) != 0) {
+        uint64_t idx = page_index((uint64_t)p);
+        owned[idx >> 3] |= (uint8_t)(1 << (idx & 7));
+    }
+    uint64_t lcg = 0x9E3779B97F4A7C15ULL;
+    for (uint64_t i = 0; i < total_pages; i++) {
+        if (!(owned[i >> 3] & (1 << (i & 7)))) continue;
+        lcg = lcg * 6364136223846793005ULL + 1442695040888963407ULL;
+        if ((lcg >> 33) % 100 >= percent) {
+            owned[i >> 3] &= (uint8_t)~(1 << (i & 7));
+            pmm_free_page(page_addr(i));
+        }
+    }
+
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        p = pmm_alloc_page();
+        pmm_free_page(p);
+    }
+    uint64_t single = (rdtsc() - t0) / BENCH_ITERS;
+
+    bench_puts("pmm bench: occupancy=");
+    bench_putu(percent);
+    bench_puts("% free=");
+    bench_putu(free_pages);
+    bench_puts("/");
+    bench_putu(pool_pages);
+    bench_puts(" alloc+free=");
+    bench_putu(single);
+    bench_puts(" cyc batched=");
+    bench_putu(bench_cycle(0));
+    bench_puts(" cyc order2=");
+    bench_putu(bench_cycle(2));
+    bench_puts(" cyc order9=");
+    bench_putu(bench_cycle(PMM_MAX_ORDER));
+    bench_puts(" cyc\n");
+
+    for (uint64_t i = 0; i < total_pages; i++) {
+        if (owned[i >> 3] & (1 << (i & 7))) {
+            owned[i >> 3] &= (uint8_t)~(1 << (i & 7));
+            pmm_free_page(page_addr(i));
+        }
+    }
+}
+
+void pmm_bench(void) {
+    if (free_pages != pool_pages || pool_pages == 0) {
+        bench_puts("pmm bench: pool not empty, skipped\n");
+        return;
+    }
+
+    // One bit per page to remember what the bench itself allocated.
+    uint64_t owned_bytes = (total_pages + 7) / 8;
+    unsigned order = 0;
+    while (PMM_BLOCK_SIZE(order) < owned_bytes && order < PMM_MAX_ORDER) order++;
+    void *owned_pa = pmm_alloc_pages(order);
+    if (!owned_pa) return;
+    uint8_t *owned = (uint8_t *)phys_to_virt((uint64_t)owned_pa);
+    memset(owned, 0, owned_bytes);
+
+    bench_occupancy(10, owned);
+    bench_occupancy(50, owned);
+    bench_occupancy(95, owned);
+
+    pmm_free_pages(owned_pa, order);
+}
+
+#endif
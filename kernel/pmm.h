@@ -5,14 +5,119 @@
 
 #define PMM_PAGE_SIZE 4096
 
-// Initialize the physical memory manager over [start, end).
-// Addresses must be physical and page-aligned.
-void pmm_init(uint64_t start, uint64_t end);
+// Largest buddy order: 2^9 pages = 2 MiB, the size of a large page.
+#define PMM_MAX_ORDER 9
+#define PMM_BLOCK_SIZE(order) ((uint64_t)PMM_PAGE_SIZE << (order))
 
-// Allocate a single 4 KiB page. Returns physical address or 0 on exhaustion.
+// Frame owner types recorded in the frame database
+#define PMM_OWNER_FREE      0
+#define PMM_OWNER_KERNEL    1   // generic kernel allocation
+#define PMM_OWNER_PAGETABLE 2   // page table level of some address space
+#define PMM_OWNER_USER_ANON 3   // anonymous user memory (code, data, stack)
+#define PMM_OWNER_KSTACK    4   // task kernel stack
+#define PMM_OWNER_DMA       5   // device DMA buffers
+#define PMM_OWNER_CACHE     6   // file data cache
+#define PMM_OWNER_ZEROPOOL  7   // pre-zeroed pool, not yet handed out
+#define PMM_OWNER_COUNT     8
+
+// struct page flags
+#define PMM_FRAME_HEAD       0x80  // first frame of an allocated block
+#define PMM_FRAME_ORDER_MASK 0x0F  // block order, valid on the head frame
+
+// Frame database entry, one per physical frame.
+struct page {
+    uint16_t refcount;   // references to the block (head frame only)
+    uint8_t owner;       // PMM_OWNER_*
+    uint8_t flags;       // PMM_FRAME_*
+};
+
+// Memory below this holds the kernel image, the boot page tables and the
+// bootstrap kernel stack; it is never pooled.
+#define PMM_LOW_LIMIT 0x200000ULL
+
+// INT 15h E820 memory map left by the bootloader: a uint32_t entry count at
+// BOOT_E820_ADDR, followed by 24-byte entries at BOOT_E820_ADDR + 8.
+#define BOOT_E820_ADDR 0x6000
+#define BOOT_E820_MAX  128
+#define E820_USABLE    1
+
+struct e820_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;    // ACPI 3.0 extended attributes, bit 0 clear = ignore
+} __attribute__((packed));
+
+// Highest end address of usable RAM in the boot E820 map, and whether
+// [start, end) holds usable RAM: 0 none, 1 partly, 2 entirely. For building
+// the direct map before pmm_init(); without a map they describe the
+// fallback range.
+uint64_t pmm_boot_ram_top(void);
+int pmm_boot_ram_in(uint64_t start, uint64_t end);
+
+// Exclude a physical range (e.g. the framebuffer) from the pool.
+// Must be called before pmm_init().
+void pmm_reserve(uint64_t start, uint64_t end);
+
+// Initialize the physical memory manager from every usable E820 range above
+// PMM_LOW_LIMIT, minus reserved ranges. Falls back to 2 MiB..64 MiB if the
+// bootloader found no map.
+void pmm_init(void);
+
+// Allocate a single 4 KiB page. Returns physical address or 0 on exhaustion;
+// access the memory through phys_to_virt().
+// New allocations have a reference count of 1 and owner PMM_OWNER_KERNEL.
 void *pmm_alloc_page(void);
 
-// Free a previously allocated page (physical address).
+// Drop a reference to a page (physical address). The page returns to the
+// pool when the last reference is dropped.
 void pmm_free_page(void *page);
 
+// Take an extra reference to an allocated page or block, e.g. when mapping
+// one frame into a second address space.
+void pmm_page_ref(void *page);
+
+// Current reference count of an allocated page or block (0 if free).
+uint16_t pmm_page_refcount(void *page);
+
+// Retag an allocated page or block with a PMM_OWNER_* type.
+void pmm_set_owner(void *ptr, uint8_t owner);
+
+// Turn an allocated block of the given order into 2^order single pages, each
+// with the block's reference count and owner, to be freed one by one.
+void pmm_split_pages(void *ptr, unsigned order);
+
+// Allocate a page that is already zero-filled. Takes from the pool the idle
+// task keeps topped up and only zeroes inline on a pool miss.
+void *pmm_alloc_zeroed_page(void);
+
+// Zero one free page into the pre-zeroed pool. Called from the idle task.
+// Returns 1 if a page was added, 0 if the pool is full or memory is short.
+int pmm_zero_pool_refill(void);
+
+struct pmm_stats {
+    uint64_t total_pages;      // pages managed by the allocator
+    uint64_t free_pages;       // pages free in the buddy maps
+    uint64_t zero_pool_pages;  // pre-zeroed pages ready to hand out
+    uint64_t zero_hits;        // pmm_alloc_zeroed_page() served from the pool
+    uint64_t zero_misses;      // pmm_alloc_zeroed_page() that zeroed inline
+    uint64_t owner_pages[PMM_OWNER_COUNT];  // pages per PMM_OWNER_* type
+};
+
+void pmm_get_stats(struct pmm_stats *out);
+
+// Allocate 2^order physically contiguous pages, aligned to their size.
+// Returns physical address or 0 if no block of that order is available.
+void *pmm_alloc_pages(unsigned order);
+
+// Drop a reference to a block returned by pmm_alloc_pages() with the same
+// order. On the last reference it merges with free buddy blocks up to
+// PMM_MAX_ORDER.
+void pmm_free_pages(void *ptr, unsigned order);
+
+// Time alloc/free cycles at 10%, 50% and 95% occupancy and print the
+// results to the QEMU debug console. Only valid on an empty pool. Built
+// only with RUN_PMM_BENCH (bench.h).
+void pmm_bench(void);
+
 #endif
@@ -1,114 +1,412 @@
 #include "sched.h"
 #include "paging.h"
 #include "pmm.h"
+#include "klib.h"
+#include "kmalloc.h"
 #include "elf_loader.h"
 #include "fs/vfs.h"
 #include "isr.h"
 #include "gdt.h"
 #include "syscall.h"
-#include "drivers/framebuffer.h"
+#include "timer.h"
+#include "smp.h"
+#include "fpu.h"
+#include "x86.h"
 
-#define MAX_TASKS 16
-#define MAX_PIPES 16
 #define KSTACK_SIZE (16 * 1024)
-#define USTACK_SIZE (16 * 1024)
-#define KSTACK_PAGES (KSTACK_SIZE / 4096)
-#define USTACK_PAGES (USTACK_SIZE / 4096)
-
-static struct task tasks[MAX_TASKS];
-static struct task *runq = 0;
-static struct task *current = 0;
-static struct pipe pipes[MAX_PIPES];
+#define KSTACK_ORDER 2  // 2^2 pages = KSTACK_SIZE
+
+// PIDs are handed out in sequence, so the low bits spread them evenly.
+#define PID_HASH_SIZE 256
+
+static struct kmem_cache *task_cache;
+static struct kmem_cache *files_cache;
+static struct kmem_cache *sighand_cache;
+static struct kmem_cache *pipe_cache;
+static struct task *pid_hash[PID_HASH_SIZE];
+static struct task *all_tasks = 0;   // every live task, in any state
 static uint64_t next_task_id = 1;
 static int sched_ready = 0;
 static int sched_running = 0;
-static uint8_t *kstacks[MAX_TASKS];
 
-// Global: current task's kernel stack top, used by syscall_entry.asm
-uint64_t current_kernel_rsp = 0;
-
-// User context saved by syscall_entry.asm (for fork)
-extern uint64_t user_ctx_rsp;
-extern uint64_t user_ctx_rip;
-extern uint64_t user_ctx_rflags;
-extern uint64_t user_ctx_rbx;
-extern uint64_t user_ctx_rbp;
-extern uint64_t user_ctx_r12;
-extern uint64_t user_ctx_r13;
-extern uint64_t user_ctx_r14;
-extern uint64_t user_ctx_r15;
+// One run queue per CPU. A task is queued on the CPU in its cpu field and
+// moves only while it is not running: when woken or created (select_cpu)
+// and when an idle CPU steals it (steal_task).
+struct runqueue {
+    struct task *curr;              // task running on the CPU
+    struct task *ring;              // runnable tasks, the idle task included
+    struct task *idle;
+    int nr_running;                 // non-idle tasks on ring
+    struct task *wake_hint;         // woken task to run at the next switch
+    volatile int need_resched;
+    volatile int idle_wait;         // schedule() is halting for a wakeup
+};
+
+static struct runqueue runqueues[MAX_CPUS];
+
+#define this_rq() (&runqueues[cpu_id()])
+
+// switch.asm / isr.asm
+extern void ctx_switch(uint64_t *old_rsp, uint64_t new_rsp);
+extern char task_first_return[];
+
+// Allocate a physically contiguous kernel stack (one buddy block)
+// Kernel stacks are used at their direct-map address, which every address
+// space shares.
+static uint8_t *alloc_stack(void) {
+    void *stack = pmm_alloc_pages(KSTACK_ORDER);
+    if (!stack) return 0;
+    pmm_set_owner(stack, PMM_OWNER_KSTACK);
+    return (uint8_t *)phys_to_virt((uint64_t)stack);
+}
 
-static void mem_zero(void *dst, uint64_t n) {
-    uint8_t *d = (uint8_t *)dst;
-    while (n--) *d++ = 0;
+static void free_stack(uint8_t *base) {
+    if (!base) return;
+    pmm_free_pages((void *)virt_to_phys(base), KSTACK_ORDER);
 }
 
-static void mem_copy(void *dst, const void *src, uint64_t n) {
-    uint8_t *d = (uint8_t *)dst;
-    const uint8_t *s = (const uint8_t *)src;
-    while (n--) *d++ = *s++;
+// Saved context for a task that has not run yet: ctx_switch pops zeroed
+// callee-saved registers and returns into task_first_return, which drops
+// one level of the kernel lock and iretqs through the frame built at the
+// top of the task's kernel stack.
+static uint64_t initial_context(void *frame) {
+    uint64_t *sp = (uint64_t *)frame;
+    *--sp = (uint64_t)task_first_return;
+    for (int i = 0; i < 6; i++) *--sp = 0;   // rbp, rbx, r12-r15
+    return (uint64_t)sp;
 }
 
-// Allocate contiguous pages for a stack from PMM
-static uint8_t *alloc_stack(int num_pages) {
-    uint8_t *base = (uint8_t *)pmm_alloc_page();
-    if (!base) return 0;
-    for (int i = 1; i < num_pages; i++) {
-        uint8_t *page = (uint8_t *)pmm_alloc_page();
-        if (!page) return 0;
-    }
-    return base;
+// The task running on this CPU, mirrored from the run queue into the
+// per-CPU area so it is read in one GS-relative load.
+#define current this_cpu_task()
+
+static inline int task_running(struct task *t) {
+    return runqueues[t->cpu].curr == t;
 }
 
-static void free_stack(uint8_t *base, int num_pages) {
-    if (!base) return;
-    for (int i = 0; i < num_pages; i++) {
-        pmm_free_page(base + i * 4096);
-    }
+// Halt until the next interrupt without holding the kernel lock, so other
+// CPUs can get on with kernel work meanwhile. Interrupts off.
+static void halt_unlocked(void) {
+    int depth = kernel_lock_drop();
+    __asm__ volatile ("sti; hlt; cli" : : : "memory");
+    kernel_lock_retake(depth);
 }
 
 void sched_init(void) {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        tasks[i].state = TASK_STATE_UNUSED;
-        tasks[i].next = 0;
-        kstacks[i] = 0;
-    }
-    runq = 0;
-    current = 0;
+    task_cache = kmem_cache_create("task", sizeof(struct task), 0);
+    files_cache = kmem_cache_create("task_files", sizeof(struct task_files), 0);
+    sighand_cache = kmem_cache_create("task_sighand", sizeof(struct task_sighand), 0);
+    pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), 0);
+    for (int i = 0; i < PID_HASH_SIZE; i++) pid_hash[i] = 0;
+    all_tasks = 0;
+    memset(runqueues, 0, sizeof(runqueues));
     next_task_id = 1;
     sched_running = 0;
     sched_ready = 1;
 }
 
-static struct task *alloc_task(void) {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_STATE_UNUSED) {
-            tasks[i].state = TASK_STATE_RUNNABLE;
-            tasks[i].id = next_task_id++;
-            tasks[i].next = 0;
-            tasks[i].cr3 = 0;
-            tasks[i].rsp = 0;
-            tasks[i].kernel_stack_base = 0;
-            tasks[i].kernel_stack_top = 0;
-            tasks[i].user_stack_top = 0;
-            tasks[i].entry = 0;
-            tasks[i].is_user = 0;
-            tasks[i].is_idle = 0;
-            tasks[i].parent_id = 0;
-            tasks[i].exit_code = 0;
-            tasks[i].waiting_for = -1;
-            tasks[i].pending_signals = 0;
-            tasks[i].blocked_signals = 0;
-            for (int j = 0; j < 32; j++){
-                tasks[i].signal_handlers[j] = 0;
-            }
-            tasks[i].pgid = 0;
-            task_fd_init(&tasks[i]);
-            return &tasks[i];
+// A new runnable task, child of parent (0 for none), entered in the PID
+// hash and the task lists.
+static struct task *alloc_task(struct task *parent) {
+    if (!task_cache) return 0;
+    struct task *t = kmem_cache_zalloc(task_cache);
+    if (!t) return 0;
+    t->files = kmem_cache_alloc(files_cache);
+    t->sighand = kmem_cache_zalloc(sighand_cache);
+    if (!t->files || !t->sighand) {
+        if (t->files) kmem_cache_free(files_cache, t->files);
+        if (t->sighand) kmem_cache_free(sighand_cache, t->sighand);
+        kmem_cache_free(task_cache, t);
+        return 0;
+    }
+    t->state = TASK_STATE_RUNNABLE;
+    t->brk = USER_HEAP_BASE;
+    t->lock_depth = 1;          // dropped by task_first_return
+    task_fd_init(t);
+
+    uint64_t flags = irq_save();
+    t->cpu = cpu_id();
+    t->id = next_task_id++;
+    struct task **bucket = &pid_hash[t->id % PID_HASH_SIZE];
+    t->hash_next = *bucket;
+    *bucket = t;
+
+    t->list_next = all_tasks;
+    if (all_tasks) all_tasks->list_prev = t;
+    all_tasks = t;
+
+    t->parent = parent;
+    if (parent) {
+        t->sibling_next = parent->children;
+        if (parent->children) parent->children->sibling_prev = t;
+        parent->children = t;
+    }
+    irq_restore(flags);
+    return t;
+}
+
+static void task_reap(struct task *t);
+
+// Return a task that is off the run queue, and its kernel stack.
+// Children still running are orphaned; exited ones are reaped, since
+// nobody is left to wait for them (unless another CPU has yet to switch
+// away from one, which is then never freed).
+static void free_task(struct task *t) {
+    uint64_t flags = irq_save();
+    struct task **pp = &pid_hash[t->id % PID_HASH_SIZE];
+    while (*pp != t) pp = &(*pp)->hash_next;
+    *pp = t->hash_next;
+
+    if (t->list_prev) t->list_prev->list_next = t->list_next;
+    else all_tasks = t->list_next;
+    if (t->list_next) t->list_next->list_prev = t->list_prev;
+
+    if (t->parent) {
+        if (t->sibling_prev) t->sibling_prev->sibling_next = t->sibling_next;
+        else t->parent->children = t->sibling_next;
+        if (t->sibling_next) t->sibling_next->sibling_prev = t->sibling_prev;
+    }
+
+    struct task *zombies = 0;
+    while (t->children) {
+        struct task *c = t->children;
+        t->children = c->sibling_next;
+        c->parent = 0;
+        c->sibling_prev = 0;
+        c->sibling_next = 0;
+        if (c->state == TASK_STATE_ZOMBIE && !task_running(c)) {
+            c->sibling_next = zombies;
+            zombies = c;
         }
     }
-    return 0;
+    irq_restore(flags);
+
+    while (zombies) {
+        struct task *c = zombies;
+        zombies = c->sibling_next;
+        task_reap(c);
+    }
+
+    t->state = TASK_STATE_UNUSED;
+    if (t->sleep_timer) ktimer_cancel(t->sleep_timer);
+    fpu_release(t);
+    free_stack((uint8_t *)t->kernel_stack_base);
+    kmem_cache_free(files_cache, t->files);
+    kmem_cache_free(sighand_cache, t->sighand);
+    kmem_cache_free(task_cache, t);
 }
+
+// Run queue: a ring of the runnable tasks only. Blocked and exited tasks
+// are off it, so picking the next task never skips over them.
+static void enqueue(struct task *t) {
+    uint64_t flags = irq_save();
+    struct runqueue *rq = &runqueues[t->cpu];
+    if (!t->on_runq) {
+        if (!rq->ring) {
+            rq->ring = t->next = t;
+        } else {
+            t->next = rq->ring->next;
+            rq->ring->next = t;
+        }
+        t->on_runq = 1;
+        if (!t->is_idle) rq->nr_running++;
+    }
+    irq_restore(flags);
+}
+
+static void dequeue(struct task *t) {
+    uint64_t flags = irq_save();
+    struct runqueue *rq = &runqueues[t->cpu];
+    if (t->on_runq) {
+        if (t->next == t) {
+            rq->ring = 0;
+        } else {
+            struct task *prev = t;
+            while (prev->next != t) prev = prev->next;
+            prev->next = t->next;
+            if (rq->ring == t) rq->ring = t->next;
+        }
+        t->on_runq = 0;
+        if (!t->is_idle) rq->nr_running--;
+    }
+    irq_restore(flags);
+}
+
+// Whether a CPU is up and has nothing but its idle task to run.
+static int rq_idle(struct runqueue *rq) {
+    return rq->curr && rq->curr->is_idle && rq->nr_running == 0;
+}
+
+// CPU for a task about to be queued: where it last ran if that CPU is
+// idle (its cache may still be warm), else any idle CPU, else the one with
+// the fewest runnable tasks. A task still running (blocked but not yet
+// switched away from) stays put.
+static int select_cpu(struct task *t) {
+    if (task_running(t) || rq_idle(&runqueues[t->cpu])) return t->cpu;
+    int best = t->cpu;
+    int n = smp_cpu_count();
+    for (int i = 0; i < n; i++) {
+        struct runqueue *rq = &runqueues[i];
+        if (!rq->curr) continue;
+        if (rq_idle(rq)) return i;
+        if (rq->nr_running < runqueues[best].nr_running) best = i;
+    }
+    return best;
+}
+
+// Ask a CPU to reschedule, with an IPI if it is not this one.
+static void resched_cpu(int cpu) {
+    runqueues[cpu].need_resched = 1;
+    if (cpu != cpu_id()) smp_send_ipi(cpu);
+}
+
+void sched_resched_cpu(int cpu) {
+    resched_cpu(cpu);
+}
+
+// Queue a new task and kick the CPU it was placed on. Interrupts off.
+static void place_task(struct task *t) {
+    t->cpu = select_cpu(t);
+    enqueue(t);
+    if (t->cpu != cpu_id()) resched_cpu(t->cpu);
+}
+
+// ============================================================================
+// Wait queues
+// ============================================================================
+
+static void schedule(void);
+
+// Take t off the wait queue it is blocked on. Interrupts off.
+static void wait_unlink(struct task *t) {
+    struct wait_queue *q = t->wait_q;
+    if (!q) return;
+    struct task *prev = 0;
+    for (struct task *w = q->head; w && w != t; w = w->wait_next) prev = w;
+    if (prev) prev->wait_next = t->wait_next;
+    else q->head = t->wait_next;
+    if (q->tail == t) q->tail = prev;
+    t->wait_q = 0;
+    t->wait_next = 0;
+}
+
+// Make a blocked task runnable and ask for a switch to it. Interrupts off.
+static void wake_task(struct task *t) {
+    wait_unlink(t);
+    if (t->state != TASK_STATE_WAITING) return;
+    t->state = TASK_STATE_RUNNABLE;
+    t->cpu = select_cpu(t);
+    enqueue(t);
+    runqueues[t->cpu].wake_hint = t;
+    resched_cpu(t->cpu);
+}
+
+void sched_sleep_on(struct wait_queue *q) {
+    struct task *t = current;
+    if (!t || !sched_running) {
+        // Nothing to switch to yet: wait for the interrupt that ends the wait
+        halt_unlocked();
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    t->state = TASK_STATE_WAITING;
+    t->wait_q = q;
+    t->wait_next = 0;
+    if (q->tail) q->tail->wait_next = t;
+    else q->head = t;
+    q->tail = t;
+    dequeue(t);
+
+    // Returns once woken and switched back to
+    schedule();
+    irq_restore(flags);
+}
+
+void sched_wake_one(struct wait_queue *q) {
+    uint64_t flags = irq_save();
+    if (q->head) wake_task(q->head);
+    irq_restore(flags);
+}
+
+void sched_wake_all(struct wait_queue *q) {
+    uint64_t flags = irq_save();
+    while (q->head) wake_task(q->head);
+    irq_restore(flags);
+}
+
+// A task sleeping until a deadline, on a wait queue of its own
+struct sleeper {
+    struct ktimer timer;        // first: the timer callback gets a sleeper
+    struct wait_queue q;
+    int expired;
+};
+
+static void sleeper_expired(struct ktimer *kt) {
+    struct sleeper *s = (struct sleeper *)kt;
+    s->expired = 1;
+    sched_wake_all(&s->q);
+}
+
+int sched_sleep_until(uint64_t deadline_ns) {
+    struct task *self = current;
+    struct sleeper s;
+    ktimer_init(&s.timer, sleeper_expired);
+    s.q.head = s.q.tail = 0;
+    s.expired = 0;
+
+    uint64_t flags = irq_save();
+    if (deadline_ns <= timer_now_ns()) {
+        s.expired = 1;
+    } else {
+        ktimer_add(&s.timer, deadline_ns);
+        // The timer lives on this stack: a kill cancels it before the
+        // stack can be freed (sched_kill).
+        if (self) self->sleep_timer = &s.timer;
+        // Woken by the timer or by a signal. Before scheduling starts
+        // sched_sleep_on only halts for an interrupt, so keep waiting.
+        do {
+            sched_sleep_on(&s.q);
+        } while (!s.expired && (!current || !sched_running));
+        ktimer_cancel(&s.timer);
+        if (self) self->sleep_timer = 0;
+    }
+    irq_restore(flags);
+    return s.expired ? 0 : -1;
+}
+
+int sched_need_resched(void) {
+    return this_rq()->need_resched;
+}
+
+void sched_preempt(void) {
+    uint64_t flags = irq_save();
+    if (this_rq()->need_resched && sched_running) schedule();
+    irq_restore(flags);
+}
+
+// ============================================================================
+// Signals and termination
+// ============================================================================
+
+void sched_kill(struct task *t, int code) {
+    uint64_t flags = irq_save();
+    if (t->state != TASK_STATE_ZOMBIE) {
+        wait_unlink(t);
+        if (t->sleep_timer) {
+            ktimer_cancel(t->sleep_timer);
+            t->sleep_timer = 0;
+        }
+        dequeue(t);
+        t->state = TASK_STATE_ZOMBIE;
+        t->exit_code = code;
+        if (t->parent) sched_wake_all(&t->parent->child_exit);
+        // Running (on this or another CPU): switch away from it
+        if (task_running(t)) resched_cpu(t->cpu);
+    }
+    irq_restore(flags);
+}
+
 // Check for pending signals and deliver them
 void sched_deliver_signals(struct task *t) {
     if (!t || !t->pending_signals) return;
@@ -124,21 +422,12 @@ void sched_deliver_signals(struct task *t) {
                 continue;  // Skip blocked signals
             }
             if (sig == SIGTERM || sig == SIGINT) {
-                // Mark as zombie directly instead of calling sched_exit
-                // to avoid halting in the middle of signal delivery
-                t->state = TASK_STATE_ZOMBIE;
-                t->exit_code = -1;
-                // Wake parent
-                for (int j = 0; j < 16; j++) {
-                    if (tasks[j].state == TASK_STATE_WAITING &&
-                        tasks[j].waiting_for == (int)t->id) {
-                        tasks[j].state = TASK_STATE_RUNNABLE;
-                        tasks[j].waiting_for = -1;
-                    }
-                }
+                // Terminate directly instead of calling sched_exit to
+                // avoid halting in the middle of signal delivery
+                sched_kill(t, -1);
                 return;  // Let scheduler handle the dead task
             }
-            if (t->signal_handlers[sig] != 0){
+            if (t->sighand->handlers[sig] != 0){
                 // Skip for now (we'll add custom handler support later)
             }
             break;  // Only deliver one signal at a time
@@ -146,96 +435,120 @@ void sched_deliver_signals(struct task *t) {
     }
 }
 
-// Wake all tasks waiting for a specific PID
-void sched_wake_waiters(int pid) {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_STATE_WAITING && tasks[i].waiting_for == pid) {
-            tasks[i].state = TASK_STATE_RUNNABLE;
-            tasks[i].waiting_for = -1;
-        }
-    }
+void sched_signal(struct task *t, int sig) {
+    uint64_t flags = irq_save();
+    t->pending_signals |= (1ULL << sig);
+    // Interrupt a blocking wait so the signal is acted on now; the waiter
+    // re-checks its condition and sleeps again if the signal is blocked.
+    // A task running on a CPU acts on it when that CPU next schedules.
+    if (t->state == TASK_STATE_WAITING) wake_task(t);
+    else if (task_running(t)) resched_cpu(t->cpu);
+    irq_restore(flags);
 }
 
 // Send a signal to all tasks in a process group
 void sched_signal_pgid(int pgid, int sig) {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state != TASK_STATE_UNUSED && tasks[i].pgid == pgid) {
-            tasks[i].pending_signals |= (1ULL << sig);
-        }
+    uint64_t flags = irq_save();
+    for (struct task *t = all_tasks; t; t = t->list_next) {
+        if (t->pgid == pgid && t->state != TASK_STATE_ZOMBIE) sched_signal(t, sig);
     }
-}
-static int task_index(struct task *t) {
-    return (int)(t - tasks);
-}
-
-static void enqueue(struct task *t) {
-    if (!runq) {
-        runq = t->next = t;
-    } else {
-        t->next = runq->next;
-        runq->next = t;
-    }
-}
-
-static void dequeue(struct task *t) {
-    if (!runq) return;
-    if (runq == t && t->next == t) {
-        runq = 0;
-        return;
-    }
-    struct task *prev = runq;
-    do {
-        if (prev->next == t) {
-            prev->next = t->next;
-            if (runq == t) runq = t->next;
-            return;
-        }
-        prev = prev->next;
-    } while (prev != runq);
+    irq_restore(flags);
 }
 
 void sched_bootstrap_current(void) {
-    struct task *t = alloc_task();
+    struct task *t = alloc_task(0);
     if (!t) return;
     t->is_user = 0;
     t->cr3 = (uint64_t)paging_kernel_pml4();
     t->pgid = t->id;
-    current = t;
+    uint64_t flags = irq_save();
+    this_rq()->curr = t;
+    this_cpu()->task = t;
     enqueue(t);
+    irq_restore(flags);
 }
 
-struct task *sched_create_kernel(void (*entry)(void)) {
-    struct task *t = alloc_task();
+static struct task *create_kernel_task(void (*entry)(void), int is_idle) {
+    struct task *t = alloc_task(0);
     if (!t) return 0;
-
-    int idx = task_index(t);
-    kstacks[idx] = alloc_stack(KSTACK_PAGES);
-    if (!kstacks[idx]) {
-        t->state = TASK_STATE_UNUSED;
+    t->is_idle = is_idle;
+    // Kernel tasks run holding the kernel lock; the idle task only takes
+    // it for work of its own.
+    t->lock_depth = is_idle ? 1 : 2;
+
+    uint8_t *stack = alloc_stack();
+    if (!stack) {
+        free_task(t);
         return 0;
     }
-    t->kernel_stack_base = (uint64_t)kstacks[idx];
+    t->kernel_stack_base = (uint64_t)stack;
     t->kernel_stack_top = t->kernel_stack_base + KSTACK_SIZE;
     t->cr3 = (uint64_t)paging_kernel_pml4();
-    paging_mark_supervisor_region(t->kernel_stack_base, KSTACK_SIZE);
 
     struct irq_frame *frame = (struct irq_frame *)(t->kernel_stack_top - sizeof(struct irq_frame));
-    mem_zero(frame, sizeof(*frame));
+    memset(frame, 0, sizeof(*frame));
     frame->rip = (uint64_t)entry;
     frame->cs = 0x08;
     frame->rflags = 0x202;
     frame->int_no = 0;
     frame->err_code = 0;
 
-    t->rsp = (uint64_t)frame;
+    t->rsp = initial_context(frame);
     t->entry = (uint64_t)entry;
     t->is_user = 0;
     t->pgid = t->id;
 
-    enqueue(t);
+    uint64_t flags = irq_save();
+    if (is_idle) {
+        this_rq()->idle = t;
+        enqueue(t);
+    } else {
+        place_task(t);
+    }
+    irq_restore(flags);
     return t;
 }
 
+uint64_t sched_prepare_cpu(int cpu) {
+    struct task *t = alloc_task(0);
+    if (!t) return 0;
+    uint8_t *stack = alloc_stack();
+    if (!stack) {
+        free_task(t);
+        return 0;
+    }
+    t->is_idle = 1;
+    t->kernel_stack_base = (uint64_t)stack;
+    t->kernel_stack_top = t->kernel_stack_base + KSTACK_SIZE;
+    t->cr3 = (uint64_t)paging_kernel_pml4();
+    t->pgid = t->id;
+
+    uint64_t flags = irq_save();
+    t->cpu = cpu;
+    runqueues[cpu].idle = t;
+    enqueue(t);
+    irq_restore(flags);
+    return t->kernel_stack_top;
+}
+
+void sched_enter_cpu(void) {
+    uint64_t flags = irq_save();
+    struct runqueue *rq = this_rq();
+    tss_set_rsp0(rq->idle->kernel_stack_top);
+    this_cpu()->kernel_rsp = rq->idle->kernel_stack_top;
+    this_cpu()->task = rq->idle;
+    rq->curr = rq->idle;
+    irq_restore(flags);
+}
+
+struct task *sched_create_kernel(void (*entry)(void)) {
+    return create_kernel_task(entry, 0);
+}
+
+struct task *sched_create_idle(void (*entry)(void)) {
+    return create_kernel_task(entry, 1);
+}
+
 struct task *sched_create_user(struct vfs_node *node, char **args) {
     // Legacy wrapper — delegates to sched_spawn
     (void)args;
@@ -256,59 +569,147 @@ struct task *sched_create_user(struct vfs_node *node, char **args) {
 }
 
 // ============================================================================
-// Scheduler tick — called from timer IRQ
+// Switching — timer IRQ, blocking and yielding, wakeups from IRQs
 // ============================================================================
 
-struct irq_frame *sched_tick(struct irq_frame *frame) {
-    if (!frame) return frame;
-    if (!sched_ready || !runq || !current) return frame;
-    if (!sched_running) return frame;
+// Take a task waiting on the busiest other CPU for rq, which has nothing
+// but its idle task left. 0 if no CPU has a task to spare.
+static struct task *steal_task(struct runqueue *rq) {
+    struct runqueue *busiest = 0;
+    int n = smp_cpu_count();
+    for (int i = 0; i < n; i++) {
+        struct runqueue *r = &runqueues[i];
+        if (r == rq || !r->curr) continue;
+        int waiting = r->nr_running - (!r->curr->is_idle && r->curr->on_runq);
+        if (waiting > 0 && (!busiest || r->nr_running > busiest->nr_running)) busiest = r;
+    }
+    if (!busiest) return 0;
+
+    struct task *t = busiest->ring;
+    do {
+        if (t != busiest->curr && !t->is_idle) {
+            dequeue(t);
+            t->cpu = (int)(rq - runqueues);
+            enqueue(t);
+            if (busiest->wake_hint == t) busiest->wake_hint = 0;
+            return t;
+        }
+        t = t->next;
+    } while (t != busiest->ring);
+    return 0;
+}
 
-    current->rsp = (uint64_t)frame;
+// Next task to run: a task just woken, else round robin from the current
+// task (or the ring head if the current task has left the ring), else a
+// task stolen from another CPU, with the idle task only when nothing else
+// is runnable. 0 if there is nothing at all.
+static struct task *pick_next(struct runqueue *rq) {
+    struct task *t = rq->wake_hint;
+    rq->wake_hint = 0;
+    if (t && t->on_runq && &runqueues[t->cpu] == rq) return t;
 
-    struct task *start = current;
     struct task *idle = 0;
-    do {
-        current = current->next;
-        if (!current || current->state != TASK_STATE_RUNNABLE) continue;
-        if (!current->is_idle) break;
-        if (!idle) idle = current;
-    } while (current && current != start);
-
-    if (!current || current->state != TASK_STATE_RUNNABLE) {
-        if (idle) {
-            current = idle;
-        } else {
-            return frame;
+    if (rq->ring) {
+        struct task *start = rq->curr->on_runq ? rq->curr : rq->ring;
+        t = start;
+        do {
+            t = t->next;
+            if (!t->is_idle) return t;
+            if (!idle) idle = t;
+        } while (t != start);
+    }
+    t = steal_task(rq);
+    return t ? t : idle;
+}
+
+// Switch to the next runnable task, delivering its pending signals first.
+// Returns when the current task is next switched back to, at once if it is
+// still the best choice. Interrupts off.
+static void schedule(void) {
+    struct runqueue *rq = this_rq();
+    struct task *prev = rq->curr;
+    struct task *next;
+    rq->need_resched = 0;
+
+    // A signal posted while prev ran here takes effect now
+    if (prev->pending_signals && prev->state == TASK_STATE_RUNNABLE) {
+        sched_deliver_signals(prev);
+    }
+
+    for (;;) {
+        // A pending SIGINT/SIGTERM kills the chosen task; pick again.
+        while ((next = pick_next(rq)) != 0) {
+            sched_deliver_signals(next);
+            if (next->state == TASK_STATE_RUNNABLE) break;
         }
+        if (next) break;
+        // Nothing runnable (no idle task): wait here for a wakeup. IRQs
+        // taken meanwhile must not switch from inside this loop.
+        rq->idle_wait = 1;
+        halt_unlocked();
+        rq->idle_wait = 0;
+    }
+
+    // Time-slice only while someone else is waiting; an idle CPU or a lone
+    // task runs without a tick.
+    timer_set_slice(rq->nr_running > (next->is_idle ? 0 : 1));
+    if (next == prev) return;
+    rq->curr = next;
+    this_cpu()->task = next;
+
+    // An exited task is reaped only once no CPU runs it any more
+    if (prev->state == TASK_STATE_ZOMBIE && prev->parent) {
+        sched_wake_all(&prev->parent->child_exit);
     }
-    if (current->rsp == 0) return frame;
 
     // Update per-task kernel stack for TSS and syscall entry
-    if (current->kernel_stack_top) {
-        tss_set_rsp0(current->kernel_stack_top);
-        current_kernel_rsp = current->kernel_stack_top;
+    if (next->kernel_stack_top) {
+        tss_set_rsp0(next->kernel_stack_top);
+        this_cpu()->kernel_rsp = next->kernel_stack_top;
     }
 
-    // Switch address space
-    if (current->cr3) {
-        __asm__ volatile ("mov %0, %%cr3" : : "r"(current->cr3) : "memory");
+    // Switch address space (a no-op between kernel tasks and the idle
+    // task). The kernel stacks are mapped in every address space.
+    if (next->cr3) {
+        paging_switch((uint64_t *)next->cr3, next->pcid);
     }
 
-    sched_deliver_signals(current);
-    
-    return (struct irq_frame *)current->rsp;
+    // Registers prev used stay live until another task touches the FPU
+    fpu_switch(prev);
+
+    // The kernel lock stays held across the switch; next resumes at the
+    // nesting it was switched away at.
+    prev->lock_depth = kernel_lock_handoff(next->lock_depth);
+    ctx_switch(&prev->rsp, next->rsp);
+}
+
+void sched_tick(void) {
+    if (!sched_ready || !sched_running) return;
+    struct runqueue *rq = this_rq();
+    if (!rq->curr || rq->idle_wait) return;
+    schedule();
 }
 
 void sched_start(void) {
     sched_running = 1;
+    uint64_t flags = irq_save();
+    timer_set_slice(this_rq()->nr_running > 1);
+    irq_restore(flags);
 }
 
 void sched_yield(void) {
-    // Halt until the next interrupt (typically the timer at ~18.2 Hz).
-    // The timer IRQ will call sched_tick() which context-switches if
-    // another task is runnable.
-    __asm__ volatile ("sti; hlt");
+    // Switch if another non-idle task is runnable; otherwise halt until
+    // the next interrupt rather than spin.
+    uint64_t flags = irq_save();
+    struct runqueue *rq = this_rq();
+    struct task *self = rq->curr;
+    int others = 0;
+    if (sched_running && self) {
+        others = rq->nr_running > (self->on_runq && !self->is_idle ? 1 : 0);
+    }
+    if (others) schedule();
+    else halt_unlocked();
+    irq_restore(flags);
 }
 
 // ============================================================================
@@ -318,75 +719,44 @@ void sched_yield(void) {
 void sched_exit(int code) {
     if (!current) return;
 
-    current->exit_code = code;
-    current->state = TASK_STATE_ZOMBIE;
-
-    // Wake parent if it's waiting for us
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_STATE_WAITING &&
-            tasks[i].waiting_for == (int)current->id) {
-            tasks[i].state = TASK_STATE_RUNNABLE;
-            tasks[i].waiting_for = -1;
-        }
-    }
-
-    // Halt - scheduler will never schedule us again (we're ZOMBIE)
-    // Timer interrupt will switch to another runnable task
+    // Leave the run queue as a zombie and wake the parent; never resumed
+    __asm__ volatile ("cli");
+    sched_kill(current, code);
+    schedule();
     while (1) {
-        __asm__ volatile ("sti; hlt");
+        __asm__ volatile ("hlt");
     }
 }
 
 static void task_reap(struct task *t) {
-    int idx = task_index(t);
-
     // Remove from run queue
     dequeue(t);
 
     // Free per-process page tables and user pages
     if (t->cr3 && t->cr3 != (uint64_t)paging_kernel_pml4()) {
+        paging_pcid_free(t->pcid, (uint64_t *)t->cr3);
         paging_free_user_space((uint64_t *)t->cr3);
     }
+    vma_free_all(&t->vmas);
 
-    // Free kernel stack
-    if (kstacks[idx]) {
-        free_stack(kstacks[idx], KSTACK_PAGES);
-        kstacks[idx] = 0;
-    }
+    // Drop the pipe, shared-memory and file references of open descriptors
+    for (int i = 0; i < MAX_FDS; i++) task_fd_free(t, i);
 
-    t->state = TASK_STATE_UNUSED;
+    free_task(t);
 }
 
 int sched_waitpid(int pid) {
-    struct task *child = 0;
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if ((int)tasks[i].id == pid) {
-            child = &tasks[i];
-            break;
-        }
-    }
-    if (!child) return -1;
-
-    // Already exited?
-    if (child->state == TASK_STATE_ZOMBIE) {
-        int code = child->exit_code;
-        task_reap(child);
-        return code;
-    }
-
-    // Block until child exits
-    current->state = TASK_STATE_WAITING;
-    current->waiting_for = pid;
-
-    // Spin: timer interrupts will preempt us and run other tasks.
-    // When the child calls sched_exit(), it wakes us by setting
-    // our state back to RUNNABLE.
-    while (1) {
-        // Volatile read to prevent compiler from caching the value
-        volatile int state = current->state;
-        if (state != TASK_STATE_WAITING) break;
-        __asm__ volatile ("sti; hlt");
+    struct task *self = current;
+    struct task *child = sched_get_task(pid);
+    if (!child || child->parent != self) return -1;
+
+    // Block until child exits; it wakes us from sched_kill(), and again
+    // from schedule() if it was still running on another CPU.
+    uint64_t flags = irq_save();
+    while (child->state != TASK_STATE_ZOMBIE || task_running(child)) {
+        sched_sleep_on(&self->child_exit);
     }
+    irq_restore(flags);
 
     // Child is now zombie — reap it
     int code = child->exit_code;
@@ -399,17 +769,47 @@ struct task *sched_current(void) {
 }
 
 struct task *sched_get_task(int pid) {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state != TASK_STATE_UNUSED && (int)tasks[i].id == pid)
-            return &tasks[i];
-    }
-    return 0;
+    if (pid <= 0) return 0;
+    uint64_t flags = irq_save();
+    struct task *t = pid_hash[(uint64_t)pid % PID_HASH_SIZE];
+    while (t && (int)t->id != pid) t = t->hash_next;
+    irq_restore(flags);
+    return t;
 }
 
 // ============================================================================
 // Spawn — create a new user process from an ELF file
 // ============================================================================
 
+// Copy bytes onto a new task's user stack through the direct map,
+// faulting in stack pages as needed. A copy may straddle a page boundary
+// and the two pages need not be physically adjacent.
+static int put_user_stack(struct task *t, uint64_t va, const void *src, uint64_t len) {
+    uint64_t *pml4 = (uint64_t *)t->cr3;
+    const uint8_t *s = (const uint8_t *)src;
+    while (len) {
+        uint64_t pa = paging_virt_to_phys(pml4, va);
+        if (!pa) {
+            if (vma_fault(&t->vmas, pml4, va, 1) < 0) return -1;
+            pa = paging_virt_to_phys(pml4, va);
+        }
+        uint64_t chunk = 0x1000 - (va & 0xFFF);
+        if (chunk > len) chunk = len;
+        memcpy(phys_to_virt(pa), s, chunk);
+        va += chunk;
+        s += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Undo a sched_spawn that failed after its kernel stack was allocated.
+static void spawn_abort(struct task *t) {
+    paging_free_user_space((uint64_t *)t->cr3);
+    vma_free_all(&t->vmas);
+    free_task(t);
+}
+
 int sched_spawn(const char *path, char **args, struct fd_entry *fd_overrides) {
     // Disable interrupts during path resolution + ELF loading to prevent
     // preemption from corrupting shared FAT32 buffers and ATA state.
@@ -417,23 +817,27 @@ int sched_spawn(const char *path, char **args, struct fd_entry *fd_overrides) {
 
     struct vfs_node *node = vfs_resolve_path(path);
     if (!node || !(node->flags & VFS_FILE)) {
+        vfs_node_put(node);
         __asm__ volatile ("sti");
         return -1;
     }
 
-    struct task *t = alloc_task();
-    if (!t) { __asm__ volatile ("sti"); return -1; }
+    struct task *t = alloc_task(current);
+    if (!t) { vfs_node_put(node); __asm__ volatile ("sti"); return -1; }
 
     // Create per-process page tables (identity map kernel, user space empty)
     uint64_t *user_pml4 = paging_new_user_space();
-    if (!user_pml4) { t->state = TASK_STATE_UNUSED; __asm__ volatile ("sti"); return -1; }
+    if (!user_pml4) { free_task(t); vfs_node_put(node); __asm__ volatile ("sti"); return -1; }
     t->cr3 = (uint64_t)user_pml4;
 
     // Load ELF into fresh pages mapped in the new address space
     uint64_t entry = 0;
-    if (elf_load_into(node, user_pml4, &entry) < 0) {
+    int loaded = elf_load_into(node, user_pml4, &t->vmas, &entry);
+    vfs_node_put(node);
+    if (loaded < 0) {
         paging_free_user_space(user_pml4);
-        t->state = TASK_STATE_UNUSED;
+        vma_free_all(&t->vmas);
+        free_task(t);
         __asm__ volatile ("sti");
         return -1;
     }
@@ -441,60 +845,38 @@ int sched_spawn(const char *path, char **args, struct fd_entry *fd_overrides) {
     // ELF loaded — safe to re-enable interrupts
     __asm__ volatile ("sti");
 
-    // Map the VESA framebuffer into the user's address space (supervisor-only)
-    // so that kernel syscall handlers (e.g. SYS_FB_PUTPIXEL) can access it
-    // while running with the user's CR3.
-    {
-        uint64_t fba = fb_base_addr();
-        if (fba) {
-            uint64_t bpp = (uint64_t)fb_bpp();
-            uint64_t bytes_pp = bpp ? bpp / 8 : 4;
-            uint64_t fb_size = (uint64_t)fb_width() * (uint64_t)fb_height() * bytes_pp;
-            uint64_t ms = fba & ~0xFFFULL;
-            uint64_t me = (fba + fb_size + 0xFFFULL) & ~0xFFFULL;
-            for (uint64_t a = ms; a < me; a += 0x1000) {
-                paging_map_kernel_page(user_pml4, a, a, PAGE_PRESENT | PAGE_WRITABLE);
-            }
-        }
-    }
+    // The VESA framebuffer mapping that kernel syscall handlers (e.g.
+    // SYS_FB_PUTPIXEL) use under the user's CR3 comes with the kernel
+    // subtrees linked in by paging_new_user_space().
 
-    // Allocate kernel stack (identity-mapped, supervisor-only)
-    int idx = task_index(t);
-    kstacks[idx] = alloc_stack(KSTACK_PAGES);
-    if (!kstacks[idx]) {
-        paging_free_user_space(user_pml4);
-        t->state = TASK_STATE_UNUSED;
+    // Allocate kernel stack (direct-mapped, supervisor-only)
+    uint8_t *stack = alloc_stack();
+    if (!stack) {
+        spawn_abort(t);
         return -1;
     }
-    t->kernel_stack_base = (uint64_t)kstacks[idx];
+    t->kernel_stack_base = (uint64_t)stack;
     t->kernel_stack_top = t->kernel_stack_base + KSTACK_SIZE;
-    paging_mark_supervisor_region(t->kernel_stack_base, KSTACK_SIZE);
-
-    // Allocate user stack pages and map at USER_STACK virtual address
-    uint64_t ustack_vaddr = USER_STACK_TOP - USER_STACK_SIZE;
-    uint8_t *ustack_phys[USTACK_PAGES];
-    for (int i = 0; i < USTACK_PAGES; i++) {
-        ustack_phys[i] = (uint8_t *)pmm_alloc_page();
-        if (!ustack_phys[i]) {
-            t->state = TASK_STATE_UNUSED;
-            return -1;
-        }
-        mem_zero(ustack_phys[i], 4096);
-        paging_map_user_page(user_pml4, ustack_vaddr + i * 4096,
-                             (uint64_t)ustack_phys[i],
-                             PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
+
+    // User stack is a grows-down area below USER_STACK_TOP; pages are
+    // faulted in as the program touches them.
+    struct vma *ustack = vma_add(&t->vmas, USER_STACK_TOP - USER_STACK_SIZE,
+                                 USER_STACK_TOP, VMA_WRITE | VMA_GROWSDOWN);
+    if (!ustack) {
+        spawn_abort(t);
+        return -1;
     }
+    ustack->limit = USER_STACK_TOP - USER_STACK_MAX;
     t->user_stack_top = USER_STACK_TOP;
 
     // --- Write exit stub and argv onto the user stack ---
-    // We write to the PHYSICAL pages directly (kernel has identity map access)
-    // but all POINTERS we push must be VIRTUAL addresses (what user code sees).
+    // We write to the physical pages through the direct map, but all
+    // POINTERS we push must be user virtual addresses (what user code sees).
 
     // Exit stub goes at the very top of the stack
     uint64_t stub_vaddr = USER_STACK_TOP - 32;
-    uint64_t stub_pa = paging_virt_to_phys(user_pml4, stub_vaddr);
-    uint8_t *stub = (uint8_t *)stub_pa;
     uint32_t sys_exit = SYS_EXIT;
+    uint8_t stub[10];
     stub[0] = 0xB8;  // mov eax, imm32
     stub[1] = (uint8_t)(sys_exit & 0xFF);
     stub[2] = (uint8_t)((sys_exit >> 8) & 0xFF);
@@ -505,6 +887,10 @@ int sched_spawn(const char *path, char **args, struct fd_entry *fd_overrides) {
     stub[7] = 0x0F;  // syscall
     stub[8] = 0x05;
     stub[9] = 0xF4;  // hlt (safety)
+    if (put_user_stack(t, stub_vaddr, stub, sizeof(stub)) < 0) {
+        spawn_abort(t);
+        return -1;
+    }
 
     // Build argv on user stack
     int argc = 0;
@@ -521,12 +907,12 @@ int sched_spawn(const char *path, char **args, struct fd_entry *fd_overrides) {
 
     // Copy argument strings
     uint64_t argv_vptrs[16];
+    int err = 0;
     for (int i = argc - 1; i >= 0; i--) {
         int len = 0;
         while (args[i][len]) len++;
         sp_v -= (len + 1);
-        uint64_t pa = paging_virt_to_phys(user_pml4, sp_v);
-        mem_copy((void *)pa, args[i], len + 1);
+        err |= put_user_stack(t, sp_v, args[i], len + 1);
         argv_vptrs[i] = sp_v;
     }
 
@@ -536,31 +922,36 @@ int sched_spawn(const char *path, char **args, struct fd_entry *fd_overrides) {
     // Keep SysV stack alignment correct for main(argc, argv).
     // We later push: NULL + argc pointers + return address.
     // If argc is even, add one 8-byte pad so (RSP + 8) % 16 == 0 at entry.
+    uint64_t zero = 0;
     if ((argc & 1) == 0) {
         sp_v -= 8;
-        *(uint64_t *)paging_virt_to_phys(user_pml4, sp_v) = 0;
+        err |= put_user_stack(t, sp_v, &zero, 8);
     }
 
     // Push NULL terminator for argv
     sp_v -= 8;
-    *(uint64_t *)paging_virt_to_phys(user_pml4, sp_v) = 0;
+    err |= put_user_stack(t, sp_v, &zero, 8);
 
     // Push argv pointers (reverse order)
     for (int i = argc - 1; i >= 0; i--) {
         sp_v -= 8;
-        *(uint64_t *)paging_virt_to_phys(user_pml4, sp_v) = argv_vptrs[i];
+        err |= put_user_stack(t, sp_v, &argv_vptrs[i], 8);
     }
 
     uint64_t argv_v = sp_v;  // argv points here
 
     // ABI alignment: (RSP + 8) % 16 == 0 at function entry
     sp_v -= 8;
-    *(uint64_t *)paging_virt_to_phys(user_pml4, sp_v) = stub_vaddr;  // return addr
+    err |= put_user_stack(t, sp_v, &stub_vaddr, 8);  // return addr
+    if (err) {
+        spawn_abort(t);
+        return -1;
+    }
 
     // Set up interrupt frame on kernel stack for first iretq
     struct irq_frame_user *frame = (struct irq_frame_user *)
         (t->kernel_stack_top - sizeof(struct irq_frame_user));
-    mem_zero(frame, sizeof(*frame));
+    memset(frame, 0, sizeof(*frame));
 
     frame->base.rip    = entry;
     frame->base.cs     = 0x23;
@@ -570,29 +961,28 @@ int sched_spawn(const char *path, char **args, struct fd_entry *fd_overrides) {
     frame->rsp         = sp_v;
     frame->ss          = 0x1B;
 
-    t->rsp   = (uint64_t)frame;
+    t->rsp   = initial_context(frame);
     t->entry = entry;
     t->is_user = 1;
-    t->parent_id = current ? (int)current->id : 0;
     t->pgid = t->id;  // New process starts as own group leader
 
     // Inherit FD table
     if (fd_overrides) {
-        for (int i = 0; i < MAX_FDS; i++)
-            t->fd_table[i] = fd_overrides[i];
+        for (int i = 0; i < MAX_FDS; i++) {
+            t->files->fd_table[i] = fd_overrides[i];
+            task_fd_ref(&t->files->fd_table[i]);
+        }
     }
 
     // Inherit cwd from parent
     if (current) {
-        int k = 0;
-        while (current->cwd[k] && k < VFS_MAX_PATH - 1) {
-            t->cwd[k] = current->cwd[k];
-            k++;
-        }
-        t->cwd[k] = '\0';
+        strlcpy(t->files->cwd, current->files->cwd, VFS_MAX_PATH);
     }
 
-    enqueue(t);
+    t->pcid = paging_pcid_alloc();
+    uint64_t flags = irq_save();
+    place_task(t);
+    irq_restore(flags);
     return (int)t->id;
 }
 
@@ -605,66 +995,76 @@ int sched_fork(void) {
     struct task *parent = current;
     if (!parent || !parent->is_user) return -1;
 
-    struct task *child = alloc_task();
+    // User context of this syscall, saved by syscall_entry.asm
+    struct syscall_frame *uctx = (struct syscall_frame *)
+        (parent->kernel_stack_top - sizeof(struct syscall_frame));
+
+    struct task *child = alloc_task(parent);
     if (!child) return -1;
 
-    // Clone page tables with deep copy of user pages
+    // Share the parent's user pages copy-on-write
     uint64_t *child_pml4 = paging_new_user_space();
-    if (!child_pml4) { child->state = TASK_STATE_UNUSED; return -1; }
-    if (paging_clone_user_pages(child_pml4, (uint64_t *)parent->cr3) < 0) {
-        paging_free_user_space(child_pml4);
-        child->state = TASK_STATE_UNUSED;
+    if (!child_pml4) { free_task(child); return -1; }
+    child->cr3 = (uint64_t)child_pml4;
+    if (paging_clone_user_pages(child_pml4, (uint64_t *)parent->cr3) < 0 ||
+        vma_clone(&child->vmas, parent->vmas) < 0) {
+        spawn_abort(child);
         return -1;
     }
-    child->cr3 = (uint64_t)child_pml4;
 
     // Allocate kernel stack for child
-    int idx = task_index(child);
-    kstacks[idx] = alloc_stack(KSTACK_PAGES);
-    if (!kstacks[idx]) {
-        paging_free_user_space(child_pml4);
-        child->state = TASK_STATE_UNUSED;
+    uint8_t *stack = alloc_stack();
+    if (!stack) {
+        spawn_abort(child);
         return -1;
     }
-    child->kernel_stack_base = (uint64_t)kstacks[idx];
+    child->kernel_stack_base = (uint64_t)stack;
     child->kernel_stack_top = child->kernel_stack_base + KSTACK_SIZE;
-    paging_mark_supervisor_region(child->kernel_stack_base, KSTACK_SIZE);
 
     // Build an IRQ frame on the child's kernel stack.
-    // When the scheduler picks the child, irq_common will pop this frame
-    // and iretq to user mode — resuming right after the fork() syscall
-    // with RAX = 0.
+    // When the scheduler first switches to the child, task_first_return
+    // pops this frame and iretqs to user mode — resuming right after the
+    // fork() syscall with RAX = 0.
     struct irq_frame_user *frame = (struct irq_frame_user *)
         (child->kernel_stack_top - sizeof(struct irq_frame_user));
-    mem_zero(frame, sizeof(*frame));
+    memset(frame, 0, sizeof(*frame));
 
-    frame->base.rip    = user_ctx_rip;       // resume at instruction after SYSCALL
+    frame->base.rip    = uctx->rip;          // resume at instruction after SYSCALL
     frame->base.cs     = 0x23;               // user code segment
-    frame->base.rflags = user_ctx_rflags;    // original flags
+    frame->base.rflags = uctx->rflags;       // original flags
     frame->base.rax    = 0;                  // fork() returns 0 in child
-    frame->base.rbx    = user_ctx_rbx;
-    frame->base.rbp    = user_ctx_rbp;
-    frame->base.r12    = user_ctx_r12;
-    frame->base.r13    = user_ctx_r13;
-    frame->base.r14    = user_ctx_r14;
-    frame->base.r15    = user_ctx_r15;
-    frame->rsp         = user_ctx_rsp;       // same user stack (copied via page clone)
+    frame->base.rbx    = uctx->rbx;
+    frame->base.rbp    = uctx->rbp;
+    frame->base.r12    = uctx->r12;
+    frame->base.r13    = uctx->r13;
+    frame->base.r14    = uctx->r14;
+    frame->base.r15    = uctx->r15;
+    frame->rsp         = uctx->rsp;          // same user stack (shared copy-on-write)
     frame->ss          = 0x1B;               // user data segment
 
-    child->rsp = (uint64_t)frame;
+    child->rsp = initial_context(frame);
     child->entry = parent->entry;
     child->is_user = 1;
     child->user_stack_top = parent->user_stack_top;
-    child->parent_id = (int)parent->id;
+    child->brk = parent->brk;
     child->pgid = parent->pgid;  // Inherit parent's process group
 
+    if (fpu_fork(child, parent) < 0) {
+        spawn_abort(child);
+        return -1;
+    }
+
     // Copy FD table and cwd
-    for (int i = 0; i < MAX_FDS; i++)
-        child->fd_table[i] = parent->fd_table[i];
-    for (int i = 0; i < VFS_MAX_PATH && parent->cwd[i]; i++)
-        child->cwd[i] = parent->cwd[i];
+    for (int i = 0; i < MAX_FDS; i++) {
+        child->files->fd_table[i] = parent->files->fd_table[i];
+        task_fd_ref(&child->files->fd_table[i]);
+    }
+    strlcpy(child->files->cwd, parent->files->cwd, VFS_MAX_PATH);
 
-    enqueue(child);
+    child->pcid = paging_pcid_alloc();
+    uint64_t flags = irq_save();
+    place_task(child);
+    irq_restore(flags);
 
     // Parent gets child PID
     return (int)child->id;
@@ -676,55 +1076,138 @@ int sched_fork(void) {
 
 void task_fd_init(struct task *t) {
     for (int i = 0; i < MAX_FDS; i++){
-        t->fd_table[i].type = FD_UNUSED;
-        t->fd_table[i].node = 0;
-        t->fd_table[i].offset = 0;
-        t->fd_table[i].flags = 0;
-        t->fd_table[i].pipe = 0;
+        t->files->fd_table[i].type = FD_UNUSED;
+        t->files->fd_table[i].node = 0;
+        t->files->fd_table[i].offset = 0;
+        t->files->fd_table[i].flags = 0;
+        t->files->fd_table[i].pipe = 0;
+        t->files->fd_table[i].shm = 0;
     }
-    t->fd_table[0].type = FD_CONSOLE;
-    t->fd_table[1].type = FD_CONSOLE;
-    t->fd_table[2].type = FD_CONSOLE;
+    t->files->fd_table[0].type = FD_CONSOLE;
+    t->files->fd_table[1].type = FD_CONSOLE;
+    t->files->fd_table[2].type = FD_CONSOLE;
 
-    t->cwd[0] = '/';
-    t->cwd[1] = '\0';
+    t->files->cwd[0] = '/';
+    t->files->cwd[1] = '\0';
 }
 
 int task_fd_alloc(struct task *t) {
     for (int i = 3; i < MAX_FDS; i++) {
-        if (t->fd_table[i].type == FD_UNUSED) {
+        if (t->files->fd_table[i].type == FD_UNUSED) {
             return i;
         }
     }
     return -1;
 }
 
+void task_fd_ref(struct fd_entry *e) {
+    if (e->type == FD_PIPE) {
+        uint64_t flags = irq_save();
+        if (e->flags == O_RDONLY) e->pipe->read_open++;
+        else e->pipe->write_open++;
+        irq_restore(flags);
+    } else if (e->type == FD_SHM) {
+        shm_get(e->shm);
+    } else if (e->type == FD_FILE || e->type == FD_DIR) {
+        vfs_node_get(e->node);
+    }
+}
+
 void task_fd_free(struct task *t, int fd) {
-    if (fd >= 3 && fd < MAX_FDS) {
-        t->fd_table[fd].type = FD_UNUSED;
-        t->fd_table[fd].node = 0;
-        t->fd_table[fd].offset = 0;
-        t->fd_table[fd].flags = 0;
-        t->fd_table[fd].pipe = 0;
+    if (fd < 0 || fd >= MAX_FDS) return;
+    struct fd_entry *e = &t->files->fd_table[fd];
+    if (e->type == FD_PIPE && e->pipe) {
+        uint64_t flags = irq_save();
+        if (e->flags == O_RDONLY) e->pipe->read_open--;
+        else e->pipe->write_open--;
+        int last = e->pipe->read_open == 0 && e->pipe->write_open == 0;
+        // Closing the last end of one side ends the other side's wait
+        if (!last && e->pipe->read_open == 0) sched_wake_all(&e->pipe->writers);
+        if (!last && e->pipe->write_open == 0) sched_wake_all(&e->pipe->readers);
+        irq_restore(flags);
+        if (last) kmem_cache_free(pipe_cache, e->pipe);
+    } else if (e->type == FD_SHM) {
+        shm_put(e->shm);
+    } else if (e->type == FD_FILE || e->type == FD_DIR) {
+        vfs_node_put(e->node);
     }
+
+    // The standard descriptors fall back to the console once closed
+    e->type = fd < 3 ? FD_CONSOLE : FD_UNUSED;
+    e->node = 0;
+    e->offset = 0;
+    e->flags = 0;
+    e->pipe = 0;
+    e->shm = 0;
 }
 
 struct fd_entry *task_fd_get(struct task *t, int fd) {
     if (fd < 0 || fd >= MAX_FDS) return 0;
-    if (t->fd_table[fd].type == FD_UNUSED) return 0;
-    return &t->fd_table[fd];
+    if (t->files->fd_table[fd].type == FD_UNUSED) return 0;
+    return &t->files->fd_table[fd];
 }
 
 struct pipe *pipe_alloc(void){
-    for (int i = 0; i < MAX_PIPES; i++){
-        if (pipes[i].read_open == 0 && pipes[i].write_open == 0){
-            pipes[i].read_pos = 0;
-            pipes[i].write_pos = 0;
-            pipes[i].count = 0;
-            pipes[i].read_open = 1;
-            pipes[i].write_open = 1;
-            return &pipes[i];
+    struct pipe *p = pipe_cache ? kmem_cache_alloc(pipe_cache) : 0;
+    if (!p) return 0;
+    p->read_pos = 0;
+    p->write_pos = 0;
+    p->count = 0;
+    p->readers.head = p->readers.tail = 0;
+    p->writers.head = p->writers.tail = 0;
+    p->read_open = 1;
+    p->write_open = 1;
+    return p;
+}
+
+// Pipe data moves through a stack buffer so user pages (which may fault)
+// are only touched with interrupts enabled.
+#define PIPE_CHUNK 256
+
+int pipe_read(struct pipe *p, char *buf, int count) {
+    char tmp[PIPE_CHUNK];
+    if (count <= 0) return 0;
+    if (count > PIPE_CHUNK) count = PIPE_CHUNK;
+
+    uint64_t flags = irq_save();
+    while (p->count == 0 && p->write_open > 0) sched_sleep_on(&p->readers);
+    int n = p->count < count ? p->count : count;
+    for (int i = 0; i < n; i++) {
+        tmp[i] = p->buffer[p->read_pos];
+        p->read_pos = (p->read_pos + 1) % PIPE_BUF_SIZE;
+    }
+    p->count -= n;
+    if (n > 0) sched_wake_all(&p->writers);
+    irq_restore(flags);
+
+    memcpy(buf, tmp, n);
+    return n;   // 0: empty with no writers left
+}
+
+int pipe_write(struct pipe *p, const char *buf, int count) {
+    char tmp[PIPE_CHUNK];
+    int done = 0;
+    while (done < count) {
+        int chunk = count - done;
+        if (chunk > PIPE_CHUNK) chunk = PIPE_CHUNK;
+        memcpy(tmp, buf + done, chunk);
+
+        int off = 0;
+        uint64_t flags = irq_save();
+        while (off < chunk) {
+            while (p->count == PIPE_BUF_SIZE && p->read_open > 0) sched_sleep_on(&p->writers);
+            if (p->read_open == 0) break;
+            while (off < chunk && p->count < PIPE_BUF_SIZE) {
+                p->buffer[p->write_pos] = tmp[off++];
+                p->write_pos = (p->write_pos + 1) % PIPE_BUF_SIZE;
+                p->count++;
+            }
+            sched_wake_all(&p->readers);
         }
+        irq_restore(flags);
+
+        done += off;
+        if (off < chunk) return done ? done : -1;   // no readers left
     }
-    return 0;
+    return done;
 }
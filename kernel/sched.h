@@ -3,13 +3,24 @@
 
 #include <stdint.h>
 #include "fs/vfs.h"
+#include "vma.h"
+#include "shm.h"
 
 struct irq_frame;
+struct ktimer;
 
 #define TASK_STATE_UNUSED   0
 #define TASK_STATE_RUNNABLE 1
 #define TASK_STATE_ZOMBIE   2
-#define TASK_STATE_WAITING  3   // Blocked on waitpid
+#define TASK_STATE_WAITING  3   // Blocked on a wait queue, off the run queue
+
+struct task;
+
+// Tasks blocked until some event, woken in FIFO order.
+struct wait_queue {
+    struct task *head;
+    struct task *tail;
+};
 
 // ============================================================================
 // Per-process file descriptor table
@@ -21,6 +32,7 @@ struct irq_frame;
 #define FD_DIR      2
 #define FD_CONSOLE  3
 #define FD_PIPE     4
+#define FD_SHM      5
 
 #define PIPE_BUF_SIZE 512
 
@@ -31,8 +43,10 @@ struct pipe{
     int read_pos;
     int write_pos;
     int count;
-    int read_open;
-    int write_open;
+    struct wait_queue readers;  // blocked until data or no writers
+    struct wait_queue writers;  // blocked until space or no readers
+    int read_open;          // descriptors open on the read end
+    int write_open;         // and on the write end; freed when both are 0
 };
 
 struct fd_entry {
@@ -41,36 +55,65 @@ struct fd_entry {
     uint32_t offset;
     int flags;
     struct pipe *pipe;
+    struct shm *shm;        // FD_SHM: holds one reference
+};
+
+// Per-process state that scheduling never touches, kept out of struct
+// task so walks over tasks stay within one or two cache lines each.
+struct task_files {
+    struct fd_entry fd_table[MAX_FDS];
+    char cwd[VFS_MAX_PATH];
+};
+
+struct task_sighand {
+    uint64_t handlers[32];
 };
 
 struct task {
+    // Scheduler-hot: read on every tick or wakeup
     uint64_t id;
-    uint64_t cr3;
+    int state;
+    int is_idle;
+    struct task *next;          // run queue ring (runnable tasks only)
+    int on_runq;
+    int cpu;                    // run queue the task is on, or last ran on
+    int lock_depth;             // kernel lock nesting while switched out
     uint64_t rsp;
-    uint64_t kernel_stack_base;
+    uint64_t cr3;
+    uint16_t pcid;              // TLB tag for cr3 (paging_pcid_alloc)
     uint64_t kernel_stack_top;
-    uint64_t user_stack_top;
-    uint64_t entry;
-    int is_user;
-    int is_idle;
-    int state;
-    struct task *next;
+    uint64_t pending_signals;
+    uint64_t blocked_signals;
+    struct wait_queue *wait_q;  // queue the task is blocked on, or 0
+    struct task *wait_next;
+    struct ktimer *sleep_timer; // pending sched_sleep_until timer (on our stack)
+    int pgid;                   // Process group ID (for job control)
+    struct task *hash_next;     // PID hash chain (sched_get_task)
 
     // Process relationships
-    int parent_id;          // Parent task ID (0 = no parent)
-    int exit_code;          // Saved exit code (valid when ZOMBIE)
-    int waiting_for;        // PID we're blocking on (-1 = none)
-    int pgid;               // Process group ID (for job control)
+    struct task *parent;        // 0 = none, or parent already reaped
+    struct task *children;      // first child
+    struct task *sibling_next;  // parent's children list
+    struct task *sibling_prev;
+    struct wait_queue child_exit;   // waitpid sleeps here
+    struct task *list_next;     // list of all tasks (sched_signal_pgid)
+    struct task *list_prev;
+    int exit_code;              // Saved exit code (valid when ZOMBIE)
 
-    // Per-process state
-    struct fd_entry fd_table[MAX_FDS];
-    char cwd[VFS_MAX_PATH];
+    uint64_t kernel_stack_base;
+    uint64_t user_stack_top;
+    uint64_t entry;
+    struct vma *vmas;           // user address ranges, faulted in lazily
+    uint64_t brk;               // program break, heap is [USER_HEAP_BASE, brk)
+    int is_user;
 
-    // signals
-    uint64_t pending_signals;
-    uint64_t blocked_signals;
-    uint64_t signal_handlers[32];
+    // Per-process state, allocated with the task
+    struct task_files *files;
+    struct task_sighand *sighand;
 
+    // FPU/SSE/AVX registers (fpu.c), allocated on first use
+    void *fpu_state;
+    int fpu_cpu;                // CPU that last loaded them
 };
 
 
@@ -78,8 +121,26 @@ struct task {
 // Initialize scheduler structures
 void sched_init(void);
 
-// Called from timer IRQ
-struct irq_frame *sched_tick(struct irq_frame *frame);
+// Preempt the current task for the next runnable one. Called from the timer
+// IRQ and from IRQs whose handler woke a task, after the EOI.
+void sched_tick(void);
+
+// Whether a wakeup asked for a switch to the woken task.
+int sched_need_resched(void);
+
+// Make a CPU reschedule at its next interrupt exit (sending it an IPI if
+// it is another CPU). Interrupts off.
+void sched_resched_cpu(int cpu);
+
+// Application processor bring-up (smp.c): create the idle task of a CPU
+// and return the top of its kernel stack, for the CPU to start on (0 if
+// out of memory); then, on that CPU with the kernel lock held, make the
+// idle task its current task.
+uint64_t sched_prepare_cpu(int cpu);
+void sched_enter_cpu(void);
+
+// Switch now if a wakeup asked for it (e.g. on the way out of a syscall).
+void sched_preempt(void);
 
 // Enable scheduling (preemption)
 void sched_start(void);
@@ -87,15 +148,37 @@ void sched_start(void);
 // Create a runnable kernel task
 struct task *sched_create_kernel(void (*entry)(void));
 
+// Create the idle task: run only when nothing else is runnable, and
+// never time-sliced.
+struct task *sched_create_idle(void (*entry)(void));
+
 // Create a runnable user task from an ELF file node (minimal stub for now)
 struct task *sched_create_user(struct vfs_node *node, char **args);
 
 // Bootstrap current kernel context as a task
 void sched_bootstrap_current(void);
 
-// Yield current task (syscall or cooperative)
+// Let another runnable task run; halts until the next interrupt if there
+// is none.
 void sched_yield(void);
 
+// Block the current task on q until woken. Call with interrupts off after
+// testing the wait condition, and test it again on return:
+//     uint64_t flags = irq_save();
+//     while (!cond) sched_sleep_on(&q);
+//     irq_restore(flags);
+// A signal may wake the task early.
+void sched_sleep_on(struct wait_queue *q);
+
+// Make the first / every task on q runnable and switch to it at the next
+// opportunity. Safe from IRQ handlers.
+void sched_wake_one(struct wait_queue *q);
+void sched_wake_all(struct wait_queue *q);
+
+// Sleep until timer_now_ns() reaches deadline_ns. Returns 0, or -1 if a
+// signal cut the sleep short.
+int sched_sleep_until(uint64_t deadline_ns);
+
 // Exit current task with code
 void sched_exit(int code);
 
@@ -108,28 +191,40 @@ struct task *sched_current(void);
 int sched_spawn(const char *path, char **args, struct fd_entry *fd_overrides);
 
 // Block current task until child with given PID exits.
-// Returns the child's exit code, or -1 on error.
+// Returns the child's exit code, or -1 if pid is not a child of the caller.
 int sched_waitpid(int pid);
 
 // Fork the current user task. Returns child PID to caller (parent).
 // The child will be set up to return 0 from the syscall.
 int sched_fork(void);
 
-// Look up a task by its ID. Returns NULL if not found.
+// Look up a task by its ID through the PID hash. Returns NULL if not found.
 struct task *sched_get_task(int pid);
 
-// Wake all tasks waiting for a specific PID
-void sched_wake_waiters(int pid);
+// Post a signal to a task, waking it if it is blocked
+void sched_signal(struct task *t, int sig);
 
 // Send a signal to all tasks in a process group
 void sched_signal_pgid(int pgid, int sig);
 
+// Terminate t with code: it leaves the run and wait queues and becomes a
+// zombie for its parent to reap. For the current task use sched_exit().
+void sched_kill(struct task *t, int code);
+
 // Per-process FD table helpers
 void task_fd_init(struct task *t);
 int task_fd_alloc(struct task *t);
+// Release what an fd holds (pipe end, shm or node reference) and clear it.
 void task_fd_free(struct task *t, int fd);
+// Take the references of an fd entry just copied into another slot.
+void task_fd_ref(struct fd_entry *e);
 struct fd_entry *task_fd_get(struct task *t, int fd);
 
 struct pipe *pipe_alloc(void);
 
+// Blocking pipe I/O. Read returns 0 at end of file (no writers left);
+// write returns -1 if there are no readers.
+int pipe_read(struct pipe *p, char *buf, int count);
+int pipe_write(struct pipe *p, const char *buf, int count);
+
 #endif
@@ -0,0 +1,73 @@
+#include "shm.h"
+#include "paging.h"
+#include "pmm.h"
+#include "kmalloc.h"
+
+static struct kmem_cache *shm_cache = 0;
+
+void shm_init(void) {
+    shm_cache = kmem_cache_create("shm", sizeof(struct shm), 0);
+}
+
+// Drop the object's hold on its first count frames and free it.
+static void release_frames(struct shm *s, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) pmm_free_page((void *)s->frames[i]);
+    pmm_free_pages((void *)virt_to_phys(s->frames), s->frames_order);
+    kmem_cache_free(shm_cache, s);
+}
+
+struct shm *shm_create(uint64_t size) {
+    if (!size || size > SHM_MAX_SIZE || !shm_cache) return 0;
+
+    uint64_t npages = (size + 0xFFFULL) >> 12;
+    unsigned order = 0;
+    while (PMM_BLOCK_SIZE(order) < npages * sizeof(uint64_t)) order++;
+    if (order > PMM_MAX_ORDER) return 0;
+    struct shm *s = kmem_cache_alloc(shm_cache);
+    if (!s) return 0;
+    void *array = pmm_alloc_pages(order);
+    if (!array) {
+        kmem_cache_free(shm_cache, s);
+        return 0;
+    }
+    s->frames = phys_to_virt((uint64_t)array);
+    s->frames_order = order;
+
+    for (uint64_t i = 0; i < npages; i++) {
+        void *frame = pmm_alloc_zeroed_page();
+        if (!frame) {
+            release_frames(s, i);
+            return 0;
+        }
+        pmm_set_owner(frame, PMM_OWNER_USER_ANON);
+        s->frames[i] = (uint64_t)frame;
+    }
+    s->npages = npages;
+    s->refs = 1;
+    return s;
+}
+
+void shm_get(struct shm *s) {
+    s->refs++;
+}
+
+void shm_put(struct shm *s) {
+    if (--s->refs == 0) release_frames(s, s->npages);
+}
+
+int shm_map(struct shm *s, uint64_t *pml4, uint64_t vaddr, uint64_t npages, uint64_t flags) {
+    if (npages > s->npages) return -1;
+    // Each mapped page owns a frame reference, dropped by the usual
+    // PAGE_USERALLOC teardown in unmap, exit and exec.
+    for (uint64_t i = 0; i < npages; i++) pmm_page_ref((void *)s->frames[i]);
+    flags |= PAGE_USERALLOC | PAGE_SHARED;
+    if (paging_map_range(pml4, vaddr, s->frames, 0, npages, flags) == 0) return 0;
+
+    // Pages past the failure never got mapped: drop their references by
+    // hand, then let unmap release the rest.
+    for (uint64_t i = 0; i < npages; i++) {
+        if (!paging_virt_to_phys(pml4, vaddr + (i << 12))) pmm_free_page((void *)s->frames[i]);
+    }
+    paging_unmap_range(pml4, vaddr, npages);
+    return -1;
+}
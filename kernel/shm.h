@@ -0,0 +1,38 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+
+// Shared-memory objects: a set of zero-filled frames that several address
+// spaces map at once, so processes exchange large buffers without copies.
+// An object is reached through FD_SHM descriptors and mapped with
+// mmap(MAP_SHARED, fd). Each descriptor holds a reference to the object and
+// each mapped page a reference to its frame, so unmapping and closing can
+// happen in either order.
+
+#define SHM_MAX_SIZE  (256ULL * 1024 * 1024)
+
+struct shm {
+    uint32_t refs;          // descriptors referring to the object
+    uint32_t frames_order;  // pmm order of the frames array
+    uint64_t npages;
+    uint64_t *frames;       // npages physical frames, through the direct map
+};
+
+// Create the object cache. Call once after pmm_init.
+void shm_init(void);
+
+// Allocate an object of size bytes (rounded up to pages) with one
+// reference. Returns 0 if size is out of range or memory is short.
+struct shm *shm_create(uint64_t size);
+
+// Take or drop a descriptor reference. The last drop frees the object and
+// its hold on its frames; pages still mapped somewhere stay until unmapped.
+void shm_get(struct shm *s);
+void shm_put(struct shm *s);
+
+// Map npages pages of the object into pml4 at vaddr with the given leaf
+// flags. Returns 0, or -1 with nothing left mapped.
+int shm_map(struct shm *s, uint64_t *pml4, uint64_t vaddr, uint64_t npages, uint64_t flags);
+
+#endif
@@ -0,0 +1,309 @@
+#include "smp.h"
+#include "lapic.h"
+#include "gdt.h"
+#include "idt.h"
+#include "paging.h"
+#include "klib.h"
+#include "sched.h"
+#include "syscall.h"
+#include "timer.h"
+#include "console.h"
+#include "fpu.h"
+#include "x86.h"
+
+#define MSR_GS_BASE         0xC0000101
+#define MSR_KERNEL_GS_BASE  0xC0000102
+#define TRAMPOLINE_BASE     0x7000     // must match trampoline.asm
+
+static struct cpu cpus[MAX_CPUS];
+static volatile int ncpus = 1;
+
+// trampoline.asm: real-mode startup code, copied to TRAMPOLINE_BASE
+extern char ap_trampoline[];
+extern char ap_trampoline_end[];
+extern char ap_boot[];
+
+// Parameters at ap_boot, read by each AP on its way to long mode
+struct ap_boot_params {
+    uint64_t cr3;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t arg;
+};
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    uint32_t low = value & 0xFFFFFFFF;
+    uint32_t high = value >> 32;
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"(low), "d"(high) : "memory");
+}
+
+// ---------------------------------------------------------------------------
+// Kernel lock
+// ---------------------------------------------------------------------------
+
+static volatile int lock_owner = -1;   // CPU holding the lock, or -1
+static int lock_depth = 0;             // nesting on that CPU
+
+void kernel_lock(void) {
+    for (;;) {
+        // The CPU is read with interrupts off: an IRQ taken while spinning
+        // may switch this task away and resume it elsewhere.
+        uint64_t flags = irq_save();
+        int me = cpu_id();
+        if (lock_owner == me) {
+            lock_depth++;
+            irq_restore(flags);
+            return;
+        }
+        if (__sync_bool_compare_and_swap(&lock_owner, -1, me)) {
+            lock_depth = 1;
+            irq_restore(flags);
+            return;
+        }
+        irq_restore(flags);
+        while (lock_owner != -1) __asm__ volatile ("pause");
+    }
+}
+
+void kernel_unlock(void) {
+    uint64_t flags = irq_save();
+    if (--lock_depth == 0) __atomic_store_n(&lock_owner, -1, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+int kernel_lock_drop(void) {
+    if (lock_owner != cpu_id()) return 0;
+    int depth = lock_depth;
+    lock_depth = 0;
+    __atomic_store_n(&lock_owner, -1, __ATOMIC_RELEASE);
+    return depth;
+}
+
+void kernel_lock_retake(int depth) {
+    if (!depth) return;
+    kernel_lock();
+    lock_depth = depth;
+}
+
+int kernel_lock_handoff(int depth) {
+    int old = lock_depth;
+    lock_depth = depth;
+    return old;
+}
+
+// ---------------------------------------------------------------------------
+// ACPI: find the CPUs in the MADT
+// ---------------------------------------------------------------------------
+
+struct acpi_rsdp {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;           // 2+: xsdt and length are valid
+    uint32_t rsdt;
+    uint32_t length;
+    uint64_t xsdt;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_header header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+    // variable-length entries follow: type, length, body
+} __attribute__((packed));
+
+#define MADT_LAPIC          0
+#define MADT_X2APIC         9
+#define MADT_CPU_ENABLED    0x1   // (online-capable ones are hotplug slots)
+
+// A table through the direct map. The direct map only covers 2 MiB
+// stretches that hold RAM; firmware keeps its tables next to RAM, but
+// check rather than fault.
+static void *acpi_map(uint64_t phys, uint64_t len) {
+    for (uint64_t p = phys & ~0xFFFULL; p < phys + len; p += 0x1000) {
+        if (!paging_virt_to_phys(paging_kernel_pml4(), (uint64_t)phys_to_virt(p))) return 0;
+    }
+    return phys_to_virt(phys);
+}
+
+static int acpi_checksum_ok(const void *p, uint32_t len) {
+    const uint8_t *b = (const uint8_t *)p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += b[i];
+    return sum == 0;
+}
+
+static struct acpi_rsdp *rsdp_scan(uint64_t start, uint64_t len) {
+    uint8_t *base = acpi_map(start, len);
+    if (!base) return 0;
+    for (uint64_t off = 0; off + sizeof(struct acpi_rsdp) <= len; off += 16) {
+        struct acpi_rsdp *r = (struct acpi_rsdp *)(base + off);
+        if (memcmp(r->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(r, 20)) return r;
+    }
+    return 0;
+}
+
+// The RSDP sits in the first KiB of the EBDA or in the BIOS ROM area.
+static struct acpi_rsdp *rsdp_find(void) {
+    uint16_t *ebda_seg = acpi_map(0x40E, 2);
+    struct acpi_rsdp *r = 0;
+    if (ebda_seg && *ebda_seg) r = rsdp_scan((uint64_t)*ebda_seg << 4, 1024);
+    if (!r) r = rsdp_scan(0xE0000, 0x20000);
+    return r;
+}
+
+static struct acpi_header *acpi_table(uint64_t phys) {
+    struct acpi_header *h = acpi_map(phys, sizeof(*h));
+    if (!h || !acpi_map(phys, h->length) || !acpi_checksum_ok(h, h->length)) return 0;
+    return h;
+}
+
+static struct acpi_madt *madt_find(void) {
+    struct acpi_rsdp *rsdp = rsdp_find();
+    if (!rsdp) return 0;
+
+    int use_xsdt = rsdp->revision >= 2 && rsdp->xsdt;
+    struct acpi_header *root = acpi_table(use_xsdt ? rsdp->xsdt : rsdp->rsdt);
+    if (!root) return 0;
+
+    int size = use_xsdt ? 8 : 4;
+    int n = (root->length - sizeof(*root)) / size;
+    uint8_t *entries = (uint8_t *)(root + 1);
+    for (int i = 0; i < n; i++) {
+        uint64_t phys = 0;
+        memcpy(&phys, entries + i * size, size);   // entries are unaligned
+        struct acpi_header *h = acpi_table(phys);
+        if (h && memcmp(h->signature, "APIC", 4) == 0) return (struct acpi_madt *)h;
+    }
+    return 0;
+}
+
+// APIC IDs of the usable CPUs, in MADT order. Returns how many (at most max).
+static int madt_cpus(uint32_t *ids, int max) {
+    struct acpi_madt *madt = madt_find();
+    if (!madt) return 0;
+
+    int n = 0;
+    uint8_t *p = (uint8_t *)(madt + 1);
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end && n < max) {
+        uint32_t id = 0, flags = 0;
+        if (p[0] == MADT_LAPIC && p[1] >= 8) {
+            id = p[3];
+            memcpy(&flags, p + 4, 4);
+        } else if (p[0] == MADT_X2APIC && p[1] >= 16) {
+            memcpy(&id, p + 4, 4);
+            memcpy(&flags, p + 8, 4);
+            if (id > 0xFE) flags = 0;   // needs x2APIC mode to address
+        }
+        if (flags & MADT_CPU_ENABLED) ids[n++] = id;
+        p += p[1];
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Bring-up
+// ---------------------------------------------------------------------------
+
+// GS_BASE is the kernel's from here on; the first swapgs on the way to
+// user mode parks it in KERNEL_GS_BASE and gives user code a zero base.
+static void cpu_set_area(struct cpu *c) {
+    c->self = c;
+    wrmsr(MSR_GS_BASE, (uint64_t)c);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void smp_init_boot_cpu(void) {
+    cpus[0].id = 0;
+    cpus[0].online = 1;
+    cpu_set_area(&cpus[0]);
+}
+
+// Long-mode entry of an AP, on the stack of its idle task. Interrupts off.
+static void ap_main(struct cpu *c) {
+    gdt_init_cpu(c->id);
+    cpu_set_area(c);
+    idt_load();
+    paging_init_ap();
+    syscall_init();
+    fpu_init_ap();
+    lapic_init_ap();
+    c->online = 1;
+
+    kernel_lock();
+    sched_enter_cpu();
+    kernel_unlock();
+    for (;;) cpu_idle();
+}
+
+// INIT, then up to two STARTUPs, as the MP specification prescribes.
+static int start_ap(struct cpu *c) {
+    lapic_send_init(c->apic_id);
+    timer_delay_us(10000);
+    for (int sipi = 0; sipi < 2; sipi++) {
+        lapic_send_startup(c->apic_id, TRAMPOLINE_BASE);
+        for (int us = 0; us < (sipi ? 100000 : 1000); us += 10) {
+            if (c->online) return 0;
+            timer_delay_us(10);
+        }
+    }
+    return -1;
+}
+
+void smp_init(void) {
+    if (!lapic_enabled()) return;
+    cpus[0].apic_id = lapic_id();
+
+    uint32_t ids[MAX_CPUS];
+    int n = madt_cpus(ids, MAX_CPUS);
+    if (n <= 1) return;
+
+    uint64_t size = (uint64_t)(ap_trampoline_end - ap_trampoline);
+    memcpy(phys_to_virt(TRAMPOLINE_BASE), ap_trampoline, size);
+    struct ap_boot_params *boot = (struct ap_boot_params *)
+        phys_to_virt(TRAMPOLINE_BASE + (uint64_t)(ap_boot - ap_trampoline));
+    boot->cr3 = (uint64_t)paging_kernel_pml4();
+    boot->entry = (uint64_t)ap_main;
+
+    for (int i = 0; i < n && ncpus < MAX_CPUS; i++) {
+        if (ids[i] == cpus[0].apic_id) continue;
+        struct cpu *c = &cpus[ncpus];
+        c->id = ncpus;
+        c->apic_id = ids[i];
+        c->online = 0;
+
+        uint64_t stack = sched_prepare_cpu(c->id);
+        if (!stack) break;
+        boot->stack = stack;
+        boot->arg = (uint64_t)c;
+        if (start_ap(c) < 0) {
+            // Its id stays taken by the idle task prepared for it
+            console_write("smp: CPU did not start\n", 23);
+            break;
+        }
+        ncpus++;
+    }
+}
+
+int smp_cpu_count(void) {
+    return ncpus;
+}
+
+void smp_send_ipi(int cpu) {
+    lapic_send_ipi(cpus[cpu].apic_id, LAPIC_IPI_VECTOR);
+}
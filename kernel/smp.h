@@ -0,0 +1,80 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+// Multiprocessor support: the per-CPU area, application processor
+// bring-up and the kernel lock.
+//
+// Kernel code runs under one lock (the "big kernel lock"): it is taken on
+// every entry from user mode or from an interrupt and released on the way
+// back out, so user code runs on all CPUs in parallel while kernel code
+// keeps the single-CPU assumptions it was written with (irq_save()
+// sections, the scheduler's queues). A CPU drops it only to halt.
+
+#define MAX_CPUS 16
+
+struct task;
+
+// Per-CPU area. GS_BASE points at it while in the kernel; user mode has
+// its own GS_BASE, exchanged by swapgs on every entry from and return to
+// ring 3. syscall_entry.asm uses the fields up to user_rsp at fixed offsets.
+struct cpu {
+    struct cpu *self;           // 0x00: this_cpu() reads it through GS
+    struct task *task;          // 0x08: task running on the CPU
+    uint64_t kernel_rsp;        // 0x10: its kernel stack top
+    uint64_t user_rsp;          // 0x18: scratch for syscall_entry
+    int id;                     // index in 0..smp_cpu_count()-1, 0 = boot CPU
+    uint32_t apic_id;
+    volatile int online;        // set by the CPU itself once it is up
+};
+
+static inline struct cpu *this_cpu(void) {
+    struct cpu *c;
+    // volatile: a task may resume on another CPU after any switch
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(c));
+    return c;
+}
+
+// The running task, in one GS-relative load: unlike going through
+// this_cpu(), it cannot mix up two CPUs if the task moves in between.
+static inline struct task *this_cpu_task(void) {
+    struct task *t;
+    __asm__ volatile ("mov %%gs:8, %0" : "=r"(t));
+    return t;
+}
+
+static inline int cpu_id(void) {
+    return this_cpu()->id;
+}
+
+// Point GS_BASE at the boot CPU's area. First thing in kernel_main.
+void smp_init_boot_cpu(void);
+
+// Start the other CPUs listed in the ACPI MADT. Call with the kernel lock
+// held, after timer_init and sched_init; each CPU waits for the lock, then
+// idles until it is given work.
+void smp_init(void);
+
+// CPUs running, the boot CPU included.
+int smp_cpu_count(void);
+
+// Interrupt another CPU (LAPIC_IPI_VECTOR) so it reschedules or rearms
+// its timer.
+void smp_send_ipi(int cpu);
+
+// Big kernel lock. Nests on the CPU holding it.
+void kernel_lock(void);
+void kernel_unlock(void);
+
+// Release the lock whatever the nesting, to halt; retake it at the same
+// depth. Interrupts off. Dropping a lock this CPU does not hold returns 0,
+// and retaking depth 0 does nothing.
+int kernel_lock_drop(void);
+void kernel_lock_retake(int depth);
+
+// Context switch: the lock stays with the CPU, its nesting goes with the
+// task. Sets the depth of the task switched to and returns the old one.
+int kernel_lock_handoff(int depth);
+
+#endif
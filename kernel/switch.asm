@@ -3,7 +3,10 @@
 global ctx_switch
 global user_mode_enter
 
-; void ctx_switch(uint64_t *old_rsp, uint64_t new_rsp, uint64_t new_cr3)
+; void ctx_switch(uint64_t *old_rsp, uint64_t new_rsp)
+; Saves the callee-saved registers on the current stack, stores rsp in
+; *old_rsp and resumes the context saved at new_rsp. The caller switches
+; address space first (kernel stacks are mapped in every one).
 ctx_switch:
     push rbp
     push rbx
@@ -13,7 +16,6 @@ ctx_switch:
     push r15
     mov [rdi], rsp        ; save old rsp
     mov rsp, rsi          ; load new rsp
-    mov cr3, rdx          ; switch address space
     pop r15
     pop r14
     pop r13
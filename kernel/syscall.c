@@ -5,6 +5,11 @@
 #include "sched.h"
 #include "paging.h"
 #include "pmm.h"
+#include "klib.h"
+#include "pagecache.h"
+#include "kmalloc.h"
+#include "timer.h"
+#include "smp.h"
 #include "isr.h"
 #include "tty.h"
 #include "console.h"
@@ -42,30 +47,15 @@ static inline uint64_t rdmsr(uint32_t msr) {
 // String helpers
 // ============================================================================
 
-static int str_len(const char *s) {
-    int len = 0;
-    while (s[len]) len++;
-    return len;
-}
-
-static void str_copy(char *dst, const char *src, int max) {
-    int i = 0;
-    while (src[i] && i < max - 1) {
-        dst[i] = src[i];
-        i++;
-    }
-    dst[i] = '\0';
-}
-
 static void build_path(const char *path, char *out) {
     struct task *t = sched_current();
     if (path[0] == '/') {
-        str_copy(out, path, VFS_MAX_PATH);
+        strlcpy(out, path, VFS_MAX_PATH);
     } else {
-        int cwd_len = str_len(t->cwd);
-        str_copy(out, t->cwd, VFS_MAX_PATH);
+        int cwd_len = strlen(t->files->cwd);
+        strlcpy(out, t->files->cwd, VFS_MAX_PATH);
 
-        if (cwd_len > 0 && t->cwd[cwd_len-1] != '/') {
+        if (cwd_len > 0 && t->files->cwd[cwd_len-1] != '/') {
             out[cwd_len] = '/';
             out[cwd_len + 1] = '\0';
             cwd_len++;
@@ -97,20 +87,29 @@ void syscall_init(void) {
     wrmsr(MSR_STAR, star);
 
     wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
-    wrmsr(MSR_FMASK, 0x200);
+    // Enter with IF and DF clear: the kernel's string copies run forwards
+    wrmsr(MSR_FMASK, 0x600);
+}
+
+// Touch every page of a user buffer before the filesystem works on it.
+// A file-mapped page faulting in halfway through fat32 would re-enter it
+// and clobber its shared cluster buffer; a read touch maps such pages up
+// front (copy-on-write ones stay read-only until the copy really happens).
+static void prefault_user(const char *buf, int count) {
+    if (count <= 0) return;
+    uint64_t p = (uint64_t)buf & ~0xFFFULL;
+    uint64_t end = (uint64_t)buf + count;
+    for (; p < end; p += 0x1000) {
+        (void)*(volatile const char *)(p < (uint64_t)buf ? (uint64_t)buf : p);
+    }
 }
 
 // ============================================================================
 // Syscall handler
 // ============================================================================
 
-// User context saved by syscall_entry.asm — used by fork() in sched.c
-extern uint64_t user_ctx_rsp;
-extern uint64_t user_ctx_rip;
-extern uint64_t user_ctx_rflags;
-
-uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
-                         uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+static uint64_t syscall_dispatch(uint64_t num, uint64_t arg1, uint64_t arg2,
+                                 uint64_t arg3, uint64_t arg4, uint64_t arg5) {
     switch (num) {
 
         case SYS_EXIT: {
@@ -130,27 +129,19 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             if (!entry) return -1;
 
             if (entry->type == FD_CONSOLE) {
-                return 0;  
+                return keyboard_read(buf, count);
             }
 
             if (entry->type == FD_FILE && entry->node) {
-                int bytes = vfs_read(entry->node, entry->offset, count, (uint8_t *)buf);
+                prefault_user(buf, count);
+                int bytes = pcache_read(entry->node, entry->offset, count, (uint8_t *)buf);
                 if (bytes > 0) {
                     entry->offset += bytes;
                 }
                 return bytes;
             }
             if (entry->type == FD_PIPE){
-                struct pipe *p = entry->pipe;
-                if (p->count == 0) return 0;
-                int to_read = p->count;
-                if (to_read > count) to_read = count;
-                for (int i = 0; i < to_read; i++){
-                    buf[i] = p->buffer[p->read_pos];
-                    p->read_pos = (p->read_pos + 1) % PIPE_BUF_SIZE;
-                    p->count--;
-                }
-                return to_read;
+                return pipe_read(entry->pipe, buf, count);
             }
 
             return -1;
@@ -168,19 +159,10 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
                 return console_fd_write(buf, count);
             }
             if (entry->type == FD_PIPE){
-                struct pipe *p = entry->pipe;
-                if (p->count >= PIPE_BUF_SIZE) return 0;
-                int free_space = PIPE_BUF_SIZE - p->count;
-                int to_write = count;
-                if (to_write > free_space) to_write = free_space;
-                for (int i = 0; i < to_write; i++){
-                    p->buffer[p->write_pos] = buf[i];
-                    p->write_pos = (p->write_pos + 1) % PIPE_BUF_SIZE;
-                    p->count++;
-                }
-                return to_write;
+                return pipe_write(entry->pipe, buf, count);
             }
             if (entry->type == FD_FILE && entry->node) {
+                prefault_user(buf, count);
                 int bytes = vfs_write(entry->node, entry->offset, count, (const uint8_t *)buf);
                 if (bytes > 0) {
                     entry->offset += bytes;
@@ -211,20 +193,24 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             struct task *t = sched_current();
             int fd = task_fd_alloc(t);
 
-            if (fd < 0) return -1;
+            if (fd < 0) {
+                vfs_node_put(node);
+                return -1;
+            }
 
-            t->fd_table[fd].node = node;
-            t->fd_table[fd].offset = 0;
-            t->fd_table[fd].flags = flags;
+            // The descriptor keeps the lookup's reference
+            t->files->fd_table[fd].node = node;
+            t->files->fd_table[fd].offset = 0;
+            t->files->fd_table[fd].flags = flags;
 
             if (node->flags & VFS_DIRECTORY) {
-                t->fd_table[fd].type = FD_DIR;
+                t->files->fd_table[fd].type = FD_DIR;
             } else {
-                t->fd_table[fd].type = FD_FILE;
+                t->files->fd_table[fd].type = FD_FILE;
             }
 
-            if ((flags & O_APPEND) && (t->fd_table[fd].type == FD_FILE)) {
-                t->fd_table[fd].offset = node->size;
+            if ((flags & O_APPEND) && (t->files->fd_table[fd].type == FD_FILE)) {
+                t->files->fd_table[fd].offset = node->size;
             }
 
             return fd;
@@ -239,13 +225,6 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             if (entry->type == FD_FILE && entry->node) {
                 fat32_flush_size(entry->node);
             }
-            if (entry->type == FD_PIPE && entry->pipe) {
-                if (entry->flags == O_RDONLY) {
-                    entry->pipe->read_open = 0;
-                } else if (entry->flags == O_WRONLY) {
-                    entry->pipe->write_open = 0;
-                }
-            }
             task_fd_free(t, fd);
             return 0;
         }
@@ -264,6 +243,7 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             buf->st_ino = node->inode;
             buf->st_mode = (node->flags & VFS_DIRECTORY) ? S_IFDIR : S_IFREG;
 
+            vfs_node_put(node);
             return 0;
         }
 
@@ -289,7 +269,9 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             build_path(path, full_path);
 
             struct vfs_node *result = ensure_path_exists(full_path);
-            return result ? 0 : -1;
+            if (!result) return -1;
+            vfs_node_put(result);
+            return 0;
         }
 
         case SYS_RMDIR: {
@@ -322,10 +304,11 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             struct dirent *dent = vfs_readdir(entry->node, index);
             if (!dent) return -1;
 
-            str_copy(buf->name, dent->name, 256);
+            strlcpy(buf->name, dent->name, 256);
 
             struct vfs_node *child = vfs_finddir(entry->node, dent->name);
             buf->type = (child && (child->flags & VFS_DIRECTORY)) ? 1 : 0;
+            vfs_node_put(child);
 
             return 0;
         }
@@ -339,9 +322,11 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
 
             struct vfs_node *node = vfs_resolve_path(full_path);
             if (!node) return -1;
-            if (!(node->flags & VFS_DIRECTORY)) return -1;
+            int is_dir = (node->flags & VFS_DIRECTORY) != 0;
+            vfs_node_put(node);
+            if (!is_dir) return -1;
 
-            str_copy(t->cwd, full_path, VFS_MAX_PATH);
+            strlcpy(t->files->cwd, full_path, VFS_MAX_PATH);
             return 0;
         }
 
@@ -350,10 +335,10 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             char *buf = (char *)arg1;
             int size = (int)arg2;
 
-            int len = str_len(t->cwd);
+            int len = strlen(t->files->cwd);
             if (len >= size) return -1;
 
-            str_copy(buf, t->cwd, size);
+            strlcpy(buf, t->files->cwd, size);
             return len;
         }
 
@@ -377,7 +362,9 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             build_path(path, full_path);
             struct vfs_node *node = vfs_resolve_path(full_path);
             if (!node) return -1;
-            return (fat32_truncate(node, size) == 0) ? 0 : -1;
+            int res = fat32_truncate(node, size);
+            vfs_node_put(node);
+            return (res == 0) ? 0 : -1;
         }
 
         case SYS_CREATE: {
@@ -412,25 +399,27 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             int *fds = (int *)arg1;
 
             struct task *t = sched_current();
-            struct pipe *pipe = pipe_alloc();
-            if (!pipe) return -1;
             int read_fd = task_fd_alloc(t);
             if (read_fd < 0) return -1;
+            struct pipe *pipe = pipe_alloc();
+            if (!pipe) return -1;
+
+            // setup read_fd (claims the slot before the second alloc)
+            t->files->fd_table[read_fd].type = FD_PIPE;
+            t->files->fd_table[read_fd].pipe = pipe;
+            t->files->fd_table[read_fd].flags = O_RDONLY;
 
             int write_fd = task_fd_alloc(t);
             if (write_fd < 0){
-                task_fd_free(t, read_fd);
+                pipe->write_open = 0;
+                task_fd_free(t, read_fd);   // last end: frees the pipe
                 return -1;
             }
-            // setup read_fd 
-            t->fd_table[read_fd].type = FD_PIPE;
-            t->fd_table[read_fd].pipe = pipe;
-            t->fd_table[read_fd].flags = O_RDONLY;
 
             // setup write_fd
-            t->fd_table[write_fd].type = FD_PIPE;
-            t->fd_table[write_fd].pipe = pipe;
-            t->fd_table[write_fd].flags = O_WRONLY;
+            t->files->fd_table[write_fd].type = FD_PIPE;
+            t->files->fd_table[write_fd].pipe = pipe;
+            t->files->fd_table[write_fd].flags = O_WRONLY;
 
             fds[0] = read_fd;
             fds[1] = write_fd;
@@ -444,8 +433,10 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             struct fd_entry *old = task_fd_get(t, oldfd);
             if (!old) return -1;
             if (newfd < 0 || newfd >= MAX_FDS) return -1;
-            if (t->fd_table[newfd].type != FD_UNUSED) task_fd_free(t, newfd); 
-            t->fd_table[newfd] = t->fd_table[oldfd];
+            if (newfd == oldfd) return newfd;
+            if (t->files->fd_table[newfd].type != FD_UNUSED) task_fd_free(t, newfd); 
+            t->files->fd_table[newfd] = t->files->fd_table[oldfd];
+            task_fd_ref(&t->files->fd_table[newfd]);
             return newfd;
         }
 
@@ -475,14 +466,13 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             int sig = (int)arg2;
             struct task *task = sched_get_task(pid);
             if (!task) return -1;
-            if (sig < 0) return -1;
+            if (sig < 0 || sig > 31) return -1;
             if (sig == SIGKILL){
-                task->state = TASK_STATE_ZOMBIE;
-                task->exit_code = -1;
-                sched_wake_waiters(pid);
+                if (task == sched_current()) sched_exit(-1);
+                sched_kill(task, -1);
                 return 0;
             }
-            task->pending_signals |= (1ULL << sig);
+            sched_signal(task, sig);
             return 0;
         }
         case SYS_SIGNAL: {
@@ -492,8 +482,8 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             struct task *t = sched_current();
             if (sig < 1 || sig > 31) return -1;
 
-            uint64_t old = t->signal_handlers[sig];
-            t->signal_handlers[sig] = (uint64_t)handler;
+            uint64_t old = t->sighand->handlers[sig];
+            t->sighand->handlers[sig] = (uint64_t)handler;
 
             return old;
         }
@@ -588,8 +578,25 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
         }
 
         case SYS_TICKS: {
-            extern volatile uint64_t system_ticks;
-            return system_ticks;
+            return timer_ticks();
+        }
+
+        case SYS_CLOCK: {
+            return timer_now_ns();
+        }
+
+        case SYS_SLEEP:
+        case SYS_NANOSLEEP: {
+            // Saturate rather than wrap for absurd lengths
+            uint64_t ns = arg1;
+            if (num == SYS_SLEEP) ns = arg1 > ~0ULL / 1000000 ? ~0ULL : arg1 * 1000000;
+            uint64_t now = timer_now_ns();
+            uint64_t deadline = ns > ~0ULL - now ? ~0ULL : now + ns;
+            return sched_sleep_until(deadline);
+        }
+
+        case SYS_SLEEP_UNTIL: {
+            return sched_sleep_until(arg1);
         }
 
         case SYS_FB_MAP: {
@@ -603,23 +610,10 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             uint64_t size = w * h * bytes_pp;
             if (size == 0) return 0;
 
-            uint64_t pages = (size + 0xFFF) / 0x1000;
             uint64_t vaddr = 0x2000000ULL; // Fixed backbuffer base
 
-            for (uint64_t i = 0; i < pages; i++) {
-                void *page = pmm_alloc_page();
-                if (!page) return 0;
-                paging_map_user_page((uint64_t *)t->cr3,
-                                     vaddr + i * 0x1000,
-                                     (uint64_t)page,
-                                     PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
-            }
-
-            // Zero through the now-mapped virtual address (safe with any CR3)
-            uint64_t *vp = (uint64_t *)vaddr;
-            uint64_t qwords = size / 8;
-            for (uint64_t i = 0; i < qwords; i++) vp[i] = 0;
-
+            // Zero-filled pages are faulted in as the backbuffer is drawn.
+            if (!vma_add(&t->vmas, vaddr, vaddr + size, VMA_WRITE | VMA_LARGE)) return 0;
             return vaddr;
         }
 
@@ -648,9 +642,147 @@ uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
             return 0;
         }
 
+        case SYS_MEMINFO: {
+            struct user_meminfo *out = (struct user_meminfo *)arg1;
+            if (!out) return -1;
+
+            struct pmm_stats st;
+            pmm_get_stats(&st);
+            out->total_pages = st.total_pages;
+            out->free_pages = st.free_pages;
+            out->zero_pool_pages = st.zero_pool_pages;
+            out->zero_hits = st.zero_hits;
+            out->zero_misses = st.zero_misses;
+            for (int i = 0; i < MEMINFO_OWNER_COUNT; i++) {
+                out->owner_pages[i] = st.owner_pages[i];
+            }
+            struct pcache_stats cs;
+            pcache_get_stats(&cs);
+            out->cache_hits = cs.hits;
+            out->cache_misses = cs.misses;
+            struct kmem_stats ks;
+            kmem_get_stats(&ks);
+            out->heap_pages = ks.slab_pages + ks.large_pages;
+            out->heap_objects = ks.objects;
+            return 0;
+        }
+
+        case SYS_MMAP: {
+            struct task *t = sched_current();
+            uint64_t addr = arg1;
+            uint64_t len = arg2;
+            int prot = (int)arg3;
+            int flags = (int)arg4;
+            if (!t || !t->is_user || !len) return MAP_FAILED;
+
+            // MAP_SHARED takes a shared-memory fd; MAP_PRIVATE without
+            // MAP_ANONYMOUS maps a file from offset 0 through the page cache.
+            struct shm *shm = 0;
+            struct vfs_node *file = 0;
+            if (!(flags & MAP_ANONYMOUS)) {
+                struct fd_entry *e = task_fd_get(t, (int)arg5);
+                if (!e || (flags & MAP_HUGE_2MB)) return MAP_FAILED;
+                if ((flags & MAP_SHARED) && e->type == FD_SHM) {
+                    shm = e->shm;
+                    if (len > (shm->npages << 12)) return MAP_FAILED;
+                } else if ((flags & MAP_PRIVATE) && e->type == FD_FILE && e->node) {
+                    file = e->node;
+                } else {
+                    return MAP_FAILED;
+                }
+            }
+
+            uint64_t align = (flags & MAP_HUGE_2MB) ? 0x200000 : 0x1000;
+            len = (len + align - 1) & ~(align - 1);
+            if (!len) return MAP_FAILED;
+            uint32_t vflags = (prot & PROT_WRITE) ? VMA_WRITE : 0;
+            if (flags & MAP_HUGE_2MB) vflags |= VMA_LARGE;
+            if (shm) vflags |= VMA_SHARED;
+            if (file) vflags |= VMA_FILE;
+
+            if (flags & MAP_FIXED) {
+                if ((addr & (align - 1)) || !paging_user_range_ok(addr, addr + len)) return MAP_FAILED;
+                if (paging_unmap_range((uint64_t *)t->cr3, addr, len >> 12) < 0 ||
+                    vma_remove(&t->vmas, addr, addr + len) < 0) return MAP_FAILED;
+            } else {
+                addr = vma_find_gap(t->vmas, USER_MMAP_BASE, USER_MMAP_END, len, align);
+                if (!addr) return MAP_FAILED;
+            }
+
+            // Zero-filled pages (2 MiB ones for MAP_HUGE_2MB) and file pages
+            // are faulted in on use; a shared object's frames go in now.
+            struct vma *v = vma_add(&t->vmas, addr, addr + len, vflags);
+            if (!v) return MAP_FAILED;
+            v->file = file;
+            vfs_node_get(file);
+            if (shm) {
+                uint64_t pte_flags = PAGE_PRESENT | PAGE_USER;
+                if (prot & PROT_WRITE) pte_flags |= PAGE_WRITABLE;
+                if (shm_map(shm, (uint64_t *)t->cr3, addr, len >> 12, pte_flags) < 0) {
+                    vma_remove(&t->vmas, addr, addr + len);
+                    return MAP_FAILED;
+                }
+            }
+            return addr;
+        }
+
+        case SYS_MUNMAP: {
+            struct task *t = sched_current();
+            uint64_t addr = arg1;
+            uint64_t len = (arg2 + 0xFFFULL) & ~0xFFFULL;
+            if (!t || !t->is_user || (addr & 0xFFF) || !len) return -1;
+            if (!paging_user_range_ok(addr, addr + len)) return -1;
+
+            if (paging_unmap_range((uint64_t *)t->cr3, addr, len >> 12) < 0) return -1;
+            if (vma_remove(&t->vmas, addr, addr + len) < 0) return -1;
+            return 0;
+        }
+
+        case SYS_BRK: {
+            struct task *t = sched_current();
+            if (!t || !t->is_user) return 0;
+            uint64_t want = arg1;
+            if (want < USER_HEAP_BASE || want > USER_HEAP_BASE + USER_HEAP_MAX) return t->brk;
+
+            uint64_t old_top = (t->brk + 0xFFFULL) & ~0xFFFULL;
+            uint64_t new_top = (want + 0xFFFULL) & ~0xFFFULL;
+            if (new_top > old_top) {
+                if (vma_overlaps(t->vmas, old_top, new_top)) return t->brk;
+                if (!vma_add(&t->vmas, old_top, new_top, VMA_WRITE)) return t->brk;
+            } else if (new_top < old_top) {
+                if (paging_unmap_range((uint64_t *)t->cr3, new_top, (old_top - new_top) >> 12) < 0 ||
+                    vma_remove(&t->vmas, new_top, old_top) < 0) return t->brk;
+            }
+            t->brk = want;
+            return want;
+        }
+
+        case SYS_SHM_CREATE: {
+            struct task *t = sched_current();
+            if (!t) return -1;
+            int fd = task_fd_alloc(t);
+            if (fd < 0) return -1;
+            struct shm *shm = shm_create(arg1);
+            if (!shm) return -1;
+            t->files->fd_table[fd].type = FD_SHM;
+            t->files->fd_table[fd].shm = shm;
+            t->files->fd_table[fd].flags = O_RDWR;
+            return fd;
+        }
+
         default:
             return -1;
     }
     struct task *t = sched_current();
     if (t) sched_deliver_signals(t);
 }
+
+uint64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
+                         uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+    kernel_lock();
+    uint64_t ret = syscall_dispatch(num, arg1, arg2, arg3, arg4, arg5);
+    // A wakeup during the call (pipe write, exit) runs the woken task now
+    sched_preempt();
+    kernel_unlock();
+    return ret;
+}
@@ -49,6 +49,16 @@
 #define SYS_FB_MAP    33  // fb_map() -> vaddr of user backbuffer (or 0)
 #define SYS_FB_PRESENT 34 // fb_present(void *buf) -> 0
 #define SYS_FB_PRESENT_RECT 35 // fb_present_rect(void *buf, int x, int y, int w, int h) -> 0
+#define SYS_MEMINFO   36  // meminfo(struct user_meminfo *out) -> 0 or -1
+#define SYS_MMAP      37  // mmap(void *addr, uint64_t len, int prot, int flags, int fd) -> addr or MAP_FAILED
+                          // fd: MAP_SHARED shm object, or MAP_PRIVATE file mapped from offset 0
+#define SYS_MUNMAP    38  // munmap(void *addr, uint64_t len) -> 0 or -1
+#define SYS_BRK       39  // brk(void *addr) -> new break (current break on failure or addr 0)
+#define SYS_SHM_CREATE 40 // shm_create(uint64_t size) -> fd of a new shared-memory object or -1
+#define SYS_SLEEP     41  // sleep(uint64_t ms) -> 0, or -1 if a signal cut it short
+#define SYS_NANOSLEEP 42  // nanosleep(uint64_t ns) -> 0 or -1
+#define SYS_SLEEP_UNTIL 43 // sleep_until(uint64_t deadline) -> 0 or -1; deadline on the clock() timeline
+#define SYS_CLOCK     44  // clock() -> ns since boot (monotonic)
 
 // signal numbers
 #define SIGKILL     9
@@ -71,6 +81,19 @@
 #define SEEK_CUR    1
 #define SEEK_END    2
 
+// mmap protection and flags. Three kinds of mapping: anonymous memory
+// (MAP_ANONYMOUS), zero-filled on first touch; a shared-memory object
+// (MAP_SHARED); and a private file mapping (MAP_PRIVATE with a file fd).
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4   // accepted, not enforced
+#define MAP_SHARED    0x01  // map the FD_SHM object fd; writes are seen by every mapper
+#define MAP_PRIVATE   0x02  // with a file fd: page-cache pages, copied on first write
+#define MAP_FIXED     0x10  // map exactly at addr, replacing what is there
+#define MAP_ANONYMOUS 0x20  // no fd: zero-filled pages
+#define MAP_HUGE_2MB  0x40000  // 2 MiB-aligned, length rounded up to 2 MiB, large pages
+#define MAP_FAILED    ((uint64_t)-1)
+
 // Stat structure (simplified)
 struct stat {
     uint32_t st_size;      // File size in bytes
@@ -82,6 +105,31 @@ struct stat {
 #define S_IFREG     0x8000  // Regular file
 #define S_IFDIR     0x4000  // Directory
 
+// Owner types indexing meminfo owner_pages[]
+#define MEMINFO_OWNER_FREE      0
+#define MEMINFO_OWNER_KERNEL    1
+#define MEMINFO_OWNER_PAGETABLE 2
+#define MEMINFO_OWNER_USER_ANON 3
+#define MEMINFO_OWNER_KSTACK    4
+#define MEMINFO_OWNER_DMA       5
+#define MEMINFO_OWNER_CACHE     6
+#define MEMINFO_OWNER_ZEROPOOL  7
+#define MEMINFO_OWNER_COUNT     8
+
+// Physical memory statistics for meminfo
+struct user_meminfo {
+    uint64_t total_pages;      // 4 KiB pages managed by the kernel
+    uint64_t free_pages;       // pages currently free
+    uint64_t zero_pool_pages;  // pre-zeroed pages ready for allocation
+    uint64_t zero_hits;        // zeroed-page requests served from the pool
+    uint64_t zero_misses;      // zeroed-page requests that zeroed inline
+    uint64_t owner_pages[MEMINFO_OWNER_COUNT];  // pages per MEMINFO_OWNER_* type
+    uint64_t cache_hits;       // file pages found in the page cache
+    uint64_t cache_misses;     // file pages read in from disk
+    uint64_t heap_pages;       // pages held by the kernel heap (kmalloc)
+    uint64_t heap_objects;     // kernel heap objects allocated
+};
+
 // Dirent structure for readdir
 struct user_dirent {
     char name[256];        // File name
@@ -129,6 +177,15 @@ struct user_input_event {
 #define STDOUT_FD   1
 #define STDERR_FD   2
 
+// User context saved by syscall_entry.asm at the top of the task's kernel
+// stack for the duration of a syscall, lowest address first.
+struct syscall_frame {
+    uint64_t r15, r14, r13, r12, rbp, rbx;
+    uint64_t rflags;    // from R11
+    uint64_t rip;       // from RCX
+    uint64_t rsp;
+};
+
 // Initialize syscall mechanism (call once at boot)
 void syscall_init(void);
 
@@ -6,49 +6,34 @@ DEFAULT ABS
 ;   - RAX = syscall number
 ;   - RDI, RSI, RDX, R10, R8, R9 = arguments 1-6
 ;
-; IMPORTANT: All user context is saved on the per-task kernel stack,
-; NOT in globals.  This prevents race conditions when two user tasks
-; are both inside syscalls (one preempted, one active).
+; IMPORTANT: All user context is saved on the per-task kernel stack
+; (struct syscall_frame in syscall.h), where fork() reads it back. The
+; per-CPU area (struct cpu in smp.h) only lends a scratch slot for the user
+; RSP until the kernel stack is loaded; interrupts are off until then
+; (SYSCALL masks IF via FMASK).
 ;
-; The globals (user_ctx_*) are written ONLY while interrupts are disabled
-; (SYSCALL masks IF via FMASK) and are a snapshot for fork() to read
-; during the current syscall invocation.
+; SYSCALL leaves GS_BASE as user mode had it: swapgs brings in the
+; kernel's, and the return path swaps back just before SYSRET.
+
+; struct cpu offsets
+CPU_KERNEL_RSP  equ 0x10
+CPU_USER_RSP    equ 0x18
 
 section .text
 global syscall_entry
 extern syscall_handler
-extern current_kernel_rsp
-
-; Snapshot of user context for fork() — only valid during current syscall
-global user_ctx_rsp
-global user_ctx_rip
-global user_ctx_rflags
-global user_ctx_rbx
-global user_ctx_rbp
-global user_ctx_r12
-global user_ctx_r13
-global user_ctx_r14
-global user_ctx_r15
 
 syscall_entry:
-    ; Interrupts are DISABLED here (FMASK cleared IF).
-    ; Save user context snapshot to globals for fork().
-    mov [user_ctx_rsp], rsp
-    mov [user_ctx_rip], rcx
-    mov [user_ctx_rflags], r11
-    mov [user_ctx_rbx], rbx
-    mov [user_ctx_rbp], rbp
-    mov [user_ctx_r12], r12
-    mov [user_ctx_r13], r13
-    mov [user_ctx_r14], r14
-    mov [user_ctx_r15], r15
+    ; Interrupts are DISABLED here (FMASK cleared IF, and DF).
+    swapgs
+    mov [gs:CPU_USER_RSP], rsp
 
     ; Switch to per-task kernel stack
-    mov rsp, [current_kernel_rsp]
+    mov rsp, [gs:CPU_KERNEL_RSP]
 
-    ; Save user context on the PER-TASK kernel stack (safe across preemption).
-    ; This is what we restore from — NOT the globals.
-    push qword [user_ctx_rsp]   ; user RSP
+    ; Save user context on the PER-TASK kernel stack (safe across preemption
+    ; and migration to another CPU).
+    push qword [gs:CPU_USER_RSP]   ; user RSP
     push rcx                    ; user RIP (= return address)
     push r11                    ; user RFLAGS
     push rbx                    ; callee-saved registers
@@ -83,16 +68,6 @@ syscall_entry:
     pop rcx         ; user RIP for SYSRET
     pop rsp         ; user RSP — restores user stack directly
 
-    ; Return to user mode
+    ; Return to user mode, with user GS_BASE
+    swapgs
     o64 sysret
-
-section .data
-    user_ctx_rsp:    dq 0
-    user_ctx_rip:    dq 0
-    user_ctx_rflags: dq 0
-    user_ctx_rbx:    dq 0
-    user_ctx_rbp:    dq 0
-    user_ctx_r12:    dq 0
-    user_ctx_r13:    dq 0
-    user_ctx_r14:    dq 0
-    user_ctx_r15:    dq 0
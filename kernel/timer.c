@@ -0,0 +1,327 @@
+#include "timer.h"
+#include "lapic.h"
+#include "smp.h"
+#include "sched.h"
+#include "x86.h"
+
+#define PIT_FREQ   1193182
+#define CAL_MS     10
+#define TICK_NS    10000000ULL   // SYS_TICKS unit, the old PIT period
+#define SLICE_NS   10000000ULL   // time slice while the CPU is contended
+
+// Timer wheel: four levels of 64 slots. Level L holds timers due 64^L to
+// 64^(L+1) units ahead, in the slot picked by bits 6L..6L+5 of the due
+// unit; a higher-level slot is cascaded down when the clock reaches its
+// turn. Timers further out than the wheel reaches (about 28 minutes) sit
+// in the last slot and are re-placed when it cascades.
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+#define NEVER        (~0ULL)
+
+static int use_lapic = 0;          // APIC one-shot timer; else periodic PIT
+static uint64_t tsc_khz = 0;       // TSC ticks per millisecond
+static uint64_t tsc_base = 0;      // TSC at timer_init
+static uint64_t ns_mult = 0;       // ns = tsc * ns_mult >> 32
+static uint64_t tsc_mult = 0;      // tsc = ns * tsc_mult >> 32
+static uint64_t lapic_per_ms = 0;  // APIC timer counts per millisecond
+static volatile uint64_t pit_ticks = 0;
+
+static struct ktimer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_used[WHEEL_LEVELS];   // bit per non-empty slot
+static uint64_t wheel_clock = 0;            // next unit to process
+static int wheel_count = 0;                 // pending timers
+
+// The wheel belongs to the boot CPU: only its APIC timer is armed, and
+// timers added on other CPUs are run from its interrupt.
+#define WHEEL_CPU    0
+
+static struct ktimer slice_timer[MAX_CPUS];
+static uint64_t armed = 0;         // ns deadline the APIC timer is set for
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t val;
+    __asm__ volatile ("inb %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+// PIT channel 2 in one-shot mode, gated through port 0x61 (OUT readable
+// in bit 5): load count, then start it and wait for it to run out.
+static uint8_t pit_oneshot_load(uint16_t count) {
+    uint8_t port61 = inb(0x61);
+    outb(0x61, port61 & ~0x03);              // gate off, speaker off
+    outb(0x43, 0xB0);                        // channel 2, lo/hi, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, count >> 8);
+    return port61;
+}
+
+static void pit_oneshot_run(uint8_t port61) {
+    outb(0x61, (port61 & ~0x02) | 0x01);     // gate on: count down
+    while (!(inb(0x61) & 0x20)) { }
+    outb(0x61, port61);
+}
+
+// Count TSC and APIC timer ticks over CAL_MS, timed by the PIT.
+static void calibrate(void) {
+    uint8_t port61 = pit_oneshot_load(PIT_FREQ * CAL_MS / 1000);
+    if (use_lapic) lapic_timer_oneshot(0xFFFFFFFF);
+    uint64_t t0 = rdtsc();
+    pit_oneshot_run(port61);
+    uint64_t t1 = rdtsc();
+    uint32_t left = use_lapic ? lapic_timer_count() : 0xFFFFFFFF;
+    if (use_lapic) lapic_timer_stop();
+
+    tsc_khz = (t1 - t0) / CAL_MS;
+    lapic_per_ms = (0xFFFFFFFFu - left) / CAL_MS;
+}
+
+static inline uint64_t ns_to_tsc(uint64_t ns) {
+    return (uint64_t)(((unsigned __int128)ns * tsc_mult) >> 32);
+}
+
+// ---------------------------------------------------------------------------
+// Timer wheel
+// ---------------------------------------------------------------------------
+
+static void wheel_insert(struct ktimer *t) {
+    // Round up: a timer never runs before its deadline
+    uint64_t unit = t->expires / TIMER_UNIT_NS + (t->expires % TIMER_UNIT_NS != 0);
+    if (unit < wheel_clock) unit = wheel_clock;
+    uint64_t delta = unit - wheel_clock;
+    if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        unit = wheel_clock + delta;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1))) level++;
+    int slot = (unit >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    t->level = level;
+    t->slot = slot;
+    t->pending = 1;
+    t->prev = 0;
+    t->next = wheel[level][slot];
+    if (t->next) t->next->prev = t;
+    wheel[level][slot] = t;
+    wheel_used[level] |= 1ULL << slot;
+    wheel_count++;
+}
+
+static void wheel_remove(struct ktimer *t) {
+    if (t->prev) t->prev->next = t->next;
+    else wheel[t->level][t->slot] = t->next;
+    if (t->next) t->next->prev = t->prev;
+    if (!wheel[t->level][t->slot]) wheel_used[t->level] &= ~(1ULL << t->slot);
+    t->pending = 0;
+    wheel_count--;
+}
+
+// First unit at which the wheel has work (a level-0 slot to expire or a
+// higher slot to cascade), or NEVER.
+static uint64_t wheel_next_due(void) {
+    uint64_t best = NEVER;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t used = wheel_used[level];
+        if (!used) continue;
+        int shift = WHEEL_BITS * level;
+        uint64_t cur = wheel_clock >> shift;
+        int idx = cur & WHEEL_MASK;
+        uint64_t rot = idx ? (used >> idx) | (used << (WHEEL_SIZE - idx)) : used;
+        uint64_t due;
+        if (level == 0) {
+            due = wheel_clock + __builtin_ctzll(rot);
+        } else {
+            // The slot under the clock holds timers a full turn ahead
+            rot &= ~1ULL;
+            due = (cur + (rot ? (uint64_t)__builtin_ctzll(rot) : WHEEL_SIZE)) << shift;
+        }
+        if (due < best) best = due;
+    }
+    return best;
+}
+
+// Run every timer due at or before unit now. Interrupts off.
+static void wheel_run(uint64_t now) {
+    while (wheel_clock <= now) {
+        uint64_t due = wheel_count ? wheel_next_due() : NEVER;
+        if (due > now) {
+            wheel_clock = now + 1;   // nothing due in between: skip ahead
+            return;
+        }
+        wheel_clock = due;
+
+        // Cascade every level whose turn starts here, highest first, so
+        // timers land in the level that now covers them.
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 &&
+               !(wheel_clock & ((1ULL << (WHEEL_BITS * (top + 1))) - 1))) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            int slot = (wheel_clock >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            struct ktimer *t = wheel[level][slot];
+            while (t) {
+                struct ktimer *next = t->next;
+                wheel_remove(t);
+                wheel_insert(t);
+                t = next;
+            }
+        }
+
+        // Detach the due slot and move the clock past it first, so a
+        // callback re-adding its timer for now lands in the next unit.
+        int slot = wheel_clock & WHEEL_MASK;
+        struct ktimer *t = wheel[0][slot];
+        wheel[0][slot] = 0;
+        wheel_used[0] &= ~(1ULL << slot);
+        wheel_clock++;
+        while (t) {
+            struct ktimer *next = t->next;
+            t->pending = 0;
+            wheel_count--;
+            t->fn(t);
+            t = next;
+        }
+    }
+}
+
+// Program the APIC timer for the wheel's next due unit, or stop it. On
+// another CPU, have the wheel's CPU do it if the timer must fire sooner.
+static void rearm(void) {
+    if (!use_lapic) return;
+    uint64_t due = wheel_count ? wheel_next_due() : NEVER;
+    uint64_t next = due == NEVER ? 0 : due * TIMER_UNIT_NS;
+    if (due != NEVER && next == 0) next = 1;
+    if (next == armed) return;
+    if (cpu_id() != WHEEL_CPU) {
+        if (next && (!armed || next < armed)) smp_send_ipi(WHEEL_CPU);
+        return;
+    }
+    armed = next;
+
+    if (!next) {
+        lapic_timer_stop();
+    } else if (lapic_has_tsc_deadline()) {
+        lapic_timer_deadline(tsc_base + ns_to_tsc(next));
+    } else {
+        uint64_t now = timer_now_ns();
+        uint64_t count = next > now ? (next - now) * lapic_per_ms / 1000000 : 0;
+        if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+        lapic_timer_oneshot((uint32_t)count);
+    }
+}
+
+void ktimer_init(struct ktimer *t, void (*fn)(struct ktimer *t)) {
+    t->expires = 0;
+    t->fn = fn;
+    t->next = t->prev = 0;
+    t->level = t->slot = 0;
+    t->pending = 0;
+}
+
+void ktimer_add(struct ktimer *t, uint64_t expires_ns) {
+    uint64_t flags = irq_save();
+    if (t->pending) wheel_remove(t);
+    t->expires = expires_ns;
+    wheel_insert(t);
+    rearm();
+    irq_restore(flags);
+}
+
+int ktimer_cancel(struct ktimer *t) {
+    uint64_t flags = irq_save();
+    int was = t->pending;
+    if (was) {
+        wheel_remove(t);
+        rearm();
+    }
+    irq_restore(flags);
+    return was;
+}
+
+static void slice_timer_fn(struct ktimer *t) {
+    sched_resched_cpu((int)(t - slice_timer));
+}
+
+// ---------------------------------------------------------------------------
+// Clock and timer interrupt
+// ---------------------------------------------------------------------------
+
+void timer_init(void) {
+    use_lapic = lapic_init() == 0;
+    calibrate();
+    if (tsc_khz == 0 || (use_lapic && lapic_per_ms == 0)) {
+        use_lapic = 0;   // no usable clock to convert deadlines with
+    }
+    if (tsc_khz) {
+        ns_mult = (1000000ULL << 32) / tsc_khz;
+        tsc_mult = (tsc_khz << 32) / 1000000;
+    }
+    tsc_base = rdtsc();
+    for (int i = 0; i < MAX_CPUS; i++) ktimer_init(&slice_timer[i], slice_timer_fn);
+
+    if (use_lapic) {
+        outb(0x21, inb(0x21) | 0x01);   // mask PIT IRQ0 at the PIC
+        rearm();
+    }
+}
+
+uint64_t timer_now_ns(void) {
+    if (!tsc_khz) return pit_ticks * TICK_NS;
+    return (uint64_t)(((unsigned __int128)(rdtsc() - tsc_base) * ns_mult) >> 32);
+}
+
+uint64_t timer_ticks(void) {
+    if (!tsc_khz) return pit_ticks;
+    return timer_now_ns() / TICK_NS;
+}
+
+void timer_delay_us(uint64_t us) {
+    if (tsc_khz) {
+        uint64_t end = rdtsc() + us * tsc_khz / 1000;
+        while (rdtsc() < end) __asm__ volatile ("pause");
+        return;
+    }
+    // No TSC rate: the PIT's 16-bit count covers up to 54 ms at a time
+    while (us) {
+        uint64_t chunk = us < 50000 ? us : 50000;
+        pit_oneshot_run(pit_oneshot_load(PIT_FREQ * chunk / 1000000 + 1));
+        us -= chunk;
+    }
+}
+
+void timer_set_slice(int contended) {
+    struct ktimer *t = &slice_timer[cpu_id()];
+    if (contended == t->pending) return;
+    if (contended) ktimer_add(t, timer_now_ns() + SLICE_NS);
+    else ktimer_cancel(t);
+}
+
+void timer_interrupt(void) {
+    if (!use_lapic) pit_ticks++;
+    armed = 0;   // one-shot: whatever was set has fired
+
+    // An expired slice asks its CPU to reschedule; the scheduler starts
+    // the next slice when it picks a task.
+    wheel_run(timer_now_ns() / TIMER_UNIT_NS);
+    rearm();
+}
+
+void timer_rearm(void) {
+    uint64_t flags = irq_save();
+    if (cpu_id() == WHEEL_CPU) rearm();
+    irq_restore(flags);
+}
+
+void cpu_idle(void) {
+    // sti takes effect after hlt starts, so a wakeup cannot be lost
+    __asm__ volatile ("sti; hlt" : : : "memory");
+}
@@ -0,0 +1,68 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Time keeping, kernel timers and the scheduler's timer interrupt.
+//
+// With a local APIC the timer is one-shot: it is armed only for the next
+// pending kernel timer (end of the running task's time slice, a sleeping
+// task's deadline, a driver's poll) and left off when none is pending, so
+// an idle CPU is not woken 100 times a second. Without one the PIT keeps
+// ticking at 100 Hz and timers run at that resolution. Either way the
+// timers run on the boot CPU; other CPUs are sent an IPI when their time
+// slice ends.
+
+// Timer granularity: deadlines are rounded up to a multiple of this.
+#define TIMER_UNIT_NS 100000ULL
+
+// A kernel timer. fn runs once from the timer interrupt (interrupts off)
+// some time at or after the deadline; it may re-add its own timer.
+struct ktimer {
+    uint64_t expires;               // deadline, ns since timer_init
+    void (*fn)(struct ktimer *t);
+    struct ktimer *next;            // wheel slot list
+    struct ktimer *prev;
+    uint8_t level;                  // slot holding the timer while pending
+    uint8_t slot;
+    uint8_t pending;
+};
+
+// Calibrate the TSC (and the APIC timer) against the PIT and take over the
+// timer interrupt. Call once after idt_init, with interrupts off.
+void timer_init(void);
+
+// Nanoseconds since timer_init.
+uint64_t timer_now_ns(void);
+
+// Time in 10 ms ticks (SYS_TICKS).
+uint64_t timer_ticks(void);
+
+// Busy-wait for us microseconds. Works with interrupts off.
+void timer_delay_us(uint64_t us);
+
+// Kernel timers. Adding and cancelling are O(1) and safe from interrupt
+// handlers; adding a pending timer moves it to the new deadline.
+void ktimer_init(struct ktimer *t, void (*fn)(struct ktimer *t));
+void ktimer_add(struct ktimer *t, uint64_t expires_ns);
+// Returns 1 if the timer was pending, 0 if it had already run (or was
+// never added).
+int ktimer_cancel(struct ktimer *t);
+
+// Scheduler: whether another task is waiting for this CPU. While it is,
+// the running task is preempted (sched_resched_cpu) at the end of a 10 ms
+// slice.
+void timer_set_slice(int contended);
+
+// Body of the timer interrupt (PIT IRQ0 or LAPIC_TIMER_VECTOR): run the
+// expired kernel timers.
+void timer_interrupt(void);
+
+// From the IPI handler: another CPU added a timer due before the one armed.
+void timer_rearm(void);
+
+// Halt until the next interrupt; a reschedule IPI wakes an idle CPU.
+// Returns with interrupts enabled.
+void cpu_idle(void);
+
+#endif
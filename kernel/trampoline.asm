@@ -0,0 +1,88 @@
+; Application processor startup code.
+;
+; smp.c copies ap_trampoline..ap_trampoline_end to TRAMPOLINE_BASE (a page
+; below 1 MiB; the STARTUP IPI names it by page number) and fills in
+; ap_boot. Each AP starts here in real mode, goes through protected mode
+; into long mode on the kernel page tables, and calls entry(arg) on the
+; stack it was given. Code and data are addressed at their copy, so every
+; address goes through T().
+
+TRAMPOLINE_BASE equ 0x7000          ; must match smp.c
+
+%define T(x) (TRAMPOLINE_BASE + ((x) - ap_trampoline))
+
+section .text
+global ap_trampoline, ap_trampoline_end, ap_boot
+
+[BITS 16]
+ap_trampoline:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [T(tramp_gdt_ptr)]
+    mov eax, cr0
+    or eax, 1                       ; PE
+    mov cr0, eax
+    jmp dword 0x08:T(ap_protected)
+
+[BITS 32]
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, 1 << 5                  ; PAE
+    mov cr4, eax
+    mov eax, [T(ap_boot_cr3)]
+    mov cr3, eax
+
+    mov ecx, 0xC0000080             ; EFER.LME
+    rdmsr
+    or eax, 1 << 8
+    wrmsr
+
+    mov eax, cr0
+    or eax, 1 << 31                 ; PG
+    mov cr0, eax
+    jmp 0x18:T(ap_long)
+
+[BITS 64]
+ap_long:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov rsp, [T(ap_boot_stack)]
+    mov rdi, [T(ap_boot_arg)]
+    mov rax, [T(ap_boot_entry)]
+    call rax
+.halt:
+    hlt
+    jmp .halt
+
+; Flat 32-bit code and data, and 64-bit code, until the AP loads its own GDT
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF           ; 0x08: 32-bit code
+    dq 0x00CF92000000FFFF           ; 0x10: data
+    dq 0x00AF9A000000FFFF           ; 0x18: 64-bit code
+tramp_gdt_ptr:
+    dw tramp_gdt_ptr - tramp_gdt - 1
+    dd T(tramp_gdt)
+
+; struct ap_boot_params in smp.c
+align 8
+ap_boot:
+ap_boot_cr3:    dq 0
+ap_boot_stack:  dq 0
+ap_boot_entry:  dq 0
+ap_boot_arg:    dq 0
+ap_trampoline_end:
@@ -0,0 +1,224 @@
+#include "vma.h"
+#include "paging.h"
+#include "pmm.h"
+#include "klib.h"
+#include "pagecache.h"
+#include "fs/vfs.h"
+#include "kmalloc.h"
+
+// Areas come from a slab cache; a task typically needs three or four
+// (text/data, bss, stack, backbuffer). The cap is per task, so one
+// process mapping piece after piece cannot starve the others.
+#define VMA_MAX_PER_TASK 256
+
+static struct kmem_cache *vma_cache = 0;
+
+void vma_init(void) {
+    vma_cache = kmem_cache_create("vma", sizeof(struct vma), 0);
+}
+
+// A new area for list, or 0 if it is at its cap or memory is out.
+static struct vma *vma_alloc(struct vma *list) {
+    int n = 0;
+    for (struct vma *v = list; v; v = v->next) {
+        if (++n >= VMA_MAX_PER_TASK) return 0;
+    }
+    return vma_cache ? kmem_cache_alloc(vma_cache) : 0;
+}
+
+static void vma_release(struct vma *v) {
+    vfs_node_put(v->file);
+    kmem_cache_free(vma_cache, v);
+}
+
+struct vma *vma_add(struct vma **list, uint64_t start, uint64_t end, uint32_t flags) {
+    start &= ~0xFFFULL;
+    end = (end + 0xFFFULL) & ~0xFFFULL;
+    if (end <= start) return 0;
+    uint64_t limit = start;
+
+    // Absorb areas that overlap the new one, or touch it with equal flags.
+    struct vma **pp = list;
+    while (*pp) {
+        struct vma *v = *pp;
+        int overlap = v->start < end && v->end > start;
+        int touch = v->start <= end && v->end >= start;
+        if (overlap || (touch && v->flags == flags && !(flags & VMA_FILE))) {
+            if (v->start < start) start = v->start;
+            if (v->end > end) end = v->end;
+            if (v->limit < limit) limit = v->limit;
+            flags |= v->flags;
+            *pp = v->next;
+            vma_release(v);
+            continue;
+        }
+        pp = &v->next;
+    }
+
+    struct vma *v = vma_alloc(*list);
+    if (!v) return 0;
+    v->start = start;
+    v->end = end;
+    v->limit = limit < start ? limit : start;
+    v->flags = flags;
+    v->pgoff = 0;
+    v->file = 0;
+
+    pp = list;
+    while (*pp && (*pp)->start < start) pp = &(*pp)->next;
+    v->next = *pp;
+    *pp = v;
+    return v;
+}
+
+struct vma *vma_find(struct vma *list, uint64_t addr) {
+    for (struct vma *v = list; v; v = v->next) {
+        if (addr < v->start) return 0;
+        if (addr < v->end) return v;
+    }
+    return 0;
+}
+
+int vma_overlaps(struct vma *list, uint64_t start, uint64_t end) {
+    for (struct vma *v = list; v && v->start < end; v = v->next) {
+        if (v->end > start) return 1;
+    }
+    return 0;
+}
+
+uint64_t vma_find_gap(struct vma *list, uint64_t lo, uint64_t hi, uint64_t len, uint64_t align) {
+    uint64_t addr = (lo + align - 1) & ~(align - 1);
+    for (struct vma *v = list; v; v = v->next) {
+        if (v->end <= addr) continue;
+        if (addr + len <= v->limit) break;   // fits below this area's reach
+        addr = (v->end + align - 1) & ~(align - 1);
+    }
+    if (addr + len < addr || addr + len > hi) return 0;
+    return addr;
+}
+
+int vma_remove(struct vma **list, uint64_t start, uint64_t end) {
+    start &= ~0xFFFULL;
+    end = (end + 0xFFFULL) & ~0xFFFULL;
+
+    struct vma **pp = list;
+    while (*pp) {
+        struct vma *v = *pp;
+        if (v->end <= start || v->start >= end) {
+            pp = &v->next;
+            continue;
+        }
+        if (v->start < start && v->end > end) {
+            // Hole in the middle: the upper part becomes its own area.
+            struct vma *hi = vma_alloc(*list);
+            if (!hi) return -1;
+            *hi = *v;
+            vfs_node_get(hi->file);
+            hi->start = end;
+            hi->limit = end;
+            hi->pgoff += (uint32_t)((end - v->start) >> 12);
+            v->end = start;
+            v->flags &= ~VMA_GROWSDOWN;
+            hi->next = v->next;
+            v->next = hi;
+            return 0;
+        }
+        if (v->start < start) {
+            v->end = start;
+            v->flags &= ~VMA_GROWSDOWN;
+            pp = &v->next;
+        } else if (v->end > end) {
+            v->pgoff += (uint32_t)((end - v->start) >> 12);
+            v->start = end;
+            if (v->limit < end) v->limit = end;   // no regrowing into the hole
+            pp = &v->next;
+        } else {
+            *pp = v->next;
+            vma_release(v);
+        }
+    }
+    return 0;
+}
+
+int vma_fault(struct vma **list, uint64_t *pml4, uint64_t addr, int write) {
+    uint64_t page = addr & ~0xFFFULL;
+    struct vma *v = vma_find(*list, addr);
+
+    if (!v) {
+        // Below a stack area, within its growth limit, and not running into
+        // the area underneath: extend the stack down to this page.
+        struct vma *prev = 0;
+        for (v = *list; v && v->start <= addr; v = v->next) prev = v;
+        if (!v || !(v->flags & VMA_GROWSDOWN) || page < v->limit) return -1;
+        if (prev && prev->end > page) return -1;
+        v->start = page;
+    }
+
+    if (v->flags & VMA_SHARED) return -1;              // never lazy
+    if (write && !(v->flags & VMA_WRITE)) return -1;
+    if (paging_virt_to_phys(pml4, page)) return -1;  // present: not a lazy page
+
+    uint64_t pte_flags = PAGE_PRESENT | PAGE_USER;
+
+    if (v->flags & VMA_FILE) {
+        uint64_t index = v->pgoff + ((page - v->start) >> 12);
+        uint64_t frame = pcache_get(v->file, (uint32_t)index);
+        if (!frame) return -1;                     // past end of file
+        if (v->flags & VMA_WRITE) pte_flags |= PAGE_COW;
+        if (paging_map_user_page(pml4, page, frame, pte_flags) < 0) {
+            pmm_free_page((void *)frame);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (v->flags & VMA_WRITE) pte_flags |= PAGE_WRITABLE;
+
+    // Whole aligned 2 MiB stretch inside the area: one large page. Falls
+    // back to 4 KiB if memory is fragmented or part is already mapped.
+    uint64_t big = addr & ~0x1FFFFFULL;
+    if ((v->flags & VMA_LARGE) && big >= v->start && big + 0x200000 <= v->end) {
+        void *block = pmm_alloc_pages(PMM_MAX_ORDER);
+        if (block) {
+            memset(phys_to_virt((uint64_t)block), 0, 0x200000);
+            pmm_set_owner(block, PMM_OWNER_USER_ANON);
+            if (paging_map_large(pml4, big, (uint64_t)block, pte_flags | PAGE_USERALLOC) == 0) {
+                return 0;
+            }
+            pmm_free_pages(block, PMM_MAX_ORDER);
+        }
+    }
+
+    void *frame = pmm_alloc_zeroed_page();
+    if (!frame) return -1;
+    pmm_set_owner(frame, PMM_OWNER_USER_ANON);
+
+    if (paging_map_user_page(pml4, page, (uint64_t)frame, pte_flags) < 0) {
+        pmm_free_page(frame);
+        return -1;
+    }
+    return 0;
+}
+
+int vma_clone(struct vma **dst, struct vma *src) {
+    struct vma **tail = dst;
+    while (*tail) tail = &(*tail)->next;
+    for (; src; src = src->next) {
+        struct vma *v = vma_alloc(0);   // src is within the cap already
+        if (!v) return -1;
+        *v = *src;
+        vfs_node_get(v->file);
+        v->next = 0;
+        *tail = v;
+        tail = &v->next;
+    }
+    return 0;
+}
+
+void vma_free_all(struct vma **list) {
+    while (*list) {
+        struct vma *v = *list;
+        *list = v->next;
+        vma_release(v);
+    }
+}
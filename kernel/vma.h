@@ -0,0 +1,67 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+
+// Virtual memory areas: the user address ranges a task may touch.
+// Pages inside an area are allocated zero-filled on first access by the
+// page-fault handler instead of up front.
+
+#define VMA_WRITE      0x1   // writable by user code
+#define VMA_GROWSDOWN  0x2   // stack: faults just below start extend the area
+#define VMA_LARGE      0x4   // back aligned 2 MiB stretches with large pages
+#define VMA_SHARED     0x8   // shared-memory mapping, populated up front (shm_map)
+#define VMA_FILE       0x10  // pages come from file's page cache, never merged
+
+struct vfs_node;
+
+struct vma {
+    uint64_t start;          // page-aligned, inclusive
+    uint64_t end;            // page-aligned, exclusive
+    uint64_t limit;          // VMA_GROWSDOWN: lowest address start may reach
+    uint32_t flags;          // VMA_*
+    uint32_t pgoff;          // VMA_FILE: file page mapped at start
+    struct vfs_node *file;   // VMA_FILE: backing file, holds a reference
+    struct vma *next;        // next area, sorted by start
+};
+
+// Create the area cache. Call once after pmm_init.
+void vma_init(void);
+
+// Add [start, end) to a task's area list. Overlapping or touching areas are
+// merged. Returns the area, or 0 if the task has VMA_MAX_PER_TASK areas
+// already or memory is out.
+struct vma *vma_add(struct vma **list, uint64_t start, uint64_t end, uint32_t flags);
+
+// Area containing addr, or 0.
+struct vma *vma_find(struct vma *list, uint64_t addr);
+
+// Whether any area overlaps [start, end).
+int vma_overlaps(struct vma *list, uint64_t start, uint64_t end);
+
+// Lowest address in [lo, hi), aligned to align (a power of two), where len
+// bytes fit clear of every area and of the room stacks may grow into.
+// Returns 0 if there is none.
+uint64_t vma_find_gap(struct vma *list, uint64_t lo, uint64_t hi, uint64_t len, uint64_t align);
+
+// Remove [start, end) from the list, trimming areas that straddle an edge
+// and splitting one that spans the whole range. Mapped pages are left to
+// the caller (paging_unmap_range). Returns 0, or -1 if a split could not
+// get a new area.
+int vma_remove(struct vma **list, uint64_t start, uint64_t end);
+
+// Resolve a not-present fault at addr in the address space pml4: grow a
+// stack area if addr is just below it, then map a zeroed page. File areas
+// map the page-cache frame instead, read-only; a writable private area
+// maps it copy-on-write so the first store takes a private copy.
+// Returns 0 if a page was mapped, -1 if addr is not in any area (or the
+// access is not allowed, or memory is out).
+int vma_fault(struct vma **list, uint64_t *pml4, uint64_t addr, int write);
+
+// Duplicate an area list (for fork). Returns 0 or -1 if memory is out.
+int vma_clone(struct vma **dst, struct vma *src);
+
+// Release every area in the list.
+void vma_free_all(struct vma **list);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef X86_H
+#define X86_H
+
+#include <stdint.h>
+
+// Small wrappers around x86 instructions used across the kernel.
+
+// Disable interrupts on this CPU, returning the previous RFLAGS for
+// irq_restore. State shared between syscalls (which run with interrupts on
+// and may be preempted) and interrupt handlers or the idle task is changed
+// inside such a section. Sections nest.
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & 0x200) __asm__ volatile ("sti" : : : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// CPUID leaf with subleaf sub (ECX); pass 0 for leaves without subleaves.
+static inline void cpuid(uint32_t leaf, uint32_t sub, uint32_t *a, uint32_t *b,
+                         uint32_t *c, uint32_t *d) {
+    __asm__ volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+#endif
@@ -44,6 +44,15 @@
 #define SYS_FB_MAP    33  // fb_map() -> vaddr of user backbuffer
 #define SYS_FB_PRESENT 34 // fb_present(void *buf) -> 0
 #define SYS_FB_PRESENT_RECT 35 // fb_present_rect(void *buf, int x, int y, int w, int h) -> 0
+#define SYS_MEMINFO   36  // meminfo(struct meminfo *out) -> 0 or -1
+#define SYS_MMAP      37  // mmap(void *addr, unsigned long len, int prot, int flags, int fd) -> addr or MAP_FAILED
+#define SYS_MUNMAP    38  // munmap(void *addr, unsigned long len) -> 0 or -1
+#define SYS_BRK       39  // brk(void *addr) -> new break (current break on failure)
+#define SYS_SHM_CREATE 40 // shm_create(unsigned long size) -> fd or -1
+#define SYS_SLEEP     41  // sleep(unsigned long ms) -> 0 or -1
+#define SYS_NANOSLEEP 42  // nanosleep(unsigned long ns) -> 0 or -1
+#define SYS_SLEEP_UNTIL 43 // sleep_until(unsigned long deadline) -> 0 or -1
+#define SYS_CLOCK     44  // clock() -> ns since boot
 
 // signal numbers
 #define SIGKILL     9
@@ -72,6 +81,20 @@
 #define SEEK_CUR    1
 #define SEEK_END    2
 
+// ============================================================================
+// Memory Mapping (anonymous, private; zero-filled on first touch)
+// ============================================================================
+
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+#define MAP_SHARED    0x01  // map a shm_create() fd, shared with every mapper
+#define MAP_PRIVATE   0x02  // with a file fd: read it in place, copy-on-write
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_HUGE_2MB  0x40000  // 2 MiB-aligned and -granular, backed by large pages
+#define MAP_FAILED    ((void *)-1)
+
 // ============================================================================
 // Standard File Descriptors
 // ============================================================================
@@ -93,6 +116,34 @@ struct stat {
 #define S_IFREG     0x8000  // Regular file
 #define S_IFDIR     0x4000  // Directory
 
+// ============================================================================
+// Memory Statistics (for meminfo)
+// ============================================================================
+
+// Owner types indexing meminfo owner_pages[]
+#define MEMINFO_OWNER_FREE      0
+#define MEMINFO_OWNER_KERNEL    1
+#define MEMINFO_OWNER_PAGETABLE 2
+#define MEMINFO_OWNER_USER_ANON 3
+#define MEMINFO_OWNER_KSTACK    4
+#define MEMINFO_OWNER_DMA       5
+#define MEMINFO_OWNER_CACHE     6
+#define MEMINFO_OWNER_ZEROPOOL  7
+#define MEMINFO_OWNER_COUNT     8
+
+struct meminfo {
+    unsigned long total_pages;      // 4 KiB pages managed by the kernel
+    unsigned long free_pages;       // pages currently free
+    unsigned long zero_pool_pages;  // pre-zeroed pages ready for allocation
+    unsigned long zero_hits;        // zeroed-page requests served from the pool
+    unsigned long zero_misses;      // zeroed-page requests that zeroed inline
+    unsigned long owner_pages[MEMINFO_OWNER_COUNT];  // pages per MEMINFO_OWNER_* type
+    unsigned long cache_hits;       // file pages found in the page cache
+    unsigned long cache_misses;     // file pages read in from disk
+    unsigned long heap_pages;       // pages held by the kernel heap (kmalloc)
+    unsigned long heap_objects;     // kernel heap objects allocated
+};
+
 // ============================================================================
 // Directory Entry (for readdir)
 // ============================================================================
@@ -352,6 +403,27 @@ static inline unsigned long ticks(void) {
     return (unsigned long)syscall0(SYS_TICKS);
 }
 
+// Monotonic nanoseconds since boot; the timeline sleep_until() takes.
+static inline unsigned long clock(void) {
+    return (unsigned long)syscall0(SYS_CLOCK);
+}
+
+// Block for at least the given time (100 us granularity). Return 0, or -1
+// if a signal woke the task early.
+static inline int sleep(unsigned long ms) {
+    return (int)syscall1(SYS_SLEEP, (long)ms);
+}
+
+static inline int nanosleep(unsigned long ns) {
+    return (int)syscall1(SYS_NANOSLEEP, (long)ns);
+}
+
+// Block until clock() reaches deadline; periodic loops use this to avoid
+// drift: for (t = clock(); ; ) { t += period; sleep_until(t); ... }
+static inline int sleep_until(unsigned long deadline) {
+    return (int)syscall1(SYS_SLEEP_UNTIL, (long)deadline);
+}
+
 static inline long fb_map(void) {
     return syscall0(SYS_FB_MAP);
 }
@@ -364,4 +436,40 @@ static inline int fb_present_rect(void *buf, int x, int y, int w, int h) {
     return (int)syscall5(SYS_FB_PRESENT_RECT, (long)buf, x, y, w, h);
 }
 
+static inline int meminfo(struct meminfo *out) {
+    return (int)syscall1(SYS_MEMINFO, (long)out);
+}
+
+// fd is a shm_create() object for MAP_SHARED, or an open file for
+// MAP_PRIVATE (mapped from offset 0, pages past EOF fault); pass -1 with
+// MAP_ANONYMOUS.
+static inline void *mmap(void *addr, unsigned long len, int prot, int flags, int fd) {
+    return (void *)syscall5(SYS_MMAP, (long)addr, (long)len, prot, flags, fd);
+}
+
+static inline int munmap(void *addr, unsigned long len) {
+    return (int)syscall2(SYS_MUNMAP, (long)addr, (long)len);
+}
+
+// Create a zero-filled shared-memory object of size bytes. Map it with
+// mmap(0, size, prot, MAP_SHARED, fd); the fd survives fork and can be
+// handed to a spawned child, and the memory lives until every fd is closed
+// and every mapping is gone.
+static inline int shm_create(unsigned long size) {
+    return (int)syscall1(SYS_SHM_CREATE, (long)size);
+}
+
+// Set the program break; returns the new break, or the old one on failure.
+static inline void *brk(void *addr) {
+    return (void *)syscall1(SYS_BRK, (long)addr);
+}
+
+// Move the break by incr bytes; returns the previous break, or (void *)-1.
+static inline void *sbrk(long incr) {
+    char *old = (char *)brk(0);
+    if (incr == 0) return old;
+    if ((char *)brk(old + incr) != old + incr) return (void *)-1;
+    return old;
+}
+
 #endif // LIBSYS_H